@@ -99,6 +99,22 @@ call_handler_cb (pTHX_ SV *closure, UV n_args, ...)
 	LEAVE;
 }
 
+// Comparisons are made between dates if pat is a xsd:date or xsd:dateTime lexical form, and between numbers if pat is
+// entirely numeric. Returns NULL for any other value.
+static query_filter_t*
+comparison_filter(filter_type_t type, int64_t var, const char* pat) {
+	int64_t date;
+	char* end;
+	if (triplestore_parse_date(pat, &date) == 0) {
+		return triplestore_new_filter(type - FILTER_LT + FILTER_DATE_LT, var, date);
+	}
+	double d	= strtod(pat, &end);
+	if (end == pat || *end != '\0') {
+		return NULL;
+	}
+	return triplestore_new_filter(type, var, d);
+}
+
 static SV*
 rdf_term_to_object(triplestore_t* t, rdf_term_t* term) {
 	SV* object;
@@ -203,6 +219,44 @@ int64_t _triplestore_query_get_variable_id(query_t* query, const char* var) {
 	return v;
 }
 
+// Builds a path from its prefix serialization: an operator followed by its operands, where PATH_PREDICATE is followed
+// by a predicate ID and PATH_NEGATED by a count and that many predicate IDs.
+path_t* _triplestore_path_from_ops(triplestore_t* t, AV* ops, I32* pos) {
+	SV** sv	= av_fetch(ops, (*pos)++, 0);
+	if (!sv) {
+		return NULL;
+	}
+	path_type_t type	= (path_type_t) SvIV(*sv);
+	switch (type) {
+		case PATH_PREDICATE:
+			sv	= av_fetch(ops, (*pos)++, 0);
+			return sv ? triplestore_new_path_predicate(t, (nodeid_t) SvIV(*sv)) : NULL;
+		case PATH_NEGATED: {
+			sv	= av_fetch(ops, (*pos)++, 0);
+			uint32_t count	= sv ? (uint32_t) SvIV(*sv) : 0;
+			nodeid_t* preds	= calloc(1+count, sizeof(nodeid_t));
+			for (uint32_t i = 0; i < count; i++) {
+				sv	= av_fetch(ops, (*pos)++, 0);
+				if (!sv) {
+					free(preds);
+					return NULL;
+				}
+				preds[i]	= (nodeid_t) SvIV(*sv);
+			}
+			path_t* path	= triplestore_new_path_negated(t, preds, count);
+			free(preds);
+			return path;
+		}
+		case PATH_SEQUENCE:
+		case PATH_ALTERNATIVE: {
+			path_t* left	= _triplestore_path_from_ops(t, ops, pos);
+			path_t* right	= left ? _triplestore_path_from_ops(t, ops, pos) : NULL;
+			return triplestore_new_path_operator(t, type, left, right);
+		}
+		default:
+			return triplestore_new_path_operator(t, type, _triplestore_path_from_ops(t, ops, pos), NULL);
+	}
+}
 
 void
 handle_new_triple_object (triplestore_t* t, SV* closure, rdf_term_t* subject, rdf_term_t* predicate, rdf_term_t* object) {
@@ -268,8 +322,25 @@ BOOT:
 	EXPORT_FLAG(FILTER_CONTAINS);
 	EXPORT_FLAG(FILTER_STRSTARTS);
 	EXPORT_FLAG(FILTER_STRENDS);
+	EXPORT_FLAG(FILTER_IRIPREFIX);
+	EXPORT_FLAG(FILTER_LT);
+	EXPORT_FLAG(FILTER_LE);
+	EXPORT_FLAG(FILTER_GT);
+	EXPORT_FLAG(FILTER_GE);
+	EXPORT_FLAG(FILTER_EQ);
+	EXPORT_FLAG(FILTER_DATE_LT);
+	EXPORT_FLAG(FILTER_DATE_LE);
+	EXPORT_FLAG(FILTER_DATE_GT);
+	EXPORT_FLAG(FILTER_DATE_GE);
+	EXPORT_FLAG(FILTER_DATE_EQ);
 	EXPORT_FLAG(PATH_PLUS);
 	EXPORT_FLAG(PATH_STAR);
+	EXPORT_FLAG(PATH_ZERO_OR_ONE);
+	EXPORT_FLAG(PATH_PREDICATE);
+	EXPORT_FLAG(PATH_INVERSE);
+	EXPORT_FLAG(PATH_SEQUENCE);
+	EXPORT_FLAG(PATH_ALTERNATIVE);
+	EXPORT_FLAG(PATH_NEGATED);
 }
 
 int
@@ -298,6 +369,13 @@ triplestore_load(triplestore_t *store, char* filename, int verbose)
 int
 triplestore_size(triplestore_t *store)
 
+int
+triplestore__build_closure(triplestore_t *store, IV pred)
+	CODE:
+		RETVAL = triplestore_build_closure(store, (nodeid_t) pred);
+	OUTPUT:
+		RETVAL
+
 int
 triplestore__term_to_id1(triplestore_t *store, int type, char* value)
 	PREINIT:
@@ -334,6 +412,19 @@ triplestore__term_to_id3(triplestore_t *store, int type, char* value, int vid)
 	OUTPUT:
 		RETVAL
 
+SV*
+triplestore__term_string(triplestore_t *store, IV id)
+	PREINIT:
+		char* string;
+	CODE:
+		if (id <= 0 || id > store->nodes_used || !(string = triplestore_term_to_string(store, store->graph[id]._term))) {
+			XSRETURN_UNDEF;
+		}
+		RETVAL = newSVpv(string, 0);
+		free(string);
+	OUTPUT:
+		RETVAL
+
 void
 triplestore_DESTROY (triplestore_t *store)
 	CODE:
@@ -455,19 +546,33 @@ query__add_filter (query_t* query, triplestore_t* t, char* var_name, char* op, c
 			filter	= triplestore_new_filter(FILTER_ISLITERAL, var);
 		} else if (!strcmp(op, "isnumeric")) {
 			filter	= triplestore_new_filter(FILTER_ISNUMERIC, var);
-		} else if (!strcmp(op, "starts")) {
+		} else if (!strcmp(op, "starts") || !strcmp(op, "strstarts")) {
 			filter	= triplestore_new_filter(FILTER_STRSTARTS, var, pat, strlen(pat), type, lang, strlen(lang));
-		} else if (!strcmp(op, "ends")) {
+		} else if (!strcmp(op, "iriprefix")) {
+			filter	= triplestore_new_filter(FILTER_IRIPREFIX, var, pat, strlen(pat));
+		} else if (!strcmp(op, "langmatches")) {
+			filter	= triplestore_new_filter(FILTER_LANGMATCHES, var, pat, strlen(pat));
+		} else if (!strcmp(op, "ends") || !strcmp(op, "strends")) {
 			filter	= triplestore_new_filter(FILTER_STRENDS, var, pat, strlen(pat), type, lang, strlen(lang));
 		} else if (!strcmp(op, "contains")) {
 			filter	= triplestore_new_filter(FILTER_CONTAINS, var, pat, strlen(pat), type, lang, strlen(lang));
+		} else if (!strcmp(op, "<") || !strcmp(op, "lt")) {
+			filter	= comparison_filter(FILTER_LT, var, pat);
+		} else if (!strcmp(op, "<=") || !strcmp(op, "le")) {
+			filter	= comparison_filter(FILTER_LE, var, pat);
+		} else if (!strcmp(op, ">") || !strcmp(op, "gt")) {
+			filter	= comparison_filter(FILTER_GT, var, pat);
+		} else if (!strcmp(op, ">=") || !strcmp(op, "ge")) {
+			filter	= comparison_filter(FILTER_GE, var, pat);
+		} else if (!strcmp(op, "=") || !strcmp(op, "eq")) {
+			filter	= comparison_filter(FILTER_EQ, var, pat);
 		} else if (!strncmp(op, "re", 2)) {
 			filter	= triplestore_new_filter(FILTER_REGEX, var, pat, strlen(pat), flags, strlen(flags));
 		} else {
 			RETVAL = 1;
 			return;
 		}
-		RETVAL = triplestore_query_add_op(query, QUERY_FILTER, filter);
+		RETVAL = filter ? triplestore_query_add_op(query, QUERY_FILTER, filter) : 1;
 	OUTPUT:
 		RETVAL	
 
@@ -517,30 +622,25 @@ query__add_sort (query_t* query, triplestore_t* t, AV* names, int unique)
 	OUTPUT:
 		RETVAL	
 
-void
-query__add_path (query_t* query, triplestore_t* t, IV path_type, IV variables, AV* ids, AV* names)
+int
+query__add_path (query_t* query, triplestore_t* t, IV start, IV end, AV* ops)
 	INIT:
-		int i;
-		SV **svs, **svp, **svo;
-		char* ptr;
 		path_t* path;
-		IV iv;
+		I32 pos;
 	CODE:
-		for (i = 1; i <= variables; i++) {
-			svp	= av_fetch(names, i, 0);
-			ptr = SvPV_nolen(*svp);
-			triplestore_ensure_variable_capacity(query, i);
-			triplestore_query_set_variable_name(query, i, ptr);
+		pos		= 0;
+		path	= _triplestore_path_from_ops(t, ops, &pos);
+		if (!path || pos != av_len(ops)+1) {
+			if (path) {
+				triplestore_free_path(path);
+			}
+			RETVAL = 1;
+		} else {
+			triplestore_path_set_endpoints(path, (int64_t) start, (int64_t) end);
+			RETVAL = triplestore_query_add_op(query, QUERY_PATH, path);
 		}
-		svs			= av_fetch(ids, 0, 0);
-		svp			= av_fetch(ids, 1, 0);
-		svo			= av_fetch(ids, 2, 0);
-		int64_t s	= (int64_t) SvIV(*svs);
-		int64_t p	= (int64_t) SvIV(*svp);
-		int64_t o	= (int64_t) SvIV(*svo);
-		
-		path		= triplestore_new_path(t, (path_type_t) path_type, s, (nodeid_t) p, o);		
-		triplestore_query_add_op(query, QUERY_PATH, path);
+	OUTPUT:
+		RETVAL
 
 void
 query__add_bgp (query_t* query, triplestore_t* t, IV triples, IV variables, AV* ids, AV* names)
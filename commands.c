@@ -6,6 +6,8 @@ void help(FILE* f) {
 	fprintf(f, "  (un)set print\n");
 	fprintf(f, "  (un)set verbose\n");
 	fprintf(f, "  (un)set limit LIMIT\n");
+	fprintf(f, "  (un)set threads THREADS\n");
+	fprintf(f, "  (un)set ordered\n");
 	fprintf(f, "  match PATTERN\n");
 	fprintf(f, "  ntriples\n");
 	fprintf(f, "  data\n");
@@ -13,8 +15,13 @@ void help(FILE* f) {
 	fprintf(f, "  edges\n");
 	fprintf(f, "  bgp S1 P1 O1 S2 P2 O2 ...\n");
 	fprintf(f, "  triple S P O\n");
+	fprintf(f, "  path S PATH O\n");
+	fprintf(f, "  closure P\n");
 	fprintf(f, "  filter starts|ends|contains VAR STRING S1 P1 O1 S2 P2 O2 ...\n");
+	fprintf(f, "  filter iriprefix VAR IRI S1 P1 O1 S2 P2 O2 ...\n");
+	fprintf(f, "  filter langmatches VAR RANGE S1 P1 O1 S2 P2 O2 ...\n");
 	fprintf(f, "  filter re VAR PATTERN FLAGS S1 P1 O1 S2 P2 O2 ...\n");
+	fprintf(f, "  filter lt|le|gt|ge|eq VAR NUMBER|DATE S1 P1 O1 S2 P2 O2 ...\n");
 	fprintf(f, "  agg GROUPVAR COUNT VAR S1 P1 O1 S2 P2 O2 ...\n");
 	fprintf(f, "\n");
 }
@@ -116,6 +123,7 @@ int triplestore_match_terms(triplestore_t* t, const char* pattern, int64_t limit
 		printf("PCRE compilation failed at offset %d: %s\n", erroffset, error);
 		exit(1);
 	}
+	pcre_extra* extra	= triplestore_study_regex("match", re);
 
 	int64_t count	= 0;
 	for (nodeid_t s = 1; s < t->nodes_used; s++) {
@@ -125,7 +133,7 @@ int triplestore_match_terms(triplestore_t* t, const char* pattern, int64_t limit
 		int ovector[OVECCOUNT];
 		int rc = pcre_exec(
 			re,							/* the compiled pattern */
-			NULL,						/* no extra data - we didn't study the pattern */
+			extra,						/* study data (JIT code) */
 			string,						/* the subject string */
 			(int) strlen(string),		/* the length of the subject */
 			0,							/* start at offset 0 in the subject */
@@ -160,11 +168,24 @@ int triplestore_match_terms(triplestore_t* t, const char* pattern, int64_t limit
 			break;
 		}
 	}
+	triplestore_free_regex_study(extra);
 	pcre_free(re);     /* Release memory used for the compiled pattern */
 	return 0;
 }
 
+// Applies the context's parallel evaluation settings to query.
+static void _triplestore_prepare_query(query_t* query, struct command_ctx_s* ctx) {
+	triplestore_query_set_pool(query, ctx->pool);
+	triplestore_query_set_ordered(query, ctx->ordered);
+}
+
 static int _triplestore_run_query(triplestore_t* t, query_t* query, struct command_ctx_s* ctx) {
+	return triplestore_run_bound_query(t, query, NULL, ctx);
+}
+
+// Runs query (which is not freed) as the END of a BEGIN block would, with the variables that are non-zero in bindings
+// already bound (see triplestore_query_match_bound).
+int triplestore_run_bound_query(triplestore_t* t, query_t* query, const binding_t* bindings, struct command_ctx_s* ctx) {
 	if (ctx->verbose) {
 		fprintf(stderr, "Matching Query:\n");
 		triplestore_print_query(t, query, stderr);
@@ -176,15 +197,20 @@ static int _triplestore_run_query(triplestore_t* t, query_t* query, struct comma
 	
 	double start	= triplestore_current_time();
 	__block int count	= 0;
-	triplestore_query_match(t, query, -1, ^(binding_t* final_match){
+	_triplestore_prepare_query(query, ctx);
+	double planned	= triplestore_current_time();
+	triplestore_query_match_bound(t, query, bindings, -1, ^(binding_t* final_match){
 		count++;
 		if (ctx->result_block) {
 			ctx->result_block(query, final_match);
 		}
 		return 0;
 	});
+	double matched	= triplestore_current_time();
+	ctx->plan_time	+= planned - start;
+	ctx->match_time	+= matched - planned;
 	if (ctx->verbose) {
-		double elapsed	= triplestore_elapsed_time(start);
+		double elapsed	= matched - start;
 		fprintf(stderr, "%lfs elapsed during matching of %"PRIu32" results\n", elapsed, count);
 	}
 	return 0;
@@ -297,6 +323,117 @@ query_t* construct_bgp_query(triplestore_t* t, struct command_ctx_s* ctx, int ar
 
 #pragma mark -
 
+#define PATH_MAX_NEGATED	64
+
+static path_t* _parse_path_alternative(triplestore_t* t, const char** s);
+
+static path_t* _parse_path_primary(triplestore_t* t, const char** s) {
+	char* end;
+	if (**s == '(') {
+		(*s)++;
+		path_t* path	= _parse_path_alternative(t, s);
+		if (!path) {
+			return NULL;
+		} else if (**s != ')') {
+			triplestore_free_path(path);
+			return NULL;
+		}
+		(*s)++;
+		return path;
+	} else if (**s == '!') {
+		(*s)++;
+		int group		= (**s == '(');
+		nodeid_t preds[PATH_MAX_NEGATED];
+		uint32_t count	= 0;
+		if (group) {
+			(*s)++;
+		}
+		while (1) {
+			if (!isdigit(**s) || count == PATH_MAX_NEGATED) {
+				return NULL;
+			}
+			preds[count++]	= (nodeid_t) strtoul(*s, &end, 10);
+			*s				= end;
+			if (!group || **s != '|') {
+				break;
+			}
+			(*s)++;
+		}
+		if (group) {
+			if (**s != ')') {
+				return NULL;
+			}
+			(*s)++;
+		}
+		return triplestore_new_path_negated(t, preds, count);
+	} else if (isdigit(**s)) {
+		nodeid_t pred	= (nodeid_t) strtoul(*s, &end, 10);
+		*s				= end;
+		return triplestore_new_path_predicate(t, pred);
+	}
+	return NULL;
+}
+
+static path_t* _parse_path_element(triplestore_t* t, const char** s) {
+	if (**s == '^') {
+		(*s)++;
+		path_t* path	= _parse_path_element(t, s);
+		return path ? triplestore_new_path_operator(t, PATH_INVERSE, path, NULL) : NULL;
+	}
+	path_t* path	= _parse_path_primary(t, s);
+	while (path && (**s == '+' || **s == '*' || **s == '?')) {
+		path_type_t type	= (**s == '+') ? PATH_PLUS : (**s == '*') ? PATH_STAR : PATH_ZERO_OR_ONE;
+		path				= triplestore_new_path_operator(t, type, path, NULL);
+		(*s)++;
+	}
+	return path;
+}
+
+static path_t* _parse_path_sequence(triplestore_t* t, const char** s) {
+	path_t* path	= _parse_path_element(t, s);
+	while (path && **s == '/') {
+		(*s)++;
+		path_t* right	= _parse_path_element(t, s);
+		if (!right) {
+			triplestore_free_path(path);
+			return NULL;
+		}
+		path	= triplestore_new_path_operator(t, PATH_SEQUENCE, path, right);
+	}
+	return path;
+}
+
+static path_t* _parse_path_alternative(triplestore_t* t, const char** s) {
+	path_t* path	= _parse_path_sequence(t, s);
+	while (path && **s == '|') {
+		(*s)++;
+		path_t* right	= _parse_path_sequence(t, s);
+		if (!right) {
+			triplestore_free_path(path);
+			return NULL;
+		}
+		path	= triplestore_new_path_operator(t, PATH_ALTERNATIVE, path, right);
+	}
+	return path;
+}
+
+// Parses a SPARQL-like property path over predicate IDs (e.g. "12/^13", "(12|14)*", "!(12|13)"). For compatibility,
+// a path consisting of just a predicate ID means one or more of that predicate.
+static path_t* _parse_path(triplestore_t* t, const char* string) {
+	const char* s	= string;
+	path_t* path	= _parse_path_alternative(t, &s);
+	if (path && *s != '\0') {
+		triplestore_free_path(path);
+		return NULL;
+	}
+	if (path && path->type == PATH_PREDICATE) {
+		path	= triplestore_new_path_operator(t, PATH_PLUS, path, NULL);
+	}
+	return path;
+}
+
+#pragma mark -
+
 static int _parse_term(const char* ts, int escape, rdf_term_type_t* type, const char** value, size_t* value_len, int* needs_free, const char** datatype, size_t* datatype_len, const char** language, size_t* language_len) {
 	// TODO: unescape newlines in *value
 	if (ts[0] == '<') {
@@ -428,6 +565,26 @@ static int _parse_term(const char* ts, int escape, rdf_term_type_t* type, const
 	}
 }
 
+// Returns the ID of a parsed IRI or literal (0 if the store doesn't have it), or -1 for any other kind of term.
+static int64_t _parsed_term_id(triplestore_t* t, rdf_term_type_t type, const char* value, size_t value_len, const char* datatype, size_t datatype_len, const char* language, size_t language_len) {
+	if (type == TERM_IRI) {
+		rdf_term_t* term = triplestore_new_term_n(t, TERM_IRI, value, value_len, NULL, 0, 0);
+		return triplestore_get_termid(t, term);
+	} else if (type == TERM_TYPED_LITERAL) {
+		rdf_term_t* dtterm = triplestore_new_term_n(t, TERM_IRI, datatype, datatype_len, NULL, 0, 0);
+		int64_t dtid = triplestore_get_termid(t, dtterm);
+		rdf_term_t* term = triplestore_new_term_n(t, TERM_TYPED_LITERAL, value, value_len, NULL, 0, (nodeid_t) dtid);
+		return triplestore_get_termid(t, term);
+	} else if (type == TERM_LANG_LITERAL) {
+		rdf_term_t* term = triplestore_new_term_n(t, TERM_LANG_LITERAL, value, value_len, language, language_len, 0);
+		return triplestore_get_termid(t, term);
+	} else if (type == TERM_XSDSTRING_LITERAL) {
+		rdf_term_t* term = triplestore_new_term_n(t, TERM_XSDSTRING_LITERAL, value, value_len, NULL, 0, 0);
+		return triplestore_get_termid(t, term);
+	}
+	return -1;
+}
+
 int64_t query_node_id(triplestore_t* t, struct command_ctx_s* ctx, query_t* query, const char* ts) {
 	const char *value, *datatype, *language;
 	size_t value_len, language_len, datatype_len;
@@ -441,27 +598,12 @@ int64_t query_node_id(triplestore_t* t, struct command_ctx_s* ctx, query_t* quer
 	}
 	
 	int64_t id	= 0;
-	if (type == TERM_IRI) {
-		rdf_term_t* term = triplestore_new_term_n(t, TERM_IRI, value, value_len, NULL, 0, 0);
-		id = triplestore_get_termid(t, term);
-	} else if (type == TERM_TYPED_LITERAL) {
-		rdf_term_t* dtterm = triplestore_new_term_n(t, TERM_IRI, datatype, datatype_len, NULL, 0, 0);
-		int64_t dtid = triplestore_get_termid(t, dtterm);
-		rdf_term_t* term = triplestore_new_term_n(t, TERM_TYPED_LITERAL, value, value_len, NULL, 0, (nodeid_t) dtid);
-		id = triplestore_get_termid(t, term);
-		free_rdf_term(dtterm);
-	} else if (type == TERM_LANG_LITERAL) {
-		rdf_term_t* term = triplestore_new_term_n(t, TERM_LANG_LITERAL, value, value_len, language, language_len, 0);
-		id = triplestore_get_termid(t, term);
-	} else if (type == TERM_XSDSTRING_LITERAL) {
-		rdf_term_t* term = triplestore_new_term_n(t, TERM_XSDSTRING_LITERAL, value, value_len, NULL, 0, 0);
-		id = triplestore_get_termid(t, term);
-	} else if (type == TERM_VARIABLE) {
+	if (type == TERM_VARIABLE) {
 		id	= triplestore_query_get_variable_id_n(query, value, value_len);
 		if (id == 0) {
 			id	= triplestore_query_add_variable_n(query, value, value_len);
 		}
-	} else {
+	} else if ((id = _parsed_term_id(t, type, value, value_len, datatype, datatype_len, language, language_len)) < 0) {
 		fprintf(stderr, "*** Unrecognized term string: %s\n", ts);
 		if (value_needs_free) {
 			free((char*) value);
@@ -480,6 +622,29 @@ int64_t query_node_id(triplestore_t* t, struct command_ctx_s* ctx, query_t* quer
 	return id;
 }
 
+// Sets *id to the ID of an IRI or literal term string, or to 0 if the store doesn't have the term (which isn't an
+// error). Returns 1 if the string isn't an IRI or literal.
+int query_term_id(triplestore_t* t, const char* ts, nodeid_t* id) {
+	const char *value, *datatype, *language;
+	size_t value_len, language_len, datatype_len;
+	rdf_term_type_t type;
+	int value_needs_free;
+	static const int escape	= 1;
+	if (_parse_term(ts, escape, &type, &value, &value_len, &value_needs_free, &datatype, &datatype_len, &language, &language_len)) {
+		return 1;
+	}
+	
+	int64_t termid	= _parsed_term_id(t, type, value, value_len, datatype, datatype_len, language, language_len);
+	if (value_needs_free) {
+		free((char*) value);
+	}
+	if (termid < 0) {
+		return 1;
+	}
+	*id	= (nodeid_t) termid;
+	return 0;
+}
+
 int64_t triplestore_query_get_variable_id_n(query_t* query, const char* var, size_t len) {
 	int64_t v	= 0;
 	char* p		= (char*) var;
@@ -503,7 +668,20 @@ int64_t triplestore_query_get_variable_id(query_t* query, const char* var) {
 	return triplestore_query_get_variable_id_n(query, var, strlen(var));
 }
 
+static int _triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char** argv);
+
+// Runs a command. The commands of a BEGIN block other than its END build the query (resolving its terms and adding its
+// operators), so the time spent on them is counted as planning.
 int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char** argv) {
+	double start	= triplestore_current_time();
+	int r			= _triplestore_op(t, ctx, argc, argv);
+	if (ctx->constructing) {
+		ctx->plan_time	+= triplestore_current_time() - start;
+	}
+	return r;
+}
+
+static int _triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char** argv) {
 	if (argc == 0) {
 		ctx->set_error(-1, "No arguments given");
 		return 1;
@@ -544,6 +722,8 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 			ctx->print	= 1;
 		} else if (!strcmp(field, "verbose")) {
 			ctx->verbose	= 1;
+		} else if (!strcmp(field, "ordered")) {
+			ctx->ordered	= 1;
 		} else if (!strcmp(field, "limit")) {
 			if (argc < (i + 1 + 1)) {
 				ctx->set_error(-1, "Insufficient arguments passed to LIMIT");
@@ -559,6 +739,20 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 
 			ctx->language	= calloc(1, 1+strlen(argv[i+1]));
 			strcpy(ctx->language, argv[++i]);
+		} else if (!strcmp(field, "threads")) {
+			if (argc < (i + 1 + 1)) {
+				ctx->set_error(-1, "Insufficient arguments passed to THREADS");
+				return 1;
+			}
+			
+			if (ctx->pool) {
+				triplestore_free_pool(ctx->pool);
+			}
+			ctx->pool	= triplestore_new_pool(atoi(argv[++i]));
+			if (!ctx->pool) {
+				ctx->set_error(-1, "Failed to start worker threads");
+				return 1;
+			}
 		}
 	} else if (!strcmp(op, "unset")) {
 		if (ctx->sandbox) {
@@ -575,8 +769,15 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 			ctx->print	= 0;
 		} else if (!strcmp(field, "verbose")) {
 			ctx->verbose	= 0;
+		} else if (!strcmp(field, "ordered")) {
+			ctx->ordered	= 0;
 		} else if (!strcmp(field, "limit")) {
 			ctx->limit	= -1;
+		} else if (!strcmp(field, "threads")) {
+			if (ctx->pool) {
+				triplestore_free_pool(ctx->pool);
+				ctx->pool	= NULL;
+			}
 		}
 	} else if (!strcmp(op, "size")) {
 		uint32_t count	= triplestore_size(t);
@@ -638,8 +839,12 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 		int64_t var	= -1;
 		const char* ss	= argv[++i];
 // 		int64_t s	= atoi(argv[++i]);
-		int64_t p	= atoi(argv[++i]);
+		path_t* path	= _parse_path(t, argv[++i]);
 		const char* os	= argv[++i];
+		if (!path) {
+			ctx->set_error(-1, "Invalid property path in PATH");
+			return 1;
+		}
 // 		int64_t o	= atoi(argv[++i]);
 
 		query_t* query;
@@ -665,7 +870,7 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 			triplestore_query_set_variable_name(query, -((nodeid_t)o), os);
 		}
 
-		path_t* path	= triplestore_new_path(t, PATH_PLUS, s, (nodeid_t) p, o);
+		triplestore_path_set_endpoints(path, s, o);
 		triplestore_query_add_op(query, QUERY_PATH, path);
 		if (ctx->constructing) {
 			ctx->query	= query;
@@ -811,7 +1016,10 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 				return 1;
 			}
 			
-			if (type < TERM_XSDSTRING_LITERAL || type > TERM_TYPED_LITERAL) {
+			int iriprefix	= !strcmp(op, "iriprefix");
+			if (iriprefix && type == TERM_IRI) {
+				// IRIPREFIX accepts either an IRI or a plain string as the prefix
+			} else if (type < TERM_XSDSTRING_LITERAL || type > TERM_TYPED_LITERAL) {
 				ctx->set_error(-1, "Non-literal value passed to FILTER");
 				if (value_needs_free) {
 					free((char*) value);
@@ -827,8 +1035,60 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 			fprintf(stderr, "Term datatype: %s\n", datatype);
 			fprintf(stderr, "--------\n");
 			
+			filter_type_t ntype	= 0;
+			if (!strcmp(op, "lt")) {
+				ntype	= FILTER_LT;
+			} else if (!strcmp(op, "le")) {
+				ntype	= FILTER_LE;
+			} else if (!strcmp(op, "gt")) {
+				ntype	= FILTER_GT;
+			} else if (!strcmp(op, "ge")) {
+				ntype	= FILTER_GE;
+			} else if (!strcmp(op, "eq")) {
+				ntype	= FILTER_EQ;
+			}
+			
 			if (!strncmp(op, "re", 2)) {
 				filter	= triplestore_new_filter(FILTER_REGEX, var, value, strlen(value), "i", 1);
+			} else if (ntype) {
+				char* number	= calloc(1, 1+value_len);
+				strncpy(number, value, value_len);
+				if (value_needs_free) {
+					free((char*) value);
+				}
+				
+				// xsd:date and xsd:dateTime values are compared as dates, anything else as a number
+				int is_date	= (datatype && (!strncmp(datatype, "http://www.w3.org/2001/XMLSchema#date>", datatype_len) || !strncmp(datatype, "http://www.w3.org/2001/XMLSchema#dateTime>", datatype_len)));
+				if (is_date) {
+					int64_t date;
+					int bad	= triplestore_parse_date(number, &date);
+					free(number);
+					if (bad) {
+						ctx->set_error(-1, "Invalid date value passed to FILTER");
+						return 1;
+					}
+					filter	= triplestore_new_filter(ntype - FILTER_LT + FILTER_DATE_LT, var, date);
+				} else {
+					char* end;
+					double d	= strtod(number, &end);
+					int bad		= (end == number || *end != '\0');
+					free(number);
+					if (bad) {
+						ctx->set_error(-1, "Non-numeric value passed to FILTER");
+						return 1;
+					}
+					filter	= triplestore_new_filter(ntype, var, d);
+				}
+			} else if (iriprefix) {
+				filter	= triplestore_new_filter(FILTER_IRIPREFIX, var, value, value_len);
+				if (value_needs_free) {
+					free((char*) value);
+				}
+			} else if (!strcmp(op, "langmatches")) {
+				filter	= triplestore_new_filter(FILTER_LANGMATCHES, var, value, value_len);
+				if (value_needs_free) {
+					free((char*) value);
+				}
 			} else {
 				filter_type_t ftype;
 				if (!strcmp(op, "starts")) {
@@ -909,6 +1169,21 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 			double elapsed	= triplestore_elapsed_time(start);
 			fprintf(stderr, "dumped %"PRIu32" triples in %lfs (%5.1f triples/second)\n", count, elapsed, ((double)count/elapsed));
 		}
+	} else if (!strcmp(op, "closure")) {
+		if (ctx->sandbox) {
+			ctx->set_error(-1, "Building CLOSUREs not allowed");
+			return 1;
+		}
+		nodeid_t p		= (nodeid_t) atoi(argv[++i]);
+		double start	= triplestore_current_time();
+		if (triplestore_build_closure(t, p)) {
+			ctx->set_error(-1, "Failed to build CLOSURE");
+			return 1;
+		}
+		if (ctx->verbose) {
+			double elapsed	= triplestore_elapsed_time(start);
+			fprintf(stderr, "built closure of predicate %"PRIu32" in %lfs\n", p, elapsed);
+		}
 	} else if (!strcmp(op, "import")) {
 		if (ctx->sandbox) {
 			ctx->set_error(-1, "IMPORTing of data not allowed");
@@ -970,6 +1245,7 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 		
 		table_t* table	= triplestore_new_table(triplestore_query_get_max_variables(query));
 		double start	= triplestore_current_time();
+		_triplestore_prepare_query(query, ctx);
 		triplestore_query_match(t, query, -1, ^(binding_t* final_match){
 			triplestore_table_add_row(table, final_match);
 			return 0;
@@ -1020,6 +1296,7 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 		}
 		double start	= triplestore_current_time();
 		__block int count	= 0;
+		_triplestore_prepare_query(query, ctx);
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunused-parameter"
 		triplestore_query_match(t, query, -1, ^(binding_t* final_match){
@@ -1067,6 +1344,7 @@ int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char**
 			fprintf(stderr, "Unrecognized aggregate operation. Assuming count.\n");
 		}
 		uint32_t* counts	= calloc(sizeof(uint32_t), 1+t->nodes_used);
+		_triplestore_prepare_query(query, ctx);
 		triplestore_query_match(t, query, -1, ^(binding_t* final_match){
 			nodeid_t group	= 0;
 			if (groupvar != 0) {
@@ -20,6 +20,10 @@ struct command_ctx_s {
 	query_t* query;
 	int constructing;
 	char* language;
+	triplestore_pool_t* pool;
+	int ordered;
+	double plan_time;		// seconds spent building queries (see triplestore_op) and preparing them to be matched
+	double match_time;		// seconds spent matching queries (including the result block)
 	void (^set_error)(int code, const char* message);
 	void (^custom_output)(const char* message);
 	void(^result_block)(query_t* query, binding_t* final_match);
@@ -28,7 +32,9 @@ struct command_ctx_s {
 
 void help(FILE* f);
 int64_t query_node_id(triplestore_t* t, struct command_ctx_s* ctx, query_t* query, const char* ts);
+int query_term_id(triplestore_t* t, const char* ts, nodeid_t* id);
 int64_t triplestore_query_get_variable_id_n(query_t* query, const char* var, size_t len);
 int64_t triplestore_query_get_variable_id(query_t* query, const char* var);
 int triplestore_op(triplestore_t* t, struct command_ctx_s* ctx, int argc, char** argv);
+int triplestore_run_bound_query(triplestore_t* t, query_t* query, const binding_t* bindings, struct command_ctx_s* ctx);
 int triplestore_vop(triplestore_t* t, struct command_ctx_s* ctx, int argc, ...);
@@ -92,6 +92,24 @@ Parse the RDF in C<< $filename >> and add the resulting triples to this store.
 		return $self->size;
 	}
 	
+=item C<< build_closure ( $predicate ) >>
+
+Materializes the transitive closure of the L<Attean::API::IRI> C<< $predicate >>
+so that C<< ZeroOrMore >> and C<< OneOrMore >> paths over it are answered
+without searching the graph. The closure is saved in database dumps (and
+restored when constructing a store with C<< database >>), and is ignored once
+more triples are added.
+
+=cut
+
+	sub build_closure {
+		my $self	= shift;
+		my $pred	= shift;
+		my $id		= $self->_id_from_term($pred);
+		die "Predicate does not exist in the store: " . $pred->as_string unless ($id);
+		return !$self->_build_closure($id);
+	}
+	
 =item C<< get_triples ( $subject, $predicate, $object ) >>
 
 Returns an iterator object of all L<Attean::API::Triple> objects matching the
@@ -257,16 +275,8 @@ Otherwise, returns an empty list.
 			my ($lhs, $rhs)	= @{ $algebra->children };
 			if ($rhs->isa('Attean::Algebra::Path')) {
 				if (my $query = $self->_query_for_plannable_algebra($lhs)) {
-					my $path	= $rhs->path;
-					if ($path->isa('Attean::Algebra::OneOrMorePath')) {
-						my @children	= @{ $path->children };
-						if (scalar(@children) == 1) {
-							my ($p)	= @children;
-							if ($p->isa('Attean::Algebra::PredicatePath')) {
-								$query->add_path('+', $rhs->subject, $p->predicate, $rhs->object);
-								return $query;
-							}
-						}
+					if ($query->add_path($rhs->subject, $rhs->path, $rhs->object)) {
+						return $query;
 					}
 				}
 			}
@@ -276,17 +286,9 @@ Otherwise, returns an empty list.
 			$query->add_bgp(@triples);
 			return $query;
 		} elsif ($algebra->isa('Attean::Algebra::Path')) {
-			my $path	= $algebra->path;
-			if ($path->isa('Attean::Algebra::OneOrMorePath')) {
-				my @children	= @{ $path->children };
-				if (scalar(@children) == 1) {
-					my ($p)	= @children;
-					if ($p->isa('Attean::Algebra::PredicatePath')) {
-						my $query	= AtteanX::Store::MemoryTripleStore::Query->new(store => $self);
-						$query->add_path('+', $algebra->subject, $p->predicate, $algebra->object);
-						return $query;
-					}
-				}
+			my $query	= AtteanX::Store::MemoryTripleStore::Query->new(store => $self);
+			if ($query->add_path($algebra->subject, $algebra->path, $algebra->object)) {
+				return $query;
 			}
 			return;
 		} else {
@@ -311,6 +313,11 @@ Otherwise, returns an empty list.
 						my $op		= lc($expr->operator);
 						$query->add_filter($var->value, $op);
 						return $query;
+					} elsif ($s =~ /^LANGMATCHES\(LANG\([?]\w+\), "[^"]+"\)$/) {
+						my $var		= $expr->children->[0]->children->[0]->value;
+						my $range	= $expr->children->[1]->value;
+						$query->add_filter($var->value, 'langmatches', $range->value);
+						return $query;
 					} elsif ($s =~ /^(?:CONTAINS|STRSTARTS|STRENDS)\([?]\w+, "[^"]+"\)$/) {
 						my $op		= lc($expr->operator);
 						my $var		= $expr->children->[0]->value;
@@ -325,6 +332,21 @@ Otherwise, returns an empty list.
 						}
 						$query->add_filter($var->value, $op, $pattern->value);
 						return $query;
+					} elsif ($expr->isa('Attean::BinaryExpression') and $expr->operator =~ /^(?:<|<=|>|>=|=)$/ and not grep { not $_->isa('Attean::ValueExpression') } @{ $expr->children }) {
+						my $op			= $expr->operator;
+						my ($lhs, $rhs)	= map { $_->value } @{ $expr->children };
+						if ($rhs->does('Attean::API::Variable')) {
+							# numeric constant on the left: swap the operands
+							($lhs, $rhs)	= ($rhs, $lhs);
+							$op				=~ tr/<>/></;
+						}
+						# the constant is passed in its lexical form (numeric_value may lose precision), and the filter is only
+						# pushed down if the store accepts that value
+						my $numeric	= $rhs->does('Attean::API::NumericLiteral');
+						my $date	= $rhs->does('Attean::API::Literal') && $rhs->datatype->value =~ m<^http://www.w3.org/2001/XMLSchema#date(?:Time)?$>;
+						if ($lhs->does('Attean::API::Variable') and ($numeric or $date)) {
+							return $query unless ($query->add_filter($lhs->value, $op, $rhs->value));
+						}
 					}
 				}
 			}
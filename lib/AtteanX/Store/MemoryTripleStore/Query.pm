@@ -146,41 +146,83 @@ package AtteanX::Store::MemoryTripleStore::Query 0.001 {
 		return $self->_add_filter($self->store, $var, $op, $pat, AtteanX::Store::MemoryTripleStore::TERM_LANG_LITERAL, $lang, '');
 	}
 	
+	sub _path_ops {
+		my $self	= shift;
+		my $path	= shift;
+		if ($path->isa('Attean::Algebra::PredicatePath')) {
+			my $id	= $self->store->_id_from_term($path->predicate);
+			return (AtteanX::Store::MemoryTripleStore::PATH_PREDICATE, $id);
+		} elsif ($path->isa('Attean::Algebra::NegatedPropertySet')) {
+			my @ids	= map { $self->store->_id_from_term($_) } @{ $path->predicates };
+			return (AtteanX::Store::MemoryTripleStore::PATH_NEGATED, scalar(@ids), @ids);
+		}
+		
+		my @children;
+		foreach my $child (@{ $path->children }) {
+			my @ops	= $self->_path_ops($child);
+			return unless (scalar(@ops));
+			push(@children, \@ops);
+		}
+		
+		my %unary	= (
+			'Attean::Algebra::InversePath'		=> AtteanX::Store::MemoryTripleStore::PATH_INVERSE,
+			'Attean::Algebra::OneOrMorePath'	=> AtteanX::Store::MemoryTripleStore::PATH_PLUS,
+			'Attean::Algebra::ZeroOrMorePath'	=> AtteanX::Store::MemoryTripleStore::PATH_STAR,
+			'Attean::Algebra::ZeroOrOnePath'	=> AtteanX::Store::MemoryTripleStore::PATH_ZERO_OR_ONE,
+		);
+		foreach my $class (keys %unary) {
+			if ($path->isa($class) and scalar(@children) == 1) {
+				return ($unary{$class}, @{ $children[0] });
+			}
+		}
+		
+		my $type;
+		if ($path->isa('Attean::Algebra::SequencePath')) {
+			$type	= AtteanX::Store::MemoryTripleStore::PATH_SEQUENCE;
+		} elsif ($path->isa('Attean::Algebra::AlternativePath')) {
+			$type	= AtteanX::Store::MemoryTripleStore::PATH_ALTERNATIVE;
+		} else {
+			return;
+		}
+		
+		# n-ary sequences and alternatives become left-nested binary paths
+		return unless (scalar(@children));
+		my @ops	= @{ shift(@children) };
+		foreach my $child (@children) {
+			@ops	= ($type, @ops, @$child);
+		}
+		return @ops;
+	}
+	
 	sub add_path {
 		my $self	= shift;
-		my $op		= shift;
-		if ($op ne '+') {
-			die "Unexpected path type '%op'";
+		my $subject	= shift;
+		my $path	= shift;
+		my $object	= shift;
+		my @ops		= $self->_path_ops($path);
+		unless (scalar(@ops)) {
+			return 0;
 		}
 		
 		my @ids;
-		my $last	= 0;
-		my %vars;
-		my @names	= ('');
-		my $vars	= 0;
-		foreach my $term (@_) {
+		foreach my $term ($subject, $object) {
 			if ($term->does('Attean::API::Variable')) {
-				my $id	= $self->get_or_assign_variable_id($term->value);
-				$vars{$term->value}	= $id;
-				push(@ids, $id);
+				my $name	= $term->value;
+				push(@ids, $self->get_or_assign_variable_id($name));
+				unless (grep { $_ eq $name } @{ $self->in_scope_variables }) {
+					push(@{ $self->in_scope_variables }, $name);
+				}
 			} else {
 				my $id		= $self->store->_id_from_term($term);
 				unless ($id) {
 					# term does not exist in the store
-# 					warn 'term does not exist in the store: ' . $term->as_string;
-					return Attean::ListIterator->new(values => [], item_type => 'Attean::API::Triple');
+					return 0;
 				}
 				push(@ids, $id);
 			}
 		}
 		
-		return $self->_add_path(
-			$self->store,
-			AtteanX::Store::MemoryTripleStore::PATH_PLUS,
-			$vars,
-			\@ids,
-			\@names,
-		);
+		return !$self->_add_path($self->store, @ids, \@ops);
 	}
 	
 	sub add_bgp {
@@ -7,7 +7,8 @@
 
 void usage(int argc, char** argv, FILE* f) {
 	if (argc > 0) {
-		fprintf(f, "Usage: %s PORT input.nt\n\n", argv[0]);
+		fprintf(f, "Usage: %s [-w WORKERS] PORT input.nt\n\n", argv[0]);
+		fprintf(f, "With -w, requests are served by WORKERS pre-forked processes (0 for one per CPU).\n\n");
 	}
 }
 
@@ -23,6 +24,17 @@ int main (int argc, char** argv) {
 	}
 	
 	__block int i			= 1;
+	int prefork				= 0;
+	int workers				= 0;
+	if (!strcmp(argv[i], "-w")) {
+		if (argc < 4) {
+			usage(argc, argv, stderr);
+			return 1;
+		}
+		i++;
+		prefork	= 1;
+		workers	= atoi(argv[i++]);
+	}
 	short port				= (short) atoi(argv[i++]);
 	
 	const int max_edges		= 65536;
@@ -65,9 +77,13 @@ int main (int argc, char** argv) {
 	
 	int use_http	= 1;
 	triplestore_server_t* server	= triplestore_new_server(port, use_http, t);
+	if (!server) {
+		free_triplestore(t);
+		return 1;
+	}
 // 	signal(SIGPIPE, SIG_IGN);
-	triplestore_run_server(server);
+	int r	= prefork ? triplestore_run_prefork_server(server, workers) : triplestore_run_server(server);
 	triplestore_free_server(server);
 	free_triplestore(t);
-	return 0;
+	return r;
 }
@@ -166,6 +166,112 @@ test 'store-planning for BGP string filter' => sub {
 	is($count, 2, 'Expected result count');
 };
 
+test 'store-planning for BGP numeric comparison filter' => sub {
+	my $self	= shift;
+	my $xsd		= 'http://www.w3.org/2001/XMLSchema#';
+	my @triples	= map { triple(iri('http://example.org/z'), iri('http://example.org/p'), dtliteral($_, "${xsd}integer")) } (1,10,20,50);
+	push(@triples, triple(iri('http://example.org/z'), iri('http://example.org/p'), literal('30')));
+	my $store	= $self->create_store(triples => \@triples);
+	my $graph	= iri('http://example.org/');
+	my $model	= Attean::TripleModel->new( stores => { $graph->value => $store } );
+	my $planner	= Attean::IDPQueryPlanner->new();
+
+	my $t1		= Attean::TriplePattern->new(iri('http://example.org/z'), iri('http://example.org/p'), variable('o'));
+	my $bgp		= Attean::Algebra::BGP->new(triples => [$t1]);
+	my $var		= Attean::ValueExpression->new(value => variable('o'));
+	my $value	= Attean::ValueExpression->new(value => dtliteral('15', "${xsd}integer"));
+	my %expect	= (
+		'<'		=> 2,
+		'>'		=> 2,
+		'>='	=> 2,
+		'='		=> 0,
+	);
+	while (my ($op, $expect) = each(%expect)) {
+		my $expr	= Attean::BinaryExpression->new( children => [$var, $value], operator => $op );
+		my $filter	= Attean::Algebra::Filter->new(children => [$bgp], expression => $expr);
+		my $plan	= $planner->plan_for_algebra($filter, $model, [$graph]);
+		isa_ok($plan, 'AtteanX::Store::MemoryTripleStore::Query');
+
+		my $iter	= $plan->evaluate();
+		my $count	= 0;
+		while (my $r = $iter->next) {
+			$count++;
+		}
+		is($count, $expect, "Expected result count for $op");
+	}
+};
+
+test 'store-planning for BGP date comparison filter' => sub {
+	my $self	= shift;
+	my $xsd		= 'http://www.w3.org/2001/XMLSchema#';
+	my @triples	= map { triple(iri('http://example.org/z'), iri('http://example.org/p'), dtliteral($_, "${xsd}date")) } ('2019-12-31', '2020-01-01', '2020-06-15');
+	push(@triples, triple(iri('http://example.org/z'), iri('http://example.org/p'), dtliteral('2020-01-01T12:00:00Z', "${xsd}dateTime")));
+	push(@triples, triple(iri('http://example.org/z'), iri('http://example.org/p'), dtliteral('2020-01-01T12:00:00-14:00', "${xsd}dateTime")));
+	my $store	= $self->create_store(triples => \@triples);
+	my $graph	= iri('http://example.org/');
+	my $model	= Attean::TripleModel->new( stores => { $graph->value => $store } );
+	my $planner	= Attean::IDPQueryPlanner->new();
+
+	my $t1		= Attean::TriplePattern->new(iri('http://example.org/z'), iri('http://example.org/p'), variable('o'));
+	my $bgp		= Attean::Algebra::BGP->new(triples => [$t1]);
+	my $var		= Attean::ValueExpression->new(value => variable('o'));
+	my $value	= Attean::ValueExpression->new(value => dtliteral('2020-01-02', "${xsd}date"));
+	my %expect	= (
+		'<'		=> 3,
+		'>='	=> 2,
+		'='		=> 0,
+	);
+	while (my ($op, $expect) = each(%expect)) {
+		my $expr	= Attean::BinaryExpression->new( children => [$var, $value], operator => $op );
+		my $filter	= Attean::Algebra::Filter->new(children => [$bgp], expression => $expr);
+		my $plan	= $planner->plan_for_algebra($filter, $model, [$graph]);
+		isa_ok($plan, 'AtteanX::Store::MemoryTripleStore::Query');
+
+		my $iter	= $plan->evaluate();
+		my $count	= 0;
+		while (my $r = $iter->next) {
+			$count++;
+		}
+		is($count, $expect, "Expected result count for $op");
+	}
+};
+
+test 'store-planning for BGP LANGMATCHES filter' => sub {
+	my $self	= shift;
+	my @triples	= map { triple(iri('http://example.org/z'), iri('http://example.org/label'), langliteral(@$_)) } (['colour', 'en-GB'], ['color', 'en-US'], ['color', 'en'], ['Farbe', 'de'], ['couleur', 'fr']);
+	push(@triples, triple(iri('http://example.org/z'), iri('http://example.org/label'), literal('color')));
+	my $store	= $self->create_store(triples => \@triples);
+	my $graph	= iri('http://example.org/');
+	my $model	= Attean::TripleModel->new( stores => { $graph->value => $store } );
+	my $planner	= Attean::IDPQueryPlanner->new();
+
+	my $t1		= Attean::TriplePattern->new(iri('http://example.org/z'), iri('http://example.org/label'), variable('l'));
+	my $bgp		= Attean::Algebra::BGP->new(triples => [$t1]);
+	my $var		= Attean::ValueExpression->new(value => variable('l'));
+	my $lang	= Attean::FunctionExpression->new( children => [$var], operator => 'lang' );
+	my %expect	= (
+		'en'	=> 3,
+		'EN-us'	=> 1,
+		'de'	=> 1,
+		'*'		=> 5,
+		'es'	=> 0,
+	);
+	while (my ($range, $expect) = each(%expect)) {
+		my $value	= Attean::ValueExpression->new(value => literal($range));
+		my $expr	= Attean::FunctionExpression->new( children => [$lang, $value], operator => 'langmatches' );
+		my $filter	= Attean::Algebra::Filter->new(children => [$bgp], expression => $expr);
+		my $plan	= $planner->plan_for_algebra($filter, $model, [$graph]);
+		isa_ok($plan, 'AtteanX::Store::MemoryTripleStore::Query');
+
+		my $iter	= $plan->evaluate();
+		my $count	= 0;
+		while (my $r = $iter->next) {
+			$count++;
+		}
+		is($count, $expect, "Expected result count for $range");
+	}
+};
+
 test 'OnOrMore path with ground subject' => sub {
 	my $self	= shift;
 	my $store	= $self->_store_with_path_data();
@@ -205,6 +311,117 @@ test 'OnOrMore path with ground subject' => sub {
 	}
 };
 
+test 'OnOrMore path with ground endpoints' => sub {
+	my $self	= shift;
+	my $store	= $self->_store_with_path_data();
+	my $graph	= iri('http://example.org/');
+	my $model	= Attean::TripleModel->new( stores => { $graph->value => $store } );
+	my $planner	= Attean::IDPQueryPlanner->new();
+	my $t		= AtteanX::RDFQueryTranslator->new();
+	
+	# Knows relationships
+	# eve -> alice <-> bob
+	#               -> tim
+
+	my %tests	= (
+		'eve tim'		=> 1,
+		'alice alice'	=> 1,
+		'tim tim'		=> 0,
+		'tim eve'		=> 0,
+		'bob eve'		=> 0,
+	);
+	
+	foreach my $pair (keys %tests) {
+		my ($s, $o)	= split(' ', $pair);
+		my $query	= RDF::Query->new("PREFIX foaf: <http://xmlns.com/foaf/0.1/> SELECT * WHERE { <http://example.org/$s> foaf:knows+ <http://example.org/$o> }");
+		my $algebra	= $t->translate_query($query);
+		my $plan	= $planner->plan_for_algebra($algebra, $model, [$graph]);
+		my $iter	= $plan->evaluate();
+		my $count	= 0;
+		while (my $r = $iter->next) {
+			$count++;
+		}
+		is($count, $tests{$pair}, "expected knows path from $s to $o");
+	}
+};
+
+test 'property path operators' => sub {
+	my $self	= shift;
+	my $store	= $self->_store_with_path_data();
+	my $graph	= iri('http://example.org/');
+	my $model	= Attean::TripleModel->new( stores => { $graph->value => $store } );
+	my $planner	= Attean::IDPQueryPlanner->new();
+	my $t		= AtteanX::RDFQueryTranslator->new();
+	
+	# Knows relationships
+	# eve -> alice <-> bob
+	#               -> tim
+
+	my %tests	= (
+		'<http://example.org/eve> foaf:knows* ?o'				=> [map { "http://example.org/$_" } qw(eve alice bob tim)],
+		'<http://example.org/tim> foaf:knows* ?o'				=> ['http://example.org/tim'],
+		'<http://example.org/tim> foaf:knows? ?o'				=> ['http://example.org/tim'],
+		'<http://example.org/tim> ^foaf:knows ?o'				=> ['http://example.org/alice'],
+		'<http://example.org/eve> foaf:knows/foaf:knows ?o'		=> [map { "http://example.org/$_" } qw(bob tim)],
+		'<http://example.org/tim> foaf:knows|foaf:name ?o'		=> ['Timothy'],
+		'<http://example.org/alice> !foaf:knows ?o'				=> ['http://xmlns.com/foaf/0.1/Person', 'Alice'],
+		'?o foaf:knows/^foaf:knows <http://example.org/eve>'	=> [map { "http://example.org/$_" } qw(eve bob)],
+	);
+	
+	foreach my $pattern (sort keys %tests) {
+		my %expect	= map { $_ => 1 } @{ $tests{$pattern} };
+		my $query	= RDF::Query->new("PREFIX foaf: <http://xmlns.com/foaf/0.1/> SELECT * WHERE { $pattern }");
+		my $algebra	= $t->translate_query($query);
+		my $plan	= $planner->plan_for_algebra($algebra, $model, [$graph]);
+		isa_ok($plan, 'AtteanX::Store::MemoryTripleStore::Query');
+		my $iter	= $plan->evaluate();
+		my %seen;
+		while (my $r = $iter->next) {
+			$seen{ $r->value('o')->value }++;
+		}
+		is_deeply(\%seen, \%expect, "expected results for $pattern");
+	}
+};
+
+test 'OnOrMore path with predicate closure' => sub {
+	my $self	= shift;
+	my $store	= $self->_store_with_path_data();
+	ok($store->build_closure(iri('http://xmlns.com/foaf/0.1/knows')), 'built closure');
+	my $graph	= iri('http://example.org/');
+	my $model	= Attean::TripleModel->new( stores => { $graph->value => $store } );
+	my $planner	= Attean::IDPQueryPlanner->new();
+	my $t		= AtteanX::RDFQueryTranslator->new();
+	
+	# Knows relationships
+	# eve -> alice <-> bob
+	#               -> tim
+
+	my %tests	= (
+		eve		=> [qw(alice bob tim)],
+		alice	=> [qw(alice bob tim)],
+		bob		=> [qw(alice bob tim)],
+		tim		=> [],
+	);
+	
+	foreach my $person (keys %tests) {
+		my %expect	= map { ("http://example.org/$_" => 1) } @{ $tests{$person} };
+		my $query	= RDF::Query->new("PREFIX foaf: <http://xmlns.com/foaf/0.1/> SELECT * WHERE { <http://example.org/$person> foaf:knows+ ?o }");
+		my $algebra	= $t->translate_query($query);
+		my $plan	= $planner->plan_for_algebra($algebra, $model, [$graph]);
+		my $iter	= $plan->evaluate();
+		my %seen;
+		while (my $r = $iter->next) {
+			$seen{ $r->value('o')->value }++;
+		}
+		is_deeply(\%seen, \%expect, "expected knows paths from $person");
+	}
+	
+	my $query	= RDF::Query->new("PREFIX foaf: <http://xmlns.com/foaf/0.1/> SELECT * WHERE { <http://example.org/tim> foaf:knows+ <http://example.org/eve> }");
+	my $plan	= $planner->plan_for_algebra($t->translate_query($query), $model, [$graph]);
+	my $iter	= $plan->evaluate();
+	is($iter->next, undef, 'no knows path from tim to eve');
+};
+
 test 'OnOrMore path with variable subject' => sub {
 	my $self	= shift;
 	my $store	= $self->_store_with_path_data();
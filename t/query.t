@@ -72,6 +72,54 @@ test 'filter query construction' => sub {
 	});
 };
 
+test 'prefix filter query construction' => sub {
+	my $self	= shift;
+	my $store	= $self->create_store();
+	my $graph	= iri('http://example.org/');
+	my $model	= Attean::TripleModel->new( stores => { $graph->value => $store } );
+	
+	my $t1		= Attean::TriplePattern->new(variable('s'), iri('http://data.smgov.net/resource/zzzz-zzzz/commonname'), variable('tree'));
+	my %expect	= (
+		'tree starts BRAZILIAN'							=> ['tree', 'starts', 'BRAZILIAN', 4],
+		'tree starts NOTATREE'							=> ['tree', 'starts', 'NOTATREE', 0],
+		's iriprefix http://data.smgov.net/resource/'	=> ['s', 'iriprefix', 'http://data.smgov.net/resource/', 55],
+		's iriprefix http://example.org/'				=> ['s', 'iriprefix', 'http://example.org/', 0],
+		'tree iriprefix BRAZILIAN'						=> ['tree', 'iriprefix', 'BRAZILIAN', 0],
+	);
+	while (my ($name, $data) = each(%expect)) {
+		my ($var, $op, $pat, $expect)	= @$data;
+		my $query	= AtteanX::Store::MemoryTripleStore::Query->new(store => $store);
+		$query->add_bgp($t1);
+		$query->add_filter($var, $op, $pat);
+		my $iter	= $query->evaluate($model);
+		my $count	= 0;
+		while (my $result = $iter->next) {
+			$count++;
+		}
+		is($count, $expect, $name);
+	}
+};
+
+test 'comparison filter values' => sub {
+	my $self	= shift;
+	my $store	= $self->create_store();
+	my %expect	= (
+		'number'				=> ['5', 0],
+		'exponent'				=> ['1.5e3', 0],
+		'date'					=> ['2020-01-01', 0],
+		'end of day'			=> ['2020-01-01T24:00:00Z', 0],
+		'past end of day'		=> ['2020-01-01T24:30:00Z', 1],
+		'trailing characters'	=> ['5 apples', 1],
+		'not a number'			=> ['apples', 1],
+	);
+	while (my ($name, $data) = each(%expect)) {
+		my ($pat, $expect)	= @$data;
+		my $query	= AtteanX::Store::MemoryTripleStore::Query->new(store => $store);
+		$query->add_bgp(Attean::TriplePattern->new(variable('s'), iri('http://example.org/p'), variable('o')));
+		is(!!$query->add_filter('o', 'lt', $pat), !!$expect, $name);
+	}
+};
+
 test 'filter+project+unique query construction' => sub {
 	my $self	= shift;
 	my $store	= $self->create_store();
@@ -8,6 +8,7 @@ use warnings;
 no warnings 'redefine';
 
 use Attean;
+use Attean::RDF;
 
 sub create_store {
 	my $self	= shift;
@@ -98,6 +99,25 @@ test '2-triple BGP with variable endpoints' => sub {
 	}
 };
 
+test 'serialized term forms' => sub {
+	my $self	= shift;
+	my $xsd		= 'http://www.w3.org/2001/XMLSchema#';
+	my %expect	= (
+		"${xsd}integer"	=> ['7', '7'],
+		"${xsd}decimal"	=> ['1.5', '1.5'],
+		"${xsd}double"	=> ['1.5E0', '1.5E0'],
+		"${xsd}float"	=> ['1.5', qq["1.5"^^<${xsd}float>]],
+		"${xsd}boolean"	=> ['true', qq["true"^^<${xsd}boolean>]],
+	);
+	my @triples	= map { triple(iri('http://example.org/s'), iri('http://example.org/p'), dtliteral($expect{$_}[0], $_)) } keys %expect;
+	my $store	= $self->create_store(triples => \@triples);
+	while (my ($dt, $data) = each(%expect)) {
+		my ($value, $string)	= @$data;
+		my $id	= $store->_id_from_term(dtliteral($value, $dt));
+		is($store->_term_string($id), $string, "serialized form of $dt literal");
+	}
+};
+
 run_me; # run these Test::Attean tests
 
 done_testing();
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "triplestore-pool.h"
+
+// The deque of the pool worker running on this thread (if any).
+static _Thread_local triplestore_deque_t* _triplestore_pool_current	= NULL;
+
+static int _triplestore_deque_push(triplestore_deque_t* d, triplestore_task_t* task) {
+	pthread_mutex_lock(&d->lock);
+	if (d->size == d->alloc) {
+		uint32_t alloc				= d->alloc ? 2 * d->alloc : 64;
+		triplestore_task_t** tasks	= calloc(alloc, sizeof(triplestore_task_t*));
+		if (!tasks) {
+			pthread_mutex_unlock(&d->lock);
+			return 1;
+		}
+		for (uint32_t i = 0; i < d->size; i++) {
+			tasks[i]	= d->tasks[(d->top + i) % d->alloc];
+		}
+		free(d->tasks);
+		d->tasks	= tasks;
+		d->alloc	= alloc;
+		d->top		= 0;
+	}
+	d->tasks[(d->top + d->size) % d->alloc]	= task;
+	d->size++;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+// Takes the newest task (if bottom is true, for the owning worker) or the oldest task (for a thief).
+static triplestore_task_t* _triplestore_deque_take(triplestore_deque_t* d, int bottom) {
+	triplestore_task_t* task	= NULL;
+	pthread_mutex_lock(&d->lock);
+	if (d->size > 0) {
+		if (bottom) {
+			task	= d->tasks[(d->top + d->size - 1) % d->alloc];
+		} else {
+			task	= d->tasks[d->top];
+			d->top	= (d->top + 1) % d->alloc;
+		}
+		d->size--;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return task;
+}
+
+static triplestore_task_t* _triplestore_pool_take(triplestore_pool_t* pool, triplestore_deque_t* self) {
+	triplestore_task_t* task	= _triplestore_deque_take(self, 1);
+	if (!task) {
+		pthread_mutex_lock(&pool->lock);
+		task	= pool->head;
+		if (task) {
+			pool->head	= task->next;
+			if (!pool->head) {
+				pool->tail	= NULL;
+			}
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	for (int i = 1; !task && i < pool->nthr; i++) {
+		task	= _triplestore_deque_take(&(pool->deques[(self->index + i) % pool->nthr]), 0);
+	}
+	if (task) {
+		pthread_mutex_lock(&pool->lock);
+		pool->pending--;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return task;
+}
+
+static void* _triplestore_pool_worker(void* thunk) {
+	triplestore_deque_t* self	= thunk;
+	triplestore_pool_t* pool	= self->pool;
+	_triplestore_pool_current	= self;
+	while (1) {
+		triplestore_task_t* task	= _triplestore_pool_take(pool, self);
+		if (task) {
+			task->fn(task->arg);
+			free(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->pending == 0 && !pool->shutdown) {
+			pthread_cond_wait(&pool->ready, &pool->lock);
+		}
+		int done	= (pool->pending == 0);
+		pthread_mutex_unlock(&pool->lock);
+		if (done) {
+			// shutting down, and every queued task has been run
+			break;
+		}
+	}
+	_triplestore_pool_current	= NULL;
+	return NULL;
+}
+
+// Stops the pool once its queued tasks have run, joining the first started worker threads.
+static void _triplestore_pool_destroy(triplestore_pool_t* pool, int started) {
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown	= 1;
+	pthread_cond_broadcast(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < started; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	for (int i = 0; i < pool->nthr; i++) {
+		pthread_mutex_destroy(&(pool->deques[i].lock));
+		free(pool->deques[i].tasks);
+	}
+	pthread_cond_destroy(&pool->ready);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
+
+// Starts a pool of nthr worker threads, or one per online CPU if nthr is not positive.
+triplestore_pool_t* triplestore_new_pool(int nthr) {
+	if (nthr <= 0) {
+		long cpus	= sysconf(_SC_NPROCESSORS_ONLN);
+		nthr		= (cpus > 0) ? (int) cpus : 1;
+	}
+
+	triplestore_pool_t* pool	= calloc(1, sizeof(triplestore_pool_t));
+	if (!pool) {
+		fprintf(stderr, "*** Failed to allocate memory for thread pool\n");
+		return NULL;
+	}
+	pool->threads	= calloc(nthr, sizeof(pthread_t));
+	pool->deques	= calloc(nthr, sizeof(triplestore_deque_t));
+	if (!pool->threads || !pool->deques) {
+		fprintf(stderr, "*** Failed to allocate memory for thread pool\n");
+		free(pool->threads);
+		free(pool->deques);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->ready, NULL);
+	for (int i = 0; i < nthr; i++) {
+		pool->deques[i].pool	= pool;
+		pool->deques[i].index	= i;
+		pthread_mutex_init(&(pool->deques[i].lock), NULL);
+	}
+
+	pool->nthr	= nthr;
+	for (int i = 0; i < nthr; i++) {
+		if (pthread_create(&(pool->threads[i]), NULL, _triplestore_pool_worker, &(pool->deques[i]))) {
+			fprintf(stderr, "*** Failed to start thread pool worker\n");
+			_triplestore_pool_destroy(pool, i);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+// Runs any tasks that are still queued, then stops and joins the worker threads.
+int triplestore_free_pool(triplestore_pool_t* pool) {
+	_triplestore_pool_destroy(pool, pool->nthr);
+	return 0;
+}
+
+int triplestore_pool_threads(triplestore_pool_t* pool) {
+	return pool->nthr;
+}
+
+// Queues fn(arg) to be run on one of the pool's worker threads. Tasks queued by a worker go on that worker's own
+// deque (where other workers can steal them); tasks queued from any other thread go on a shared queue.
+int triplestore_pool_async(triplestore_pool_t* pool, triplestore_task_fn fn, void* arg) {
+	triplestore_task_t* task	= calloc(1, sizeof(triplestore_task_t));
+	if (!task) {
+		fprintf(stderr, "*** Failed to allocate memory for thread pool task\n");
+		return 1;
+	}
+	task->fn	= fn;
+	task->arg	= arg;
+
+	triplestore_deque_t* self	= _triplestore_pool_current;
+	if (self && self->pool == pool) {
+		if (_triplestore_deque_push(self, task)) {
+			fprintf(stderr, "*** Failed to allocate memory for thread pool task\n");
+			free(task);
+			return 1;
+		}
+		pthread_mutex_lock(&pool->lock);
+	} else {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->shutdown) {
+			pthread_mutex_unlock(&pool->lock);
+			free(task);
+			return 1;
+		}
+		if (pool->tail) {
+			pool->tail->next	= task;
+		} else {
+			pool->head	= task;
+		}
+		pool->tail	= task;
+	}
+	pool->pending++;
+	pthread_cond_signal(&pool->ready);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+typedef void (*triplestore_task_fn)(void* arg);
+
+typedef struct triplestore_task_s {
+	struct triplestore_task_s* next;
+	triplestore_task_fn fn;
+	void* arg;
+} triplestore_task_t;
+
+// Each worker owns a deque of tasks. The worker pushes and pops its own tasks at the bottom, while idle workers
+// steal the oldest task from the top.
+typedef struct triplestore_deque_s {
+	struct triplestore_pool_s* pool;
+	int index;
+	pthread_mutex_t lock;
+	triplestore_task_t** tasks;
+	uint32_t alloc;
+	uint32_t top;
+	uint32_t size;
+} triplestore_deque_t;
+
+typedef struct triplestore_pool_s {
+	int nthr;
+	int shutdown;
+	int pending;			// tasks queued anywhere in the pool
+	pthread_t* threads;
+	triplestore_deque_t* deques;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	triplestore_task_t* head;	// tasks submitted from threads outside the pool
+	triplestore_task_t* tail;
+} triplestore_pool_t;
+
+triplestore_pool_t* triplestore_new_pool(int nthr);
+int triplestore_free_pool(triplestore_pool_t* pool);
+int triplestore_pool_threads(triplestore_pool_t* pool);
+int triplestore_pool_async(triplestore_pool_t* pool, triplestore_task_fn fn, void* arg);
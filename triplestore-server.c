@@ -1,11 +1,167 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		// fopencookie
+#endif
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <time.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
 #include "triplestore-server.h"
 #include "commands.h"
 
-static void* consume(void* thunk);
-static int triplestore_server_push_client(triplestore_server_t* s, int sd);
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SERVER_MAX_HEADER	8192
+#define SERVER_EVENTS		64
+#define SERVER_OUTPUT_BUFFER	(64 * 1024)
+#define SERVER_MAX_LINE		(1024 * 1024)
+#define SERVER_MAX_BODY		(64 * 1024 * 1024)
+#define SERVER_READ_TIMEOUT	10		// seconds a pool worker waits for more of a request (or to send a response)
+#define SERVER_BODY_TIMEOUT	60		// seconds a pool worker spends reading the body of one request
+#define BATCH_BOUNDARY		"triplestore-batch-boundary"
+#define SERVER_MAX_STATEMENTS	4096
+#define SERVER_CACHE_BUDGET		(64 * 1024 * 1024)
+#define METRICS_BUCKETS			26		// latencies of at most 2^0 ... 2^24 microseconds, and longer
+#define METRICS_SAMPLE			64		// one result in this many is timed as it is serialized
+#define PREFORK_MIN_UPTIME		10		// seconds a worker must run for its crash not to count as a failure to start
+#define PREFORK_MAX_FAILURES	5		// crashes in a row (each within PREFORK_MIN_UPTIME) before a worker isn't replaced
+
+typedef enum {
+	RESULTS_TSV,
+	RESULTS_BINARY,
+	RESULTS_JSON,
+	RESULTS_XML,
+} results_format_t;
+
+typedef struct triplestore_response_s {
+	FILE* out;				// the response body
+	results_format_t format;
+	int started_results;	// the format's preamble has been written
+	uint64_t rows;			// results serialized so far
+	uint64_t* sent;			// bitmap of the terms already sent in binary results
+	int use_http;
+	int streaming;			// if true, out is a stream_response stream and the status line and headers go out with its first block
+	int keep_alive;
+	int http10;				// the request was HTTP/1.0, so the response can't use chunked transfer encoding
+	int code;
+	const char* message;
+	const char* content_type;
+	int fd;
+	int started;			// the status line and headers have been sent
+	int finishing;			// the next block written is the last
+	int finished;
+	int failed;
+} triplestore_response_t;
+
+typedef enum {
+	REQUEST_QUERY,
+	REQUEST_BATCH,			// POST /batch
+	REQUEST_PREPARE,		// POST /prepare
+	REQUEST_EXECUTE,		// POST /execute/<statement>
+	REQUEST_METRICS,		// GET /metrics
+} request_type_t;
+
+typedef struct triplestore_http_request_s {
+	request_type_t type;
+	uint32_t statement;		// REQUEST_EXECUTE
+	size_t header_length;	// bytes up to and including the blank line that ends the header
+	size_t content_length;
+	int keep_alive;
+	int http10;
+	results_format_t format;
+	int code;				// the error response to send if the request is bad
+	const char* message;
+} triplestore_http_request_t;
+
+// The body of a request, which is read (and run) a line at a time as it arrives from a connection or, for
+// triplestore_read_and_run_query, from a file.
+typedef struct triplestore_request_body_s {
+	triplestore_connection_t* c;
+	FILE* in;
+	size_t start;			// offset of the unread part of the body in the connection's buffer
+	size_t remaining;		// body bytes not yet read (SIZE_MAX if the body runs to the end of the input)
+	char* line;				// holds lines that can't be terminated in place
+	size_t alloc;
+	size_t received;		// bytes read from the client while reading (or skipping) the body
+	time_t deadline;		// when to give up on a client that sends the body too slowly
+
+	int code;				// the error response to send if the body can't be read
+	const char* message;
+} triplestore_request_body_t;
+
+int triplestore_run_query(triplestore_server_t* s, triplestore_t* t, triplestore_request_body_t* body, triplestore_response_t* res);
+int triplestore_run_batch(triplestore_server_t* s, triplestore_t* t, triplestore_request_body_t* body, triplestore_response_t* res);
+int triplestore_prepare_statement(triplestore_server_t* s, triplestore_t* t, triplestore_request_body_t* body, triplestore_response_t* res);
+int triplestore_execute_statement(triplestore_server_t* s, triplestore_t* t, uint32_t id, triplestore_request_body_t* body, triplestore_response_t* res);
+static void _triplestore_free_statement(triplestore_statement_t* st);
+
+typedef struct triplestore_cache_key_s {
+	char* text;
+	size_t length;
+	size_t alloc;
+	int failed;
+} triplestore_cache_key_t;
+
+typedef struct triplestore_cache_capture_s {
+	FILE* out;				// the stream being written to before the capture started
+	char* output;
+	size_t length;
+	size_t alloc;
+	size_t limit;
+	int capturing;			// false once the output has grown too large to cache
+} triplestore_cache_capture_t;
+
+static void _triplestore_cache_init(triplestore_result_cache_t* cache, size_t budget);
+static void _triplestore_cache_destroy(triplestore_result_cache_t* cache);
+static void _triplestore_cache_key_append(triplestore_cache_key_t* key, results_format_t format, int argc, char** argv);
+static triplestore_cached_result_t* _triplestore_cache_get(triplestore_result_cache_t* cache, triplestore_cache_key_t* key);
+static void _triplestore_cache_release(triplestore_result_cache_t* cache, triplestore_cached_result_t* e);
+static int _triplestore_cache_capture(triplestore_result_cache_t* cache, triplestore_response_t* res, triplestore_cache_capture_t* cap);
+static void _triplestore_cache_end_capture(triplestore_result_cache_t* cache, triplestore_response_t* res, triplestore_cache_capture_t* cap, triplestore_cache_key_t* key, int store);
+
+typedef enum {
+	PHASE_QUEUE,			// waiting for a pool worker
+	PHASE_PARSE,			// reading and splitting the request's commands
+	PHASE_PLAN,				// building the query's operators from its commands (prepared statements reuse theirs)
+	PHASE_MATCH,
+	PHASE_SERIALIZE,		// estimated from the results timed by serialize_sampled_result
+	PHASE_REQUEST,			// the whole request, from a worker starting on it to its response being sent
+	PHASES
+} metrics_phase_t;
+
+// Counters kept by one thread. Only that thread updates them, and /metrics reports the sum over every thread.
+typedef struct triplestore_metrics_s {
+	struct triplestore_metrics_s* next;
+	uint64_t connections_opened;
+	uint64_t connections_closed;
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t rows;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t phase_micros[PHASES];
+	uint64_t phase_buckets[PHASES][METRICS_BUCKETS];
+} triplestore_metrics_t;
+
+static uint64_t _triplestore_metrics_now(void);
+static triplestore_metrics_t* _triplestore_metrics(triplestore_server_t* s);
+static void _triplestore_metrics_add(uint64_t* counter, uint64_t n);
+static void _triplestore_metrics_observe(triplestore_metrics_t* m, metrics_phase_t phase, uint64_t micros);
+static void _triplestore_metrics_query(triplestore_server_t* s, struct command_ctx_s* ctx, triplestore_response_t* res, uint64_t parse, uint64_t sampled);
+int triplestore_write_metrics(triplestore_server_t* s, triplestore_response_t* res);
 
 #pragma mark -
 
@@ -52,13 +208,18 @@ triplestore_server_t* triplestore_new_server(short port, int use_http, triplesto
 	server->buffer_size = 4096;
 //	server->queue		= dispatch_queue_create("us.kasei.triplestore.workers", DISPATCH_QUEUE_CONCURRENT);
 //	server->sync_queue	= dispatch_queue_create("us.kasei.triplestore.sync", NULL);
-	server->size		= 64;
-	server->nthr		= 24;
-	server->ring		= calloc(server->nthr, sizeof(ck_ring_t));
-	server->buffer		= calloc(sizeof(ck_ring_buffer_t), server->size);
-	ck_ring_init(server->ring, server->size);
-	server->threads		= calloc(sizeof(pthread_t), server->nthr);
+	server->fd			= -1;
+	server->events		= -1;
+	server->pool		= triplestore_new_pool(0);
+	if (!server->pool) {
+		free(server);
+		return NULL;
+	}
+	pthread_mutex_init(&server->statements_lock, NULL);
+	_triplestore_cache_init(&server->cache, SERVER_CACHE_BUDGET);
+	pthread_mutex_init(&server->metrics_lock, NULL);
 	triplestore_set_read_only(t);
+	triplestore_cache_terms(t);
 	
 	return server;
 }
@@ -68,67 +229,317 @@ int triplestore_free_server(triplestore_server_t* s) {
 //	dispatch_barrier_sync(s->sync_queue, ^{});	
 //	dispatch_release(s->queue);
 //	dispatch_release(s->sync_queue);
-	for (int i = 0; i < s->nthr; i++) {
-		triplestore_server_push_client(s, 0);
+	if (s->pool) {
+		triplestore_free_pool(s->pool);
 	}
-	for (int i = 0; i < s->nthr; i++) {
-		if (s->threads[i]) {
-			pthread_join(s->threads[i], NULL);
-			s->threads[i]	= NULL;
-		}
+	for (uint32_t i = 0; i < s->statements_used; i++) {
+		_triplestore_free_statement(s->statements[i]);
+	}
+	free(s->statements);
+	pthread_mutex_destroy(&s->statements_lock);
+	_triplestore_cache_destroy(&s->cache);
+	while (s->metrics) {
+		triplestore_metrics_t* m	= s->metrics;
+		s->metrics	= m->next;
+		free(m);
+	}
+	pthread_mutex_destroy(&s->metrics_lock);
+	if (s->events >= 0) {
+		close(s->events);
+	}
+	if (s->fd >= 0) {
+		close(s->fd);
 	}
-	free(s->ring);
-	free(s->buffer);
-	free(s->threads);
-	close(s->fd);
 	free(s);
 	return 0;
 }
 
+// Prepared statements bind their placeholders to variables named "$name", which are not part of the results.
+static int is_result_variable(query_t* query, int j) {
+	const char* name	= query->variable_names[j];
+	return !(name && name[0] == '$');
+}
+
 static int write_tsv_results_header(FILE* f, query_t* query) {
 	int vars	= triplestore_query_get_max_variables(query);
+	int written	= 0;
 	for (int j = 1; j <= vars; j++) {
-		if (j < vars) {
-			fprintf(f, "?%s\t", query->variable_names[j]);
-		} else {
-			fprintf(f, "?%s\n", query->variable_names[j]);
+		if (is_result_variable(query, j)) {
+			fprintf(f, (written++ > 0) ? "\t?%s" : "?%s", query->variable_names[j]);
 		}
 	}
+	if (vars > 0) {
+		fputc('\n', f);
+	}
 	return 0;
 }
 
-static int write_http_header(FILE* out, int code, const char* message, char* contenttype) {
-//	fprintf(stderr, "writing HTTP header %03d\n", code);
+static void http_date(char* buf, size_t size) {
 	time_t now		= time(0);
 	struct tm tm	= *gmtime(&now);
-	char* buf		= alloca(256);
-	strftime(buf, 256, "%a, %d %b %Y %H:%M:%S %Z", &tm);
-	
+	strftime(buf, size, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+}
+
+static int write_http_header(triplestore_response_t* res, int code, const char* message, char* contenttype) {
+//	fprintf(stderr, "writing HTTP header %03d\n", code);
 	if (!contenttype) {
 		contenttype = "text/plain";
 	}
 	
-	fprintf(out, "HTTP/1.1 %03d %s\r\n"
+	res->code			= code;
+	res->message		= message;
+	res->content_type	= contenttype;
+	if (res->streaming) {
+		// sent along with the first block of the body
+		return 0;
+	}
+	
+	char* buf		= alloca(256);
+	http_date(buf, 256);
+	fprintf(res->out, "HTTP/1.1 %03d %s\r\n"
 				"Content-Type: %s\r\n"
+				"Connection: close\r\n"
 				"Date: %s\r\n"
 				"Server: MemoryTripleStore\r\n"
 				"\r\n", code, message, contenttype, buf);
 	return 0;
 }
 
-static int write_http_error_header(struct command_ctx_s* ctx, FILE* out, int code, const char* message) {
-	if (write_http_header(out, code, message, "text/plain")) {
+static int write_http_error_header(struct command_ctx_s* ctx, triplestore_response_t* res, int code, const char* message) {
+	if (write_http_header(res, code, message, "text/plain")) {
 		return 1;
 	}
-	if (ctx->error_message) {
-		fprintf(out, "%s\r\n", ctx->error_message);
+	if (ctx && ctx->error_message) {
+		fprintf(res->out, "%s\r\n", ctx->error_message);
 	} else {
-		fprintf(out, "%s\r\n", message);
+		fprintf(res->out, "%s\r\n", message);
+	}
+	return 0;
+}
+
+// Writes every byte of iov to fd, returning non-zero if the connection fails.
+static int send_all(int fd, struct iovec* iov, int count) {
+	while (count > 0) {
+		struct msghdr msg	= { .msg_iov = iov, .msg_iovlen = count };
+		ssize_t bytes		= sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		while (count > 0 && (size_t) bytes >= iov->iov_len) {
+			bytes	-= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base	= (char*) iov->iov_base + bytes;
+			iov->iov_len	-= bytes;
+		}
 	}
 	return 0;
 }
 
-static int read_http_header(FILE* in, int* length) {
+static int http_response_header(triplestore_response_t* res, char* header, size_t size, int chunked, size_t length) {
+	if (!res->code) {
+		res->code			= 500;
+		res->message		= "Internal Server Error";
+		res->content_type	= "text/plain";
+	}
+	char date[256];
+	http_date(date, sizeof(date));
+	char framing[64];
+	if (chunked) {
+		snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked\r\n");
+	} else if (res->finishing) {
+		snprintf(framing, sizeof(framing), "Content-Length: %zu\r\n", length);
+	} else {
+		// an HTTP/1.0 body that is longer than one block is ended by closing the connection
+		framing[0]	= '\0';
+	}
+	return snprintf(header, size, "HTTP/1.1 %03d %s\r\n"
+								"Content-Type: %s\r\n"
+								"%s"
+								"Connection: %s\r\n"
+								"Date: %s\r\n"
+								"Server: MemoryTripleStore\r\n"
+								"\r\n", res->code, res->message, res->content_type, framing, res->keep_alive ? "keep-alive" : "close", date);
+}
+
+// Sends a block of the response body (each time the stream's buffer fills, and once more when it is finished). The
+// status line and headers go out with the first block: if that is also the last, the whole body is sent with a
+// Content-Length, and otherwise the body is sent using chunked transfer encoding (or, for an HTTP/1.0 client, which
+// doesn't understand chunks, unframed and followed by closing the connection).
+static ssize_t write_response_block(triplestore_response_t* res, const char* buf, size_t size) {
+	if (res->failed) {
+		return -1;
+	}
+	
+	int chunked		= res->use_http && !res->http10 && (res->started || !res->finishing);
+	char header[512];
+	char chunk[32];
+	struct iovec iov[5];
+	int count		= 0;
+	if (res->use_http && !res->started) {
+		if (res->http10 && !res->finishing) {
+			res->keep_alive	= 0;
+		}
+		int length	= http_response_header(res, header, sizeof(header), chunked, size);
+		iov[count++]	= (struct iovec) { .iov_base = header, .iov_len = length };
+	}
+	if (chunked && size > 0) {
+		int length	= snprintf(chunk, sizeof(chunk), "%zx\r\n", size);
+		iov[count++]	= (struct iovec) { .iov_base = chunk, .iov_len = length };
+	}
+	if (size > 0) {
+		iov[count++]	= (struct iovec) { .iov_base = (char*) buf, .iov_len = size };
+	}
+	if (chunked && size > 0) {
+		iov[count++]	= (struct iovec) { .iov_base = "\r\n", .iov_len = 2 };
+	}
+	if (chunked && res->finishing) {
+		iov[count++]	= (struct iovec) { .iov_base = "0\r\n\r\n", .iov_len = 5 };
+	}
+	
+	res->started	= 1;
+	if (res->finishing) {
+		res->finished	= 1;
+	}
+	if (send_all(res->fd, iov, count)) {
+		res->failed	= 1;
+		return -1;
+	}
+	return size;
+}
+
+#if defined(__linux__)
+static ssize_t response_cookie_write(void* cookie, const char* buf, size_t size) {
+	return write_response_block((triplestore_response_t*) cookie, buf, size);
+}
+#else
+static int response_cookie_write(void* cookie, const char* buf, int size) {
+	return (int) write_response_block((triplestore_response_t*) cookie, buf, (size_t) size);
+}
+#endif
+
+// Opens a stream for the body of res which is written to the client (framed as HTTP/1.1 requires) each time
+// buffer, of SERVER_OUTPUT_BUFFER bytes, fills up.
+static FILE* stream_response(triplestore_response_t* res, char* buffer) {
+#if defined(__linux__)
+	cookie_io_functions_t io	= { .read = NULL, .write = response_cookie_write, .seek = NULL, .close = NULL };
+	FILE* f	= fopencookie(res, "w", io);
+#else
+	FILE* f	= funopen(res, NULL, response_cookie_write, NULL, NULL);
+#endif
+	if (f) {
+		setvbuf(f, buffer, _IOFBF, SERVER_OUTPUT_BUFFER);
+		res->out		= f;
+		res->streaming	= 1;
+	}
+	return f;
+}
+
+// Sends whatever is left of the response body and closes its stream. Returns non-zero if the connection failed.
+static int finish_response(triplestore_response_t* res) {
+	res->finishing	= 1;
+	fflush(res->out);
+	if (!res->finished) {
+		write_response_block(res, NULL, 0);
+	}
+	fclose(res->out);
+	res->out	= NULL;
+	return res->failed;
+}
+
+static const struct {
+	results_format_t format;
+	const char* media_type;
+	char* content_type;
+} results_formats[] = {
+	{ RESULTS_TSV,		"text/tab-separated-values",			"text/tab-separated-values; charset=utf-8" },
+	{ RESULTS_JSON,		"application/sparql-results+json",		"application/sparql-results+json; charset=utf-8" },
+	{ RESULTS_XML,		"application/sparql-results+xml",		"application/sparql-results+xml; charset=utf-8" },
+	{ RESULTS_BINARY,	"application/x-triplestore-results",	"application/x-triplestore-results" },
+};
+#define RESULTS_FORMATS	(sizeof(results_formats) / sizeof(results_formats[0]))
+
+// Returns the results format that an Accept header value prefers (by quality, with ties going to the earlier entry in
+// results_formats), or TSV if it accepts none of them.
+static results_format_t negotiate_results_format(const char* accept, size_t len) {
+	double quality[RESULTS_FORMATS];
+	int precedence[RESULTS_FORMATS];
+	for (size_t i = 0; i < RESULTS_FORMATS; i++) {
+		quality[i]		= 0.0;
+		precedence[i]	= -1;
+	}
+	
+	size_t pos	= 0;
+	while (pos < len) {
+		const char* range	= &(accept[pos]);
+		const char* end		= memchr(range, ',', len - pos);
+		size_t range_len	= end ? (size_t) (end - range) : len - pos;
+		pos					+= range_len + 1;
+		
+		char buffer[256];
+		if (range_len >= sizeof(buffer)) {
+			continue;
+		}
+		memcpy(buffer, range, range_len);
+		buffer[range_len]	= '\0';
+		
+		char* type	= buffer;
+		while (*type == ' ' || *type == '\t') {
+			type++;
+		}
+		double q		= 1.0;
+		char* params	= strchr(type, ';');
+		if (params) {
+			*(params++)	= '\0';
+			char* qparam	= strstr(params, "q=");
+			if (qparam) {
+				q	= strtod(qparam + 2, NULL);
+			}
+		}
+		size_t type_len	= strcspn(type, " \t");
+		
+		for (size_t i = 0; i < RESULTS_FORMATS; i++) {
+			const char* media_type	= results_formats[i].media_type;
+			const char* slash		= strchr(media_type, '/');
+			int p	= -1;
+			if (type_len == strlen(media_type) && !strncasecmp(type, media_type, type_len)) {
+				p	= 2;
+			} else if (type_len == (size_t) (slash - media_type) + 2 && !strncasecmp(type, media_type, type_len - 1) && type[type_len-1] == '*') {
+				p	= 1;
+			} else if (type_len == 3 && !strncmp(type, "*/*", 3)) {
+				p	= 0;
+			}
+			if (p > precedence[i]) {
+				precedence[i]	= p;
+				quality[i]		= q;
+			}
+		}
+	}
+	
+	size_t best	= 0;
+	for (size_t i = 1; i < RESULTS_FORMATS; i++) {
+		if (quality[i] > quality[best]) {
+			best	= i;
+		}
+	}
+	return (quality[best] > 0.0) ? results_formats[best].format : RESULTS_TSV;
+}
+
+static char* results_content_type(results_format_t format) {
+	for (size_t i = 0; i < RESULTS_FORMATS; i++) {
+		if (results_formats[i].format == format) {
+			return results_formats[i].content_type;
+		}
+	}
+	return "text/plain";
+}
+
+static int read_http_header(FILE* in, int* length, results_format_t* format) {
 //	fprintf(stderr, "Reading HTTP header:\n");
 //	fprintf(stderr, "-------------------------\n");
 	int cl					= 0;
@@ -153,6 +564,9 @@ static int read_http_header(FILE* in, int* length) {
 				*length = cl;
 			}
 		}
+		if (format && !strncasecmp(line, "Accept:", 7)) {
+			*format	= negotiate_results_format(&(line[7]), strcspn(&(line[7]), "\r\n"));
+		}
 	}
 	free(line);
 	return 1;
@@ -190,394 +604,2557 @@ static int new_socket ( short port ) {
 	return fd;
 }
 
-static void* consume(void* thunk) {
-	triplestore_server_t* s	= (triplestore_server_t*) thunk;
-	while (1) {
-		struct sockaddr_in peer;
-		socklen_t addrlen;
-		int sd	= accept(s->fd, (struct sockaddr*) &peer, &addrlen);
-		if (sd < 0) {
-			perror("Wrong connection");
-			usleep(50000);
-			continue;
-		}
-		
-		// TODO: this seems to only work on darwin/bsd
-		int set = 1;
-		setsockopt(sd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
+#pragma mark -
+#pragma mark Connections
 
-		FILE* f = fdopen(sd, "r+");
-		if (f == NULL) {
-			close(sd);
-			perror("");
-			continue;
-		}
+static int _triplestore_events_new(void) {
+#if defined(__linux__)
+	return epoll_create1(EPOLL_CLOEXEC);
+#else
+	return kqueue();
+#endif
+}
 
-		triplestore_read_and_run_query(s, f, f);
-		fclose(f);
-	}
-	return NULL;
+// Asks for a notification when fd is readable. Connections (with non-NULL data) are watched for a single
+// notification, and must be watched again (with add false) once they have been handled.
+static int _triplestore_events_watch(int events, int fd, void* data, int add) {
+#if defined(__linux__)
+	struct epoll_event ev	= { .events = EPOLLIN | (data ? EPOLLONESHOT : 0), .data = { .ptr = data } };
+	return epoll_ctl(events, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+#else
+	struct kevent ev;
+	EV_SET(&ev, fd, EVFILT_READ, EV_ADD | (data ? EV_ONESHOT : 0), 0, 0, data);
+	return kevent(events, &ev, 1, NULL, 0, NULL);
+#endif
 }
 
-static int triplestore_server_push_client(triplestore_server_t* s, int sd) {
-	intptr_t i	= sd;
-	while (!ck_ring_enqueue_spmc(s->ring, s->buffer, (void*)i)) {
-		usleep(400);
-		ck_pr_stall();
+static int _triplestore_events_wait(int events, void** ready, int max) {
+#if defined(__linux__)
+	struct epoll_event ev[SERVER_EVENTS];
+	int count	= epoll_wait(events, ev, (max < SERVER_EVENTS) ? max : SERVER_EVENTS, -1);
+	for (int i = 0; i < count; i++) {
+		ready[i]	= ev[i].data.ptr;
 	}
-	return 0;
-// 	dispatch_async(s->queue, ^{
-// //		double block_start_time	   = triplestore_elapsed_time(start);
-// 		FILE* f = fdopen(sd, "r+");
-// 		if (f == NULL) {
-// 			close(sd);
-// 			perror("");
-// 			return;
-// 		}
-// 
-// 		triplestore_read_and_run_query(s, f, f);
-// 		fclose(f);
-// 		outstanding--;
-// //		double total_time  = triplestore_elapsed_time(start);
-// //		fprintf(stdout, "R%"PRIu64",%lf,%lf,%lf,%lf\n", request_id, start, accept_time, block_start_time, total_time);
-// 	});
+#else
+	struct kevent ev[SERVER_EVENTS];
+	int count	= kevent(events, NULL, 0, ev, (max < SERVER_EVENTS) ? max : SERVER_EVENTS, NULL);
+	for (int i = 0; i < count; i++) {
+		ready[i]	= ev[i].udata;
+	}
+#endif
+	return count;
 }
 
-int triplestore_run_server(triplestore_server_t* s) {
-	s->fd			= new_socket(s->port);
-	if (s->fd < 0) {
-		return 1;
+static triplestore_connection_t* _triplestore_new_connection(triplestore_server_t* s, int fd) {
+	triplestore_connection_t* c	= calloc(1, sizeof(triplestore_connection_t));
+	if (!c) {
+		return NULL;
 	}
+	c->server	= s;
+	c->fd		= fd;
+	c->alloc	= s->buffer_size;
+	c->buffer	= calloc(1, c->alloc);
+	if (!c->buffer) {
+		free(c);
+		return NULL;
+	}
+	_triplestore_metrics_add(&(_triplestore_metrics(s)->connections_opened), 1);
+	return c;
+}
 
-	int status		= listen(s->fd, 1024);
-	if (status < 0) {
-		perror("Listen error");
-		return 1;
-	} else {
-		if (s->use_http) {
-			fprintf(stderr, "Listening on http://localhost:%d/\n", s->port);
-		} else {
-			fprintf(stderr, "Listening on localhost:%d\n", s->port);
-		}
-	}
-	
-	for (intptr_t i = 0; i < s->nthr; i++) {
-		pthread_create(&(s->threads[i]), NULL, consume, s);
-	}
-
-// 	int sd;
-// 	fd_set set;
-// 	struct timeval timeout;
-// 	timeout.tv_sec = 0;
-// 	timeout.tv_usec = 250000;
-// 	
-// 	uint64_t count	= 0;
-// 	__block int highwater = 0;
-// 	__block int outstanding = 0;
-// 	while (1) {
-// 		usleep(10000);
-// 		FD_ZERO(&set);
-// 		FD_SET(s->fd, &set);
-// 		int ready	= select(s->fd+1, &set, NULL, NULL, &timeout);
-// 		if (ready > 0) {
-// //			fprintf(stderr, "Peer available. trying to accept\n");
-// 			uint64_t request_id	 = ++count;
-// 			addrlen = sizeof(peer);
-// //			  double start	  = triplestore_current_time();
-// 			sd	= accept(s->fd, (struct sockaddr*) &peer, &addrlen);
-// 			if (sd < 0) {
-// 				perror("Wrong connection");
-// 				exit(1);
-// 			}
-// 			
-// 			int set = 1;
-// 			setsockopt(sd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
-// 
-// //			  double accept_time	= triplestore_elapsed_time(start);
-// // 			outstanding++;
-// // 			if (outstanding > highwater) {
-// // 				fprintf(stderr, "[%"PRIu64"] Starting block with new highwater mark at %d\n", request_id, highwater);
-// // 				highwater	= outstanding;
-// // 			}
-// //			fprintf(stderr, "Accepted connection on fd %d\n", sd);
-// 
-// 			triplestore_server_push_client(s, sd);
-// 		} else {
-// 			usleep(100000);
-// 		}
-// 	}
-	return 0;
+static void _triplestore_free_connection(triplestore_connection_t* c) {
+	_triplestore_metrics_add(&(_triplestore_metrics(c->server)->connections_closed), 1);
+	close(c->fd);
+	free(c->buffer);
+	free(c->output);
+	free(c);
 }
 
-static size_t fwrite_tsv(const char* ptr, size_t size, size_t nitems, FILE *restrict stream) {
-	int needs_escape	= 0;
-	unsigned long bytes	= size * nitems;
-	for (size_t i = 0; i < size * bytes; i++) {
-		if (ptr[i] == '\r' || ptr[i] == '\n' || ptr[i] == '\t') {
-			needs_escape++;
-		}
-	}
-	
-	if (needs_escape) {
-		size_t bytes	= 0;
-		for (size_t i = 0; i < size * nitems; i++) {
-			if (ptr[i] == '\r') {
-				bytes	+= fwrite("\\r", 1, 2, stream);
-			} else if (ptr[i] == '\n') {
-				bytes	+= fwrite("\\n", 1, 2, stream);
-			} else if (ptr[i] == '\t') {
-				bytes	+= fwrite("\\t", 1, 2, stream);
-			} else {
-				fputc(ptr[i], stream);
-				bytes++;
-			}
-		}
-		return bytes;
-	} else {
-		return fwrite(ptr, size, nitems, stream);
-	}
+// True once the connection's buffer is as full as the event loop lets it get. A request that doesn't fit is handed to
+// the pool anyway, and the rest of its body is read (and run) there as it arrives.
+static int _triplestore_connection_full(triplestore_connection_t* c) {
+	return c->used >= SERVER_MAX_HEADER + (size_t) c->server->buffer_size;
 }
 
-static int triplestore_print_tsv_term(struct command_ctx_s* ctx, triplestore_t* t, nodeid_t id, FILE* f) {
-	if (id > t->nodes_used) {
-		ctx->set_error(-1, "Undefined term ID found in query result");
-		return 1;
+// If line is the header field name, points value at its value (without surrounding whitespace).
+static int _triplestore_http_field(const char* line, size_t len, const char* name, const char** value, size_t* value_len) {
+	size_t n	= strlen(name);
+	if (len <= n || line[n] != ':' || strncasecmp(line, name, n)) {
+		return 0;
 	}
-	rdf_term_t* term		= t->graph[id]._term;
-	const char* datatype	= NULL;
-	if (term == NULL) assert(0);
-	switch (term->type) {
-		case TERM_IRI:
-			fwrite("<", 1, 1, f);
-			fwrite_tsv(term->value, 1, strlen(term->value), f);
-			fwrite(">", 1, 1, f);
-			return 0;
-		case TERM_BLANK:
-			fprintf(f, "_:b%"PRIu32"b%s", (uint32_t) term->vtype.value_type.value_id, term->value);
-			return 0;
-		case TERM_XSDSTRING_LITERAL:
-			fwrite("\"", 1, 1, f);
-			fwrite_tsv(term->value, 1, strlen(term->value), f);
-			fwrite("\"", 1, 1, f);
-			return 0;
-		case TERM_LANG_LITERAL:
-			fwrite("\"", 1, 1, f);
-			fwrite_tsv(term->value, 1, strlen(term->value), f);
-			fprintf(f, "\"@%s", (char*) &(term->vtype.value_lang));
-			return 0;
-		case TERM_TYPED_LITERAL:
-			datatype	= t->graph[term->vtype.value_type.value_id]._term->value;
-			if (!strcmp(datatype, "http://www.w3.org/2001/XMLSchema#decimal")) {
-				fwrite_tsv(term->value, 1, strlen(term->value), f);
-			} else if (!strcmp(datatype, "http://www.w3.org/2001/XMLSchema#integer")) {
-				fwrite_tsv(term->value, 1, strlen(term->value), f);
-			} else if (!strcmp(datatype, "http://www.w3.org/2001/XMLSchema#double")) {
-				fwrite_tsv(term->value, 1, strlen(term->value), f);
-			} else {
-				fwrite("\"", 1, 1, f);
-				fwrite_tsv(term->value, 1, strlen(term->value), f);
-				fwrite("\"^^<", 1, 4, f);
-				fwrite_tsv(datatype, 1, strlen(datatype), f);
-				fwrite(">", 1, 1, f);
-			}
-			return 0;
-		case TERM_VARIABLE:
-			fprintf(f, "?%s", term->value);
-			return 0;
+	const char* v	= &(line[n+1]);
+	const char* end	= &(line[len]);
+	while (v < end && (*v == ' ' || *v == '\t')) {
+		v++;
 	}
+	while (end > v && (end[-1] == ' ' || end[-1] == '\t')) {
+		end--;
+	}
+	*value		= v;
+	*value_len	= end - v;
+	return 1;
 }
 
-static int serialize_result(struct command_ctx_s* ctx, FILE* f, triplestore_t* t, query_t* query, binding_t* result) {
-	if (f != NULL) {
-		int vars	= triplestore_query_get_max_variables(query);
-		for (int j = 1; j <= vars; j++) {
-			nodeid_t id = (nodeid_t) result[j];
-// 			fprintf(f, "(%"PRIu32")", id);
-			if (id > 0) {
-				triplestore_print_tsv_term(ctx, t, id, f);
-			}
-			if (j < vars) {
-				fprintf(f, "\t");
-			}
+static int _triplestore_http_has_token(const char* value, size_t len, const char* token) {
+	size_t n	= strlen(token);
+	for (size_t i = 0; i + n <= len; i++) {
+		if (!strncasecmp(&(value[i]), token, n)) {
+			return 1;
 		}
-		fprintf(f, "\n");
 	}
 	return 0;
 }
 
-int triplestore_run_query(triplestore_server_t* s, triplestore_t* t, char* query, FILE* out) {
-	__block struct command_ctx_s ctx	= {
-		.sandbox			= 1,
-		.error				= 0,
-		.error_message		= NULL,
-		.start				= triplestore_current_time(),
-		.constructing		= 0,
-		.query				= NULL,
-	};
-	
-	ctx.preamble_block		= ^(query_t* query){
-		write_tsv_results_header(out, query);
-	};
-	
-	ctx.custom_output		= ^(const char* message){
-		fprintf(out, "%s", message);
-	};
-	
-	ctx.result_block		= ^(query_t* query, binding_t* final_match){
-		serialize_result(&ctx, out, t, query, final_match);
-	};
-	
-	ctx.set_error	= ^(int code, const char* message){
-		if (0) {
-			fprintf(stderr, "*** set_error called: (%d) %s\n", code, message);
+static int _triplestore_http_bad_request(triplestore_http_request_t* req, int code, const char* message) {
+	req->code		= code;
+	req->message	= message;
+	req->keep_alive	= 0;
+	return -1;
+}
+
+// Parses the request at the start of the connection's buffer. Returns 1 if the whole request (header and body) has
+// been read, 0 if more bytes are needed, or -1 if the request is bad (setting the error response to send).
+static int _triplestore_http_parse_request(triplestore_connection_t* c, triplestore_http_request_t* req) {
+	triplestore_server_t* s	= c->server;
+	memset(req, 0, sizeof(triplestore_http_request_t));
+	if (!s->use_http) {
+		// without HTTP, the request is everything the client sends before it shuts down its side of the connection
+		if (c->used == 0 || !(c->eof || _triplestore_connection_full(c))) {
+			return 0;
 		}
-		server_ctx_set_error(&ctx, (char*) message);
-	};
-	
-	int output	= 0;
-	char* ptr	= query;
+		req->content_length	= SIZE_MAX;
+		return 1;
+	}
 	
-//	fprintf(stderr, "query: «%s»\n", query);
+	size_t pos		= 0;
+	int lines		= 0;
 	while (1) {
-		char* end;
-		if ((end = strstr(ptr, "\r"))) {
-			*end	= '\0';
-		} else if ((end = strstr(ptr, "\n"))) {
-			*end	= '\0';
-		} else {
-			end		= strstr(ptr, "\0");
+		const char* line	= &(c->buffer[pos]);
+		const char* eol		= memchr(line, '\n', c->used - pos);
+		if (!eol) {
+			if (c->used > SERVER_MAX_HEADER) {
+				return _triplestore_http_bad_request(req, 431, "Request Header Fields Too Large");
+			}
+			return 0;
 		}
-		if (!end) {
-			return 1;
+		size_t len	= eol - line;
+		pos			= eol - c->buffer + 1;
+		if (len > 0 && line[len-1] == '\r') {
+			len--;
+		}
+		if (pos > SERVER_MAX_HEADER) {
+			return _triplestore_http_bad_request(req, 431, "Request Header Fields Too Large");
 		}
 		
-		long linelen	= end - ptr + 1;
-//		fprintf(stderr, "line length: %d\n", linelen);
-
-		int argc_max	= 16;
-		char** argv		= calloc(sizeof(char*), argc_max);
-		int argc		= 0;
-		argv[argc++]	= ptr;
-		for (int i = 1; i < (linelen-1); i++) {
-			if (ptr[i] == '\0') {
-				free(argv);
-				if (0) {
-					fprintf(stderr, "Unexpected NULL byte in triplestore_run_query\n");
-				}
-				write_http_error_header(&ctx, out, 400, "Bad Request");
-				return 1;
-			} else if (ptr[i] == ' ') {
-				ptr[i]	= '\0';
-			} else if (ptr[i-1] == '\0') {
-				if (argc >= argc_max) {
-					argc_max	*= 2;
-					argv	= realloc(argv, sizeof(char*) * argc_max);
-					if (!argv) {
-						write_http_error_header(&ctx, out, 500, "Internal Server Error");
-						return 1;
-					}
-				}
-				char* p = &(ptr[i]);
-				argv[argc++]	= p;
-				if ('"' == ptr[i]) {
-					while (ptr[i]) {
-						if ('\\' == ptr[i]) {
-							i++;
-							if ('\0' == ptr[i]) {
-								break;
-							}
-						}
-						i++;
-						if ('"' == ptr[i]) {
+		if (lines == 0) {
+			if (len == 0) {
+				// blank lines before the request line (e.g. a CRLF sent after the previous request's body)
+				continue;
+			}
+			lines++;
+			if (len >= 9 && !strncmp(&(line[len-9]), " HTTP/1.1", 9)) {
+				req->keep_alive	= 1;
+			} else if (len >= 9 && !strncmp(&(line[len-9]), " HTTP/1.0", 9)) {
+				req->keep_alive	= 0;
+				req->http10		= 1;
+			} else {
+				return _triplestore_http_bad_request(req, 400, "Bad Request");
+			}
+			
+			// the request target is ignored (for compatibility with older clients) other than to select a batch, a
+			// prepared statement or the metrics
+			const char* target	= memchr(line, ' ', len - 9);
+			if (target) {
+				target++;
+				size_t n	= strcspn(target, "? ");
+				if (n == 6 && !strncmp(target, "/batch", 6)) {
+					req->type	= REQUEST_BATCH;
+				} else if (n == 8 && !strncmp(target, "/prepare", 8)) {
+					req->type	= REQUEST_PREPARE;
+				} else if (n == 8 && !strncmp(target, "/metrics", 8)) {
+					req->type	= REQUEST_METRICS;
+				} else if (n > 9 && !strncmp(target, "/execute/", 9)) {
+					req->type	= REQUEST_EXECUTE;
+					for (size_t i = 9; i < n; i++) {
+						if (!isdigit(target[i]) || req->statement > SERVER_MAX_STATEMENTS) {
+							req->statement	= 0;
 							break;
 						}
+						req->statement	= 10 * req->statement + (target[i] - '0');
 					}
 				}
 			}
+			continue;
 		}
 		
-		if (triplestore_output_op(&ctx, argc, argv)) {
-			if (s->use_http) {
-				write_http_header(out, 200, "OK", "text/tab-separated-values; charset=utf-8");
-			}
-			output++;
+		if (len == 0) {
+			break;
 		}
 		
-		if (argc == 1 && !strcmp(argv[0], "")) {
-			goto loop_cleanup;
-		}
-		int r	= triplestore_op(t, &ctx, argc, argv);
-		if (r) {
-			if (ctx.query) {
-				triplestore_free_query(ctx.query);
-				ctx.query	= NULL;
+		const char* value;
+		size_t value_len;
+		if (_triplestore_http_field(line, len, "Content-Length", &value, &value_len)) {
+			size_t cl	= 0;
+			for (size_t i = 0; i < value_len; i++) {
+				if (!isdigit(value[i]) || cl > (SIZE_MAX - 9) / 10) {
+					return _triplestore_http_bad_request(req, 400, "Bad Request");
+				}
+				cl	= 10 * cl + (value[i] - '0');
 			}
-			if (0) {
-				fprintf(stderr, "triplestore_op failed in triplestore_run_query\n");
+			if (cl > SERVER_MAX_BODY) {
+				return _triplestore_http_bad_request(req, 413, "Payload Too Large");
 			}
-			write_http_error_header(&ctx, out, 400, "Bad Request");
-			free(argv);
-			return 1;
-		}
-		
-		if (ctx.constructing == 0) {
-			free(argv);
-			break;
+			req->content_length	= cl;
+		} else if (_triplestore_http_field(line, len, "Connection", &value, &value_len)) {
+			if (_triplestore_http_has_token(value, value_len, "close")) {
+				req->keep_alive	= 0;
+			} else if (_triplestore_http_has_token(value, value_len, "keep-alive")) {
+				req->keep_alive	= 1;
+			}
+		} else if (_triplestore_http_field(line, len, "Accept", &value, &value_len)) {
+			req->format	= negotiate_results_format(value, value_len);
+		} else if (_triplestore_http_field(line, len, "Transfer-Encoding", &value, &value_len)) {
+			return _triplestore_http_bad_request(req, 411, "Length Required");
 		}
-		
-loop_cleanup:
-		ptr += linelen;
-		free(argv);
 	}
+	
+	req->header_length	= pos;
+	if (c->used - pos < req->content_length && !_triplestore_connection_full(c)) {
+		return 0;
+	}
+	return 1;
+}
 
-	if (!output) {
-		if (0) {
-			fprintf(stderr, "No output in triplestore_run_query\n");
-		}
-		write_http_error_header(&ctx, out, 400, "Bad Request");
-		return 1;
+#pragma mark -
+#pragma mark Request Bodies
+
+static int _triplestore_request_error(triplestore_request_body_t* body, int code, const char* message) {
+	body->code		= code;
+	body->message	= message;
+	return -1;
+}
+
+// Makes room for a line of the given length (and its terminator) in the body's line buffer.
+static int _triplestore_request_reserve(triplestore_request_body_t* body, size_t length) {
+	if (length < body->alloc) {
+		return 0;
 	}
-	
+	size_t alloc	= body->alloc ? body->alloc : 256;
+	while (alloc <= length) {
+		alloc	*= 2;
+	}
+	char* buffer	= realloc(body->line, alloc);
+	if (!buffer) {
+		return _triplestore_request_error(body, 500, "Internal Server Error");
+	}
+	body->line	= buffer;
+	body->alloc	= alloc;
 	return 0;
 }
 
-int triplestore_read_and_run_query(triplestore_server_t* server, FILE* in, FILE* out) {
-	if (!in) {
-		fprintf(stderr, "Missing input file handle in triplestore_read_and_run_query\n");
-		return 1;
+// Reads more of the body from the client, first discarding the bytes in front of its unread part (the request
+// header and the lines that have already been run). The socket's receive timeout, the body's deadline and
+// SERVER_MAX_BODY keep a client that sends its body slowly (or never finishes it) from holding a pool worker.
+static int _triplestore_request_fill(triplestore_request_body_t* body) {
+	triplestore_connection_t* c	= body->c;
+	if (body->start > 0) {
+		memmove(c->buffer, &(c->buffer[body->start]), c->used - body->start);
+		c->used		-= body->start;
+		body->start	= 0;
+	}
+	if (c->eof) {
+		return _triplestore_request_error(body, 400, "Bad Request");
+	}
+	if (body->received > SERVER_MAX_BODY) {
+		return _triplestore_request_error(body, 413, "Payload Too Large");
+	}
+	if (body->deadline && time(NULL) > body->deadline) {
+		return _triplestore_request_error(body, 408, "Request Timeout");
+	}
+	if (c->used == c->alloc) {
+		if (c->used >= SERVER_MAX_LINE) {
+			return _triplestore_request_error(body, 413, "Payload Too Large");
+		}
+		size_t alloc	= 2 * c->alloc;
+		char* buffer	= realloc(c->buffer, alloc);
+		if (!buffer) {
+			return _triplestore_request_error(body, 500, "Internal Server Error");
+		}
+		c->buffer	= buffer;
+		c->alloc	= alloc;
+	}
+	while (1) {
+		ssize_t bytes	= recv(c->fd, &(c->buffer[c->used]), c->alloc - c->used, 0);
+		if (bytes > 0) {
+			c->used			+= bytes;
+			body->received	+= bytes;
+			return 0;
+		} else if (bytes == 0) {
+			c->eof	= 1;
+			return 0;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return _triplestore_request_error(body, 408, "Request Timeout");
+		} else if (errno != EINTR) {
+			return _triplestore_request_error(body, 400, "Bad Request");
+		}
+	}
+}
+
+static int _triplestore_request_read_file_line(triplestore_request_body_t* body, char** line, size_t* length) {
+	size_t len	= 0;
+	int ch		= EOF;
+	if (_triplestore_request_reserve(body, 0)) {
+		return -1;
+	}
+	while (body->remaining > 0 && (ch = getc(body->in)) != EOF) {
+		if (body->remaining != SIZE_MAX) {
+			body->remaining--;
+		}
+		if (ch == '\n' || ch == '\r') {
+			break;
+		} else if (len >= SERVER_MAX_LINE) {
+			return _triplestore_request_error(body, 413, "Payload Too Large");
+		} else if (_triplestore_request_reserve(body, len + 1)) {
+			return -1;
+		}
+		body->line[len++]	= ch;
+	}
+	if (len == 0 && ch != '\n' && ch != '\r') {
+		return 0;
+	}
+	body->line[len]	= '\0';
+	*line	= body->line;
+	*length	= len;
+	return 1;
+}
+
+// Sets *line to the next line of the body (without its line break) and returns 1, or returns 0 at the end of the body
+// (or -1 if it can't be read). The line is only valid until the next call.
+static int _triplestore_request_read_line(triplestore_request_body_t* body, char** line, size_t* length) {
+	if (body->in) {
+		return _triplestore_request_read_file_line(body, line, length);
 	}
 	
-	triplestore_t* t	= server->t;
-	int length	= 0;
-	if (server->use_http) {
-		if (read_http_header(in, &length)) {
+	triplestore_connection_t* c	= body->c;
+	while (1) {
+		size_t available	= c->used - body->start;
+		if (available > body->remaining) {
+			available	= body->remaining;
+		}
+		char* p		= &(c->buffer[body->start]);
+		size_t len	= 0;
+		while (len < available && p[len] != '\n' && p[len] != '\r') {
+			len++;
+		}
+		
+		if (len < available) {
+			p[len]	= '\0';
+			*line	= p;
+			*length	= len;
+			len++;
+		} else if (available == body->remaining || (body->remaining == SIZE_MAX && c->eof)) {
+			// the last line of the body, which may be followed by the client's next request
+			if (available == 0) {
+				return 0;
+			} else if (_triplestore_request_reserve(body, len)) {
+				return -1;
+			}
+			memcpy(body->line, p, len);
+			body->line[len]	= '\0';
+			*line	= body->line;
+			*length	= len;
+		} else if (len >= SERVER_MAX_LINE) {
+			return _triplestore_request_error(body, 413, "Payload Too Large");
+		} else if (_triplestore_request_fill(body)) {
+			return -1;
+		} else {
+			continue;
+		}
+		
+		body->start	+= len;
+		if (body->remaining != SIZE_MAX) {
+			body->remaining	-= len;
+		}
+		return 1;
+	}
+}
+
+// Discards whatever part of the body the query didn't read, so that the client's next request starts at body->start.
+static int _triplestore_request_skip(triplestore_request_body_t* body) {
+	triplestore_connection_t* c	= body->c;
+	while (body->remaining > 0) {
+		size_t available	= c->used - body->start;
+		if (available > body->remaining) {
+			available	= body->remaining;
+		}
+		body->start		+= available;
+		body->remaining	-= available;
+		if (body->remaining > 0 && _triplestore_request_fill(body)) {
 			return 1;
 		}
+	}
+	return 0;
+}
+
+#pragma mark -
+
+// Answers each request in the connection's buffer on a pool worker, then either closes the connection or goes
+// back to waiting for the client's next request.
+static void _triplestore_connection_handle(void* thunk) {
+	triplestore_connection_t* c	= (triplestore_connection_t*) thunk;
+	triplestore_server_t* s		= c->server;
+	while (1) {
+		uint64_t start	= _triplestore_metrics_now();
+		if (c->queued) {
+			_triplestore_metrics_observe(_triplestore_metrics(s), PHASE_QUEUE, start - c->queued);
+			c->queued	= 0;
+		}
+		
+		triplestore_http_request_t req;
+		int r	= _triplestore_http_parse_request(c, &req);
+		if (r == 0) {
+			if (_triplestore_events_watch(s->events, c->fd, c, 0)) {
+				perror("Event registration error");
+				_triplestore_free_connection(c);
+			}
+			return;
+		}
+		
+		if (!c->output && !(c->output = malloc(SERVER_OUTPUT_BUFFER))) {
+			fprintf(stderr, "*** Failed to allocate memory for response buffer\n");
+			_triplestore_free_connection(c);
+			return;
+		}
+		triplestore_response_t res	= {
+			.use_http	= s->use_http,
+			.keep_alive	= req.keep_alive,
+			.http10		= req.http10,
+			.format		= req.format,
+			.fd			= c->fd,
+		};
+		if (!stream_response(&res, c->output)) {
+			perror("Response stream error");
+			_triplestore_free_connection(c);
+			return;
+		}
+		
+		triplestore_request_body_t body	= {
+			.c			= c,
+			.start		= req.header_length,
+			.remaining	= req.content_length,
+			.deadline	= time(NULL) + SERVER_BODY_TIMEOUT,
+		};
+		if (r < 0) {
+			write_http_error_header(NULL, &res, req.code, req.message);
+		} else if (req.type == REQUEST_METRICS) {
+			triplestore_write_metrics(s, &res);
+		} else if (req.content_length == 0 && req.type != REQUEST_EXECUTE) {
+			// (a statement without placeholders is executed with an empty body)
+			write_http_error_header(NULL, &res, 400, "Bad Request");
+		} else if (req.type == REQUEST_BATCH) {
+			triplestore_run_batch(s, s->t, &body, &res);
+		} else if (req.type == REQUEST_PREPARE) {
+			triplestore_prepare_statement(s, s->t, &body, &res);
+		} else if (req.type == REQUEST_EXECUTE) {
+			triplestore_execute_statement(s, s->t, req.statement, &body, &res);
+		} else {
+			triplestore_run_query(s, s->t, &body, &res);
+		}
+		free(body.line);
+		
+		int failed	= finish_response(&res);
+		free(res.sent);
+		triplestore_metrics_t* m	= _triplestore_metrics(s);
+		_triplestore_metrics_add(&(m->requests), 1);
+		if (res.code >= 400) {
+			_triplestore_metrics_add(&(m->errors), 1);
+		}
+		_triplestore_metrics_observe(m, PHASE_REQUEST, _triplestore_metrics_now() - start);
+		if (r < 0 || failed || body.code || !res.keep_alive || _triplestore_request_skip(&body)) {
+			_triplestore_free_connection(c);
+			return;
+		}
+		
+		memmove(c->buffer, &(c->buffer[body.start]), c->used - body.start);
+		c->used	-= body.start;
+	}
+}
+
+// Reads whatever the client has sent so far. Once a whole request (or a bad one) has arrived the connection is
+// handed to the pool, and otherwise it goes back to waiting for more.
+static void _triplestore_connection_read(triplestore_connection_t* c) {
+	triplestore_server_t* s	= c->server;
+	size_t max				= SERVER_MAX_HEADER + s->buffer_size;
+	while (!c->eof && !_triplestore_connection_full(c)) {
+		if (c->used == c->alloc) {
+			size_t alloc	= (2 * c->alloc < max) ? 2 * c->alloc : max;
+			char* buffer	= realloc(c->buffer, alloc);
+			if (!buffer) {
+				fprintf(stderr, "*** Failed to allocate memory for connection buffer\n");
+				_triplestore_free_connection(c);
+				return;
+			}
+			c->buffer	= buffer;
+			c->alloc	= alloc;
+		}
+		ssize_t bytes	= recv(c->fd, &(c->buffer[c->used]), c->alloc - c->used, MSG_DONTWAIT);
+		if (bytes > 0) {
+			c->used	+= bytes;
+		} else if (bytes == 0) {
+			c->eof	= 1;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		} else {
+			_triplestore_free_connection(c);
+			return;
+		}
+	}
+	
+	triplestore_http_request_t req;
+	if (_triplestore_http_parse_request(c, &req)) {
+		c->queued	= _triplestore_metrics_now();
+		if (triplestore_pool_async(s->pool, _triplestore_connection_handle, c)) {
+			_triplestore_free_connection(c);
+		}
+	} else if (c->eof) {
+		_triplestore_free_connection(c);
+	} else if (_triplestore_events_watch(s->events, c->fd, c, 0)) {
+		perror("Event registration error");
+		_triplestore_free_connection(c);
+	}
+}
+
+static void _triplestore_server_accept(triplestore_server_t* s) {
+	while (1) {
+		struct sockaddr_in peer;
+		socklen_t addrlen	= sizeof(peer);
+		int sd	= accept(s->fd, (struct sockaddr*) &peer, &addrlen);
+		if (sd < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("Wrong connection");
+			}
+			return;
+		}
+		
+		// responses are written by blocking sends on pool workers (on BSD the socket inherits O_NONBLOCK), and the
+		// rest of a request's body is read by blocking reads there, both of which time out
+		int flags	= fcntl(sd, F_GETFL, 0);
+		if (flags >= 0) {
+			fcntl(sd, F_SETFL, flags & ~O_NONBLOCK);
+		}
+		int set = 1;
+		setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (void *)&set, sizeof(int));
+		struct timeval timeout	= { .tv_sec = SERVER_READ_TIMEOUT };
+		setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+		setsockopt(sd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
+#endif
+		
+		triplestore_connection_t* c	= _triplestore_new_connection(s, sd);
+		if (!c) {
+			fprintf(stderr, "*** Failed to allocate memory for server connection\n");
+			close(sd);
+		} else if (_triplestore_events_watch(s->events, sd, c, 1)) {
+			perror("Event registration error");
+			_triplestore_free_connection(c);
+		}
+	}
+}
+
+#pragma mark -
+
+// Creates the server's listening socket and the event queue that watches it.
+static int _triplestore_server_listen(triplestore_server_t* s) {
+	s->fd			= new_socket(s->port);
+	if (s->fd < 0) {
+		return 1;
+	}
+
+	int status		= listen(s->fd, 1024);
+	if (status < 0) {
+		perror("Listen error");
+		return 1;
+	}
+	
+	int flags	= fcntl(s->fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(s->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("Socket options error");
+		return 1;
+	}
+	s->events	= _triplestore_events_new();
+	if (s->events < 0 || _triplestore_events_watch(s->events, s->fd, NULL, 1)) {
+		perror("Event queue error");
+		return 1;
+	}
+	return 0;
+}
+
+static void _triplestore_server_announce(triplestore_server_t* s) {
+	if (s->use_http) {
+		fprintf(stderr, "Listening on http://localhost:%d/\n", s->port);
 	} else {
-		length	= server->buffer_size-1;
+		fprintf(stderr, "Listening on localhost:%d\n", s->port);
+	}
+}
+
+static int _triplestore_server_loop(triplestore_server_t* s) {
+	// Connections are accepted and read here, and handed to the pool once a whole request has arrived, so that
+	// idle and slow (keep-alive) clients don't hold a thread. The pool's workers also evaluate the parallel query
+	// operators of the queries they run, so the two kinds of work share one thread per core.
+	void* ready[SERVER_EVENTS];
+	while (1) {
+		int count	= _triplestore_events_wait(s->events, ready, SERVER_EVENTS);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Event queue error");
+			return 1;
+		}
+		for (int i = 0; i < count; i++) {
+			if (ready[i]) {
+				_triplestore_connection_read(ready[i]);
+			} else {
+				_triplestore_server_accept(s);
+			}
+		}
+	}
+	return 0;
+}
+
+int triplestore_run_server(triplestore_server_t* s) {
+	if (_triplestore_server_listen(s)) {
+		return 1;
+	}
+	_triplestore_server_announce(s);
+	return _triplestore_server_loop(s);
+}
+
+#pragma mark -
+#pragma mark Pre-forked Workers
+
+// In pre-fork mode the process that loaded the store forks worker processes which share its pages copy-on-write
+// (the store is read-only while serving, so they stay shared). Each worker binds its own SO_REUSEPORT socket to the
+// port and runs its own event loop and pool, so a crash takes down only the connections of one worker (which is
+// then replaced, unless it keeps crashing as soon as it starts), and the workers' threads don't contend for locks,
+// including malloc's. On Linux the kernel spreads incoming connections across the workers' sockets.
+//
+// Prepared statements and the result cache belong to a worker, so a statement must be executed on the same
+// (keep-alive) connection that prepared it.
+
+static volatile sig_atomic_t _triplestore_prefork_stopping	= 0;
+
+static void _triplestore_prefork_stop(int sig) {
+	_triplestore_prefork_stopping	= sig;
+}
+
+// Only interrupts sigsuspend so that the exited worker is reaped.
+static void _triplestore_prefork_child(int sig) {
+	if (0) {
+		fprintf(stderr, "caught signal %d\n", sig);
+	}
+}
+
+// Forks a worker process running threads pool threads, which restores the signal mask to mask. Returns its pid, or
+// -1 if it can't be started.
+static pid_t _triplestore_prefork_worker(triplestore_server_t* s, int threads, const sigset_t* mask) {
+	pid_t pid	= fork();
+	if (pid < 0) {
+		perror("Fork error");
+	}
+	if (pid != 0) {
+		return pid;
 	}
 	
-	size_t total		= 0;
-	assert(length < server->buffer_size);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	sigprocmask(SIG_SETMASK, mask, NULL);
+	s->pool	= triplestore_new_pool(threads);
+	if (!s->pool || _triplestore_server_listen(s)) {
+		_exit(1);
+	}
+	_exit(_triplestore_server_loop(s));
+}
 
-	const size_t needed	= length;
-	char* buffer		= calloc(1, server->buffer_size);
-	while (total < needed) {
-		size_t bytes	= fread(&(buffer[total]), 1, needed-total, in);
-//		fprintf(stderr, "- %zu\n", bytes);
-		if (bytes == 0) {
+// Serves from workers worker processes (or one per online CPU if workers is not positive), returning once they have
+// all exited. SIGTERM or SIGINT stops the workers. Returns 0 if the workers were stopped, and 1 if they exited on their
+// own (e.g. because they couldn't bind the port).
+int triplestore_run_prefork_server(triplestore_server_t* s, int workers) {
+	long cpus	= sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 0) {
+		cpus	= 1;
+	}
+	if (workers <= 0) {
+		workers	= (int) cpus;
+	}
+	int threads	= (cpus > workers) ? (int) (cpus / workers) : 1;
+	
+	pid_t* pids			= calloc(workers, sizeof(pid_t));
+	uint64_t* started	= calloc(workers, sizeof(uint64_t));
+	int* failures		= calloc(workers, sizeof(int));
+	if (!pids || !started || !failures) {
+		fprintf(stderr, "*** Failed to allocate memory for worker processes\n");
+		free(pids);
+		free(started);
+		free(failures);
+		return 1;
+	}
+	
+	// threads don't survive fork, so each worker starts a pool of its own
+	if (s->pool) {
+		triplestore_free_pool(s->pool);
+		s->pool	= NULL;
+	}
+	
+	// the signals are blocked except while the master is suspended, so one can't arrive between checking for it and
+	// waiting
+	sigset_t blocked, mask;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGTERM);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &blocked, &mask);
+	
+	_triplestore_prefork_stopping	= 0;
+	struct sigaction sa	= { .sa_handler = _triplestore_prefork_stop };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler	= _triplestore_prefork_child;
+	sigaction(SIGCHLD, &sa, NULL);
+	
+	int running	= 0;
+	for (int i = 0; i < workers; i++) {
+		pids[i]		= _triplestore_prefork_worker(s, threads, &mask);
+		started[i]	= _triplestore_metrics_now();
+		if (pids[i] > 0) {
+			running++;
+		}
+	}
+	if (running > 0) {
+		_triplestore_server_announce(s);
+		fprintf(stderr, "Started %d worker processes\n", running);
+	}
+	
+	int stopped	= 0;
+	while (running > 0) {
+		if (_triplestore_prefork_stopping && !stopped) {
+			for (int i = 0; i < workers; i++) {
+				if (pids[i] > 0) {
+					kill(pids[i], SIGTERM);
+				}
+			}
+			stopped	= 1;
+		}
+		
+		int status;
+		pid_t pid	= waitpid(-1, &status, WNOHANG);
+		if (pid < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Wait error");
 			break;
+		} else if (pid == 0) {
+			sigsuspend(&mask);
+			continue;
+		}
+		for (int i = 0; i < workers; i++) {
+			if (pids[i] != pid) {
+				continue;
+			}
+			pids[i]	= 0;
+			running--;
+			// a worker that crashed is replaced, but not one that failed to start or was stopped, nor one that keeps
+			// crashing soon after it starts
+			if (WIFSIGNALED(status) && !_triplestore_prefork_stopping) {
+				uint64_t now	= _triplestore_metrics_now();
+				failures[i]		= (now - started[i] < PREFORK_MIN_UPTIME * 1000000) ? failures[i] + 1 : 0;
+				if (failures[i] >= PREFORK_MAX_FAILURES) {
+					fprintf(stderr, "*** Worker process %d was terminated by signal %d; not restarting it after %d crashes in a row soon after starting\n", (int) pid, WTERMSIG(status), failures[i]);
+					continue;
+				}
+				fprintf(stderr, "*** Worker process %d was terminated by signal %d; restarting it\n", (int) pid, WTERMSIG(status));
+				pids[i]		= _triplestore_prefork_worker(s, threads, &mask);
+				started[i]	= now;
+				if (pids[i] > 0) {
+					running++;
+				}
+			}
+		}
+	}
+	
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	free(pids);
+	free(started);
+	free(failures);
+	return _triplestore_prefork_stopping ? 0 : 1;
+}
+
+static int triplestore_print_tsv_term(struct command_ctx_s* ctx, triplestore_t* t, nodeid_t id, FILE* f) {
+	if (id > t->nodes_used) {
+		ctx->set_error(-1, "Undefined term ID found in query result");
+		return 1;
+	}
+	return triplestore_write_term(t, id, f);
+}
+
+static int write_tsv_result(struct command_ctx_s* ctx, FILE* f, triplestore_t* t, query_t* query, binding_t* result) {
+	if (f != NULL) {
+		int vars	= triplestore_query_get_max_variables(query);
+		int written	= 0;
+		for (int j = 1; j <= vars; j++) {
+			if (!is_result_variable(query, j)) {
+				continue;
+			}
+			if (written++ > 0) {
+				fputc('\t', f);
+			}
+			nodeid_t id = (nodeid_t) result[j];
+// 			fprintf(f, "(%"PRIu32")", id);
+			if (id > 0) {
+				triplestore_print_tsv_term(ctx, t, id, f);
+			}
+		}
+		fputc('\n', f);
+	}
+	return 0;
+}
+
+#pragma mark -
+#pragma mark Binary Results
+
+// Binary results (application/x-triplestore-results) are a sequence of records, with integers in network byte order.
+// The response starts with the cookie "3SRB" and a version number (uint32 1), and each record then starts with a tag:
+//
+//	'V' count:uint32 (length:uint32 name)*			names of the result variables
+//	'T' id:uint32 type:uint8 length:uint32 value	a term, sent once per response before the first row that uses it.
+//													type is 1 (IRI), 2 (blank node, value is its label), 3 (string
+//													literal), 4 (language literal, followed by length:uint8 language) or
+//													5 (typed literal, followed by the datatype IRI's id:uint32)
+//	'R' id:uint32*									a result row, with one term id per variable (0 if unbound)
+//	'M' length:uint32 message						output of a command other than a query
+//	'E'												the end of the results
+
+static void write_binary_u32(FILE* f, uint32_t value) {
+	uint32_t n	= htonl(value);
+	fwrite(&n, sizeof(uint32_t), 1, f);
+}
+
+static void write_binary_string(FILE* f, const char* value, size_t length) {
+	write_binary_u32(f, (uint32_t) length);
+	fwrite(value, 1, length, f);
+}
+
+static void write_binary_preamble(triplestore_response_t* res) {
+	if (!res->started_results) {
+		res->started_results	= 1;
+		fwrite("3SRB", 1, 4, res->out);
+		write_binary_u32(res->out, 1);
+	}
+}
+
+static int write_binary_term(struct command_ctx_s* ctx, triplestore_response_t* res, triplestore_t* t, nodeid_t id) {
+	if (id > t->nodes_used) {
+		ctx->set_error(-1, "Undefined term ID found in query result");
+		return 1;
+	}
+	if (!res->sent) {
+		res->sent	= calloc(sizeof(uint64_t), 1 + t->nodes_used / 64);
+		if (!res->sent) {
+			ctx->set_error(-1, "Failed to allocate memory for binary results");
+			return 1;
 		}
-		total			+= bytes;
 	}
+	if (res->sent[id / 64] & (1ULL << (id % 64))) {
+		return 0;
+	}
+	res->sent[id / 64]	|= (1ULL << (id % 64));
 	
-//	fprintf(stderr, "read %zu query bytes\n", total);
-	if ((total == 0) || buffer[total] != '\0') {
-		free(buffer);
+	FILE* f				= res->out;
+	rdf_term_t* term	= t->graph[id]._term;
+	if (term->type == TERM_TYPED_LITERAL && write_binary_term(ctx, res, t, term->vtype.value_type.value_id)) {
 		return 1;
 	}
 	
-	int r	= triplestore_run_query(server, t, buffer, out);
-	free(buffer);
-	return r;
+	fputc('T', f);
+	write_binary_u32(f, id);
+	fputc((uint8_t) term->type, f);
+	if (term->type == TERM_BLANK) {
+		char prefix[16];
+		int n		= snprintf(prefix, sizeof(prefix), "b%"PRIu32"b", (uint32_t) term->vtype.value_type.value_id);
+		size_t len	= strlen(term->value);
+		write_binary_u32(f, (uint32_t) (n + len));
+		fwrite(prefix, 1, n, f);
+		fwrite(term->value, 1, len, f);
+	} else {
+		write_binary_string(f, term->value, strlen(term->value));
+	}
+	if (term->type == TERM_LANG_LITERAL) {
+		const char* lang	= (const char*) &(term->vtype.value_lang);
+		size_t len			= strlen(lang);
+		fputc((uint8_t) len, f);
+		fwrite(lang, 1, len, f);
+	} else if (term->type == TERM_TYPED_LITERAL) {
+		write_binary_u32(f, term->vtype.value_type.value_id);
+	}
+	return 0;
+}
+
+static int write_binary_results_header(triplestore_response_t* res, query_t* query) {
+	FILE* f		= res->out;
+	int vars	= triplestore_query_get_max_variables(query);
+	uint32_t count	= 0;
+	for (int j = 1; j <= vars; j++) {
+		count	+= is_result_variable(query, j);
+	}
+	write_binary_preamble(res);
+	fputc('V', f);
+	write_binary_u32(f, count);
+	for (int j = 1; j <= vars; j++) {
+		if (is_result_variable(query, j)) {
+			write_binary_string(f, query->variable_names[j], strlen(query->variable_names[j]));
+		}
+	}
+	return 0;
+}
+
+static int write_binary_result(struct command_ctx_s* ctx, triplestore_response_t* res, triplestore_t* t, query_t* query, binding_t* result) {
+	FILE* f		= res->out;
+	int vars	= triplestore_query_get_max_variables(query);
+	for (int j = 1; j <= vars; j++) {
+		nodeid_t id = (nodeid_t) result[j];
+		if (id > 0 && is_result_variable(query, j) && write_binary_term(ctx, res, t, id)) {
+			return 1;
+		}
+	}
+	fputc('R', f);
+	for (int j = 1; j <= vars; j++) {
+		if (is_result_variable(query, j)) {
+			write_binary_u32(f, (uint32_t) result[j]);
+		}
+	}
+	return 0;
+}
+
+#pragma mark -
+#pragma mark SPARQL Results
+
+// Replacements for the bytes that must be escaped in JSON strings.
+static const char* const json_escapes[256]	= {
+	[0x00] = "\\u0000", [0x01] = "\\u0001", [0x02] = "\\u0002", [0x03] = "\\u0003", [0x04] = "\\u0004", [0x05] = "\\u0005",
+	[0x06] = "\\u0006", [0x07] = "\\u0007", [0x0b] = "\\u000b", [0x0e] = "\\u000e", [0x0f] = "\\u000f", [0x10] = "\\u0010",
+	[0x11] = "\\u0011", [0x12] = "\\u0012", [0x13] = "\\u0013", [0x14] = "\\u0014", [0x15] = "\\u0015", [0x16] = "\\u0016",
+	[0x17] = "\\u0017", [0x18] = "\\u0018", [0x19] = "\\u0019", [0x1a] = "\\u001a", [0x1b] = "\\u001b", [0x1c] = "\\u001c",
+	[0x1d] = "\\u001d", [0x1e] = "\\u001e", [0x1f] = "\\u001f",
+	['\b'] = "\\b", ['\t'] = "\\t", ['\n'] = "\\n", ['\f'] = "\\f", ['\r'] = "\\r",
+	['"'] = "\\\"", ['\\'] = "\\\\",
+};
+
+// Replacements for the bytes that must be escaped in XML text and attribute values (control characters that XML 1.0
+// cannot represent are dropped).
+static const char* const xml_escapes[256]	= {
+	[0x00] = "", [0x01] = "", [0x02] = "", [0x03] = "", [0x04] = "", [0x05] = "", [0x06] = "", [0x07] = "",
+	[0x08] = "", [0x0b] = "", [0x0c] = "", [0x0e] = "", [0x0f] = "", [0x10] = "", [0x11] = "", [0x12] = "",
+	[0x13] = "", [0x14] = "", [0x15] = "", [0x16] = "", [0x17] = "", [0x18] = "", [0x19] = "", [0x1a] = "",
+	[0x1b] = "", [0x1c] = "", [0x1d] = "", [0x1e] = "", [0x1f] = "",
+	['<'] = "&lt;", ['>'] = "&gt;", ['&'] = "&amp;", ['"'] = "&quot;",
+};
+
+// Writes value to f, replacing each byte that has an entry in escapes.
+static void write_escaped(FILE* f, const char* value, const char* const* escapes) {
+	const char* run	= value;
+	const char* p	= value;
+	for (; *p; p++) {
+		const char* e	= escapes[(unsigned char) *p];
+		if (e) {
+			fwrite(run, 1, p - run, f);
+			fputs(e, f);
+			run	= p + 1;
+		}
+	}
+	fwrite(run, 1, p - run, f);
+}
+
+static int write_json_results_header(triplestore_response_t* res, query_t* query) {
+	FILE* f		= res->out;
+	int vars	= triplestore_query_get_max_variables(query);
+	res->started_results	= 1;
+	int written	= 0;
+	fputs("{\"head\":{\"vars\":[", f);
+	for (int j = 1; j <= vars; j++) {
+		if (!is_result_variable(query, j)) {
+			continue;
+		}
+		fputs((written++ > 0) ? ",\"" : "\"", f);
+		write_escaped(f, query->variable_names[j], json_escapes);
+		fputc('"', f);
+	}
+	fputs("]},\"results\":{\"bindings\":[\n", f);
+	return 0;
+}
+
+static int write_json_term(FILE* f, triplestore_t* t, rdf_term_t* term) {
+	switch (term->type) {
+		case TERM_IRI:
+			fputs("{\"type\":\"uri\",\"value\":\"", f);
+			break;
+		case TERM_BLANK:
+			fprintf(f, "{\"type\":\"bnode\",\"value\":\"b%"PRIu32"b", (uint32_t) term->vtype.value_type.value_id);
+			break;
+		default:
+			fputs("{\"type\":\"literal\",\"value\":\"", f);
+			break;
+	}
+	write_escaped(f, term->value, json_escapes);
+	fputc('"', f);
+	if (term->type == TERM_LANG_LITERAL) {
+		fputs(",\"xml:lang\":\"", f);
+		write_escaped(f, (const char*) &(term->vtype.value_lang), json_escapes);
+		fputc('"', f);
+	} else if (term->type == TERM_TYPED_LITERAL) {
+		fputs(",\"datatype\":\"", f);
+		write_escaped(f, t->graph[term->vtype.value_type.value_id]._term->value, json_escapes);
+		fputc('"', f);
+	}
+	fputc('}', f);
+	return 0;
+}
+
+static int write_json_result(struct command_ctx_s* ctx, triplestore_response_t* res, triplestore_t* t, query_t* query, binding_t* result) {
+	FILE* f		= res->out;
+	int vars	= triplestore_query_get_max_variables(query);
+	int bound	= 0;
+	fputs((res->rows > 0) ? ",\n{" : "{", f);
+	for (int j = 1; j <= vars; j++) {
+		nodeid_t id = (nodeid_t) result[j];
+		if (id == 0 || !is_result_variable(query, j)) {
+			continue;
+		} else if (id > t->nodes_used) {
+			ctx->set_error(-1, "Undefined term ID found in query result");
+			continue;
+		}
+		fputs((bound++ > 0) ? ",\"" : "\"", f);
+		write_escaped(f, query->variable_names[j], json_escapes);
+		fputs("\":", f);
+		write_json_term(f, t, t->graph[id]._term);
+	}
+	fputc('}', f);
+	return 0;
+}
+
+static int write_xml_results_header(triplestore_response_t* res, query_t* query) {
+	FILE* f		= res->out;
+	int vars	= triplestore_query_get_max_variables(query);
+	res->started_results	= 1;
+	fputs("<?xml version=\"1.0\"?>\n<sparql xmlns=\"http://www.w3.org/2005/sparql-results#\">\n<head>\n", f);
+	for (int j = 1; j <= vars; j++) {
+		if (!is_result_variable(query, j)) {
+			continue;
+		}
+		fputs("<variable name=\"", f);
+		write_escaped(f, query->variable_names[j], xml_escapes);
+		fputs("\"/>\n", f);
+	}
+	fputs("</head>\n<results>\n", f);
+	return 0;
+}
+
+static int write_xml_term(FILE* f, triplestore_t* t, rdf_term_t* term) {
+	switch (term->type) {
+		case TERM_IRI:
+			fputs("<uri>", f);
+			write_escaped(f, term->value, xml_escapes);
+			fputs("</uri>", f);
+			return 0;
+		case TERM_BLANK:
+			fprintf(f, "<bnode>b%"PRIu32"b", (uint32_t) term->vtype.value_type.value_id);
+			write_escaped(f, term->value, xml_escapes);
+			fputs("</bnode>", f);
+			return 0;
+		case TERM_LANG_LITERAL:
+			fputs("<literal xml:lang=\"", f);
+			write_escaped(f, (const char*) &(term->vtype.value_lang), xml_escapes);
+			fputs("\">", f);
+			break;
+		case TERM_TYPED_LITERAL:
+			fputs("<literal datatype=\"", f);
+			write_escaped(f, t->graph[term->vtype.value_type.value_id]._term->value, xml_escapes);
+			fputs("\">", f);
+			break;
+		default:
+			fputs("<literal>", f);
+			break;
+	}
+	write_escaped(f, term->value, xml_escapes);
+	fputs("</literal>", f);
+	return 0;
+}
+
+static int write_xml_result(struct command_ctx_s* ctx, triplestore_response_t* res, triplestore_t* t, query_t* query, binding_t* result) {
+	FILE* f		= res->out;
+	int vars	= triplestore_query_get_max_variables(query);
+	fputs("<result>", f);
+	for (int j = 1; j <= vars; j++) {
+		nodeid_t id = (nodeid_t) result[j];
+		if (id == 0 || !is_result_variable(query, j)) {
+			continue;
+		} else if (id > t->nodes_used) {
+			ctx->set_error(-1, "Undefined term ID found in query result");
+			continue;
+		}
+		fputs("<binding name=\"", f);
+		write_escaped(f, query->variable_names[j], xml_escapes);
+		fputs("\">", f);
+		write_xml_term(f, t, t->graph[id]._term);
+		fputs("</binding>", f);
+	}
+	fputs("</result>\n", f);
+	return 0;
+}
+
+#pragma mark -
+
+static int write_results_header(triplestore_response_t* res, query_t* query) {
+	switch (res->format) {
+		case RESULTS_BINARY:
+			return write_binary_results_header(res, query);
+		case RESULTS_JSON:
+			return write_json_results_header(res, query);
+		case RESULTS_XML:
+			return write_xml_results_header(res, query);
+		default:
+			return write_tsv_results_header(res->out, query);
+	}
+}
+
+static int serialize_result(struct command_ctx_s* ctx, triplestore_response_t* res, triplestore_t* t, query_t* query, binding_t* result) {
+	int r;
+	switch (res->format) {
+		case RESULTS_BINARY:
+			r	= write_binary_result(ctx, res, t, query, result);
+			break;
+		case RESULTS_JSON:
+			r	= write_json_result(ctx, res, t, query, result);
+			break;
+		case RESULTS_XML:
+			r	= write_xml_result(ctx, res, t, query, result);
+			break;
+		default:
+			r	= write_tsv_result(ctx, res->out, t, query, result);
+			break;
+	}
+	res->rows++;
+	return r;
+}
+
+// Serializes a result, reading the clock only for every METRICS_SAMPLE'th one (as doing it for every row would cost
+// about as much as serializing it) and adding the time spent on those to *sampled.
+static int serialize_sampled_result(struct command_ctx_s* ctx, triplestore_response_t* res, triplestore_t* t, query_t* query, binding_t* result, uint64_t* sampled) {
+	if (res->rows % METRICS_SAMPLE) {
+		return serialize_result(ctx, res, t, query, result);
+	}
+	uint64_t started	= _triplestore_metrics_now();
+	int r				= serialize_result(ctx, res, t, query, result);
+	*sampled			+= _triplestore_metrics_now() - started;
+	return r;
+}
+
+static int write_output(triplestore_response_t* res, const char* message) {
+	switch (res->format) {
+		case RESULTS_BINARY:
+			write_binary_preamble(res);
+			fputc('M', res->out);
+			write_binary_string(res->out, message, strlen(message));
+			return 0;
+		case RESULTS_JSON:
+		case RESULTS_XML:
+			// the output of commands other than queries (e.g. size) is not a results document, so it is sent as text
+			if (!res->started) {
+				res->content_type	= "text/plain";
+			}
+			fprintf(res->out, "%s", message);
+			return 0;
+		default:
+			fprintf(res->out, "%s", message);
+			return 0;
+	}
+}
+
+static int write_results_end(triplestore_response_t* res) {
+	switch (res->format) {
+		case RESULTS_BINARY:
+			write_binary_preamble(res);
+			fputc('E', res->out);
+			return 0;
+		case RESULTS_JSON:
+			if (res->started_results) {
+				fputs("\n]}}\n", res->out);
+			}
+			return 0;
+		case RESULTS_XML:
+			if (res->started_results) {
+				fputs("</results>\n</sparql>\n", res->out);
+			}
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+// Splits a command line into its space-separated arguments (in place, keeping quoted strings whole). Returns 0, or the
+// HTTP status to respond with if the line can't be split.
+static int split_command_line(char* ptr, size_t length, int* argcp, char*** argvp) {
+	long linelen	= length + 1;
+	int argc_max	= 16;
+	char** argv		= calloc(sizeof(char*), argc_max);
+	if (!argv) {
+		return 500;
+	}
+	int argc		= 0;
+	argv[argc++]	= ptr;
+	for (int i = 1; i < (linelen-1); i++) {
+		if (ptr[i] == '\0') {
+			free(argv);
+			if (0) {
+				fprintf(stderr, "Unexpected NULL byte in triplestore_run_query\n");
+			}
+			return 400;
+		} else if (ptr[i] == ' ') {
+			ptr[i]	= '\0';
+		} else if (ptr[i-1] == '\0') {
+			if (argc >= argc_max) {
+				argc_max	*= 2;
+				char** expanded	= realloc(argv, sizeof(char*) * argc_max);
+				if (!expanded) {
+					free(argv);
+					return 500;
+				}
+				argv	= expanded;
+			}
+			char* p = &(ptr[i]);
+			argv[argc++]	= p;
+			if ('"' == ptr[i]) {
+				while (ptr[i]) {
+					if ('\\' == ptr[i]) {
+						i++;
+						if ('\0' == ptr[i]) {
+							break;
+						}
+					}
+					i++;
+					if ('"' == ptr[i]) {
+						break;
+					}
+				}
+			}
+		}
+	}
+	*argcp	= argc;
+	*argvp	= argv;
+	return 0;
+}
+
+int triplestore_run_query(triplestore_server_t* s, triplestore_t* t, triplestore_request_body_t* body, triplestore_response_t* res) {
+	uint64_t start				= _triplestore_metrics_now();
+	__block uint64_t sampled	= 0;
+	__block struct command_ctx_s ctx	= {
+		.sandbox			= 1,
+		.error				= 0,
+		.error_message		= NULL,
+		.start				= triplestore_current_time(),
+		.constructing		= 0,
+		.query				= NULL,
+		.pool				= s->pool,
+	};
+	
+	ctx.preamble_block		= ^(query_t* query){
+		write_results_header(res, query);
+	};
+	
+	ctx.custom_output		= ^(const char* message){
+		write_output(res, message);
+	};
+	
+	ctx.result_block		= ^(query_t* query, binding_t* final_match){
+		serialize_sampled_result(&ctx, res, t, query, final_match, &sampled);
+	};
+	
+	ctx.set_error	= ^(int code, const char* message){
+		if (0) {
+			fprintf(stderr, "*** set_error called: (%d) %s\n", code, message);
+		}
+		server_ctx_set_error(&ctx, (char*) message);
+	};
+	
+	int output		= 0;
+	uint64_t parse	= 0;
+	
+	// the command's results are looked up in (and then added to) the result cache by its results format and
+	// normalized text
+	triplestore_cache_key_t key	= { 0 };
+	triplestore_cache_capture_t cap	= { 0 };
+	
+	// each command is run as soon as its line has arrived, so the body never has to be held in memory all at once
+	while (1) {
+		char* ptr;
+		size_t length;
+		int status	= _triplestore_request_read_line(body, &ptr, &length);
+		if (status <= 0) {
+			if (ctx.query) {
+				triplestore_free_query(ctx.query);
+				ctx.query	= NULL;
+			}
+			if (status < 0) {
+				free(key.text);
+				write_http_error_header(&ctx, res, body->code, body->message);
+				return 1;
+			}
+			break;
+		}
+		
+		int argc;
+		char** argv;
+		int code	= split_command_line(ptr, length, &argc, &argv);
+		if (code) {
+			if (ctx.query) {
+				triplestore_free_query(ctx.query);
+				ctx.query	= NULL;
+			}
+			free(key.text);
+			write_http_error_header(&ctx, res, code, (code == 400) ? "Bad Request" : "Internal Server Error");
+			return 1;
+		}
+		
+		int last	= triplestore_output_op(&ctx, argc, argv);
+		if (last) {
+			// the commands that built the query are counted as planning rather than parsing
+			uint64_t plan	= (uint64_t) (ctx.plan_time * 1000000);
+			parse			= _triplestore_metrics_now() - start;
+			parse			= (parse > plan) ? parse - plan : 0;
+			if (s->use_http) {
+				write_http_header(res, 200, "OK", results_content_type(res->format));
+			}
+			output++;
+		}
+		
+		if (argc == 1 && !strcmp(argv[0], "")) {
+			free(argv);
+			continue;
+		}
+		
+		if (s->cache.budget > 0) {
+			_triplestore_cache_key_append(&key, res->format, argc, argv);
+			if (last && !key.failed) {
+				triplestore_cached_result_t* e	= _triplestore_cache_get(&s->cache, &key);
+				triplestore_metrics_t* m		= _triplestore_metrics(s);
+				_triplestore_metrics_add(e ? &(m->cache_hits) : &(m->cache_misses), 1);
+				if (e) {
+					_triplestore_metrics_observe(m, PHASE_PARSE, parse);
+					_triplestore_metrics_observe(m, PHASE_PLAN, (uint64_t) (ctx.plan_time * 1000000));
+					_triplestore_metrics_add(&(m->rows), e->rows);
+					if (ctx.query) {
+						triplestore_free_query(ctx.query);
+						ctx.query	= NULL;
+					}
+					if (e->content_type) {
+						res->content_type	= e->content_type;
+					}
+					if (e->length > 0) {
+						fwrite(e->output, 1, e->length, res->out);
+					}
+					_triplestore_cache_release(&s->cache, e);
+					free(argv);
+					free(key.text);
+					return 0;
+				}
+				_triplestore_cache_capture(&s->cache, res, &cap);
+			}
+		}
+		
+		int r	= triplestore_op(t, &ctx, argc, argv);
+		if (r) {
+			if (ctx.query) {
+				triplestore_free_query(ctx.query);
+				ctx.query	= NULL;
+			}
+			if (0) {
+				fprintf(stderr, "triplestore_op failed in triplestore_run_query\n");
+			}
+			_triplestore_cache_end_capture(&s->cache, res, &cap, &key, 0);
+			free(key.text);
+			write_http_error_header(&ctx, res, 400, "Bad Request");
+			free(argv);
+			return 1;
+		}
+		
+		free(argv);
+		if (ctx.constructing == 0) {
+			break;
+		}
+	}
+
+	if (!output) {
+		if (0) {
+			fprintf(stderr, "No output in triplestore_run_query\n");
+		}
+		free(key.text);
+		write_http_error_header(&ctx, res, 400, "Bad Request");
+		return 1;
+	}
+	
+	write_results_end(res);
+	_triplestore_cache_end_capture(&s->cache, res, &cap, &key, !ctx.error);
+	free(key.text);
+	_triplestore_metrics_query(s, &ctx, res, parse, sampled);
+	return 0;
+}
+
+int triplestore_read_and_run_query(triplestore_server_t* server, FILE* in, FILE* out) {
+	if (!in) {
+		fprintf(stderr, "Missing input file handle in triplestore_read_and_run_query\n");
+		return 1;
+	}
+	
+	triplestore_t* t	= server->t;
+	int length	= 0;
+	results_format_t format	= RESULTS_TSV;
+	triplestore_request_body_t body	= { .in = in, .remaining = SIZE_MAX };
+	if (server->use_http) {
+		if (read_http_header(in, &length, &format) || length <= 0) {
+			return 1;
+		}
+		body.remaining	= length;
+	}
+	
+	triplestore_response_t res	= { .out = out, .use_http = server->use_http, .format = format };
+	int r	= triplestore_run_query(server, t, &body, &res);
+	free(res.sent);
+	free(body.line);
+	return r;
+}
+
+#pragma mark -
+#pragma mark Batches
+
+// The body of a batch request holds any number of commands (one-line commands and begin ... end blocks), and the
+// response is a multipart/mixed document with a part for each command, in order. Each part has its own
+// Content-Type, Content-Length and Status (the status its command would have had as a request of its own).
+//
+// Commands are run on the pool as soon as they have been read, and the request's thread (which evaluates any
+// command that no task has claimed yet, rather than waiting for one to start) writes their parts once the whole
+// body has been read.
+
+typedef enum {
+	BATCH_QUEUED,
+	BATCH_RUNNING,
+	BATCH_DONE,
+} batch_state_t;
+
+typedef struct triplestore_batch_query_s {
+	struct triplestore_batch_s* batch;
+	char* text;				// the command's lines, separated by newlines
+	size_t length;
+	size_t alloc;
+	batch_state_t state;
+	triplestore_response_t res;
+	char* output;
+	size_t output_length;
+} triplestore_batch_query_t;
+
+// Reference counted (by the request's thread and each submitted task) because a queued task may not start until
+// after the request has been answered.
+typedef struct triplestore_batch_s {
+	triplestore_server_t* server;
+	triplestore_t* t;
+	results_format_t format;
+	triplestore_batch_query_t** queries;
+	uint32_t used;
+	uint32_t alloc;
+	int refs;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+} triplestore_batch_t;
+
+static void _triplestore_batch_release(triplestore_batch_t* batch) {
+	pthread_mutex_lock(&batch->lock);
+	int refs	= --batch->refs;
+	pthread_mutex_unlock(&batch->lock);
+	if (refs > 0) {
+		return;
+	}
+	for (uint32_t i = 0; i < batch->used; i++) {
+		triplestore_batch_query_t* q	= batch->queries[i];
+		free(q->text);
+		free(q->output);
+		free(q->res.sent);
+		free(q);
+	}
+	free(batch->queries);
+	pthread_cond_destroy(&batch->done);
+	pthread_mutex_destroy(&batch->lock);
+	free(batch);
+}
+
+static void _triplestore_batch_eval(triplestore_batch_query_t* q) {
+	triplestore_batch_t* batch	= q->batch;
+	q->res	= (triplestore_response_t) {
+		.use_http	= batch->server->use_http,
+		.format		= batch->format,
+		.streaming	= 1,	// only record the status, which goes in the part's header
+		.out		= open_memstream(&(q->output), &(q->output_length)),
+	};
+	FILE* in	= fmemopen(q->text, q->length, "r");
+	if (!q->res.out || !in) {
+		write_http_header(&(q->res), 500, "Internal Server Error", "text/plain");
+	} else {
+		triplestore_request_body_t body	= { .in = in, .remaining = SIZE_MAX };
+		triplestore_run_query(batch->server, batch->t, &body, &(q->res));
+		free(body.line);
+	}
+	if (in) {
+		fclose(in);
+	}
+	if (q->res.out) {
+		fclose(q->res.out);
+		q->res.out	= NULL;
+	}
+	
+	pthread_mutex_lock(&batch->lock);
+	q->state	= BATCH_DONE;
+	pthread_cond_broadcast(&batch->done);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static void _triplestore_batch_run(void* arg) {
+	triplestore_batch_query_t* q	= arg;
+	triplestore_batch_t* batch		= q->batch;
+	pthread_mutex_lock(&batch->lock);
+	int claimed	= (q->state == BATCH_QUEUED);
+	if (claimed) {
+		q->state	= BATCH_RUNNING;
+	}
+	pthread_mutex_unlock(&batch->lock);
+	if (claimed) {
+		_triplestore_batch_eval(q);
+	}
+	_triplestore_batch_release(batch);
+}
+
+// Adds the command being read to the batch and queues it to be run on the pool.
+static int _triplestore_batch_submit(triplestore_batch_t* batch, triplestore_batch_query_t* q) {
+	if (batch->used == batch->alloc) {
+		uint32_t alloc	= batch->alloc ? 2 * batch->alloc : 16;
+		triplestore_batch_query_t** queries	= realloc(batch->queries, alloc * sizeof(triplestore_batch_query_t*));
+		if (!queries) {
+			return 1;
+		}
+		batch->queries	= queries;
+		batch->alloc	= alloc;
+	}
+	q->batch	= batch;
+	batch->queries[batch->used++]	= q;
+	
+	pthread_mutex_lock(&batch->lock);
+	batch->refs++;
+	pthread_mutex_unlock(&batch->lock);
+	if (triplestore_pool_async(batch->server->pool, _triplestore_batch_run, q)) {
+		// the request's thread will run it
+		_triplestore_batch_release(batch);
+	}
+	return 0;
+}
+
+// Waits for the query at index to be done, evaluating queued queries (from index on) in the meantime.
+static void _triplestore_batch_wait(triplestore_batch_t* batch, uint32_t index) {
+	pthread_mutex_lock(&batch->lock);
+	while (batch->queries[index]->state != BATCH_DONE) {
+		triplestore_batch_query_t* q	= NULL;
+		for (uint32_t i = index; i < batch->used && !q; i++) {
+			if (batch->queries[i]->state == BATCH_QUEUED) {
+				q	= batch->queries[i];
+			}
+		}
+		if (q) {
+			q->state	= BATCH_RUNNING;
+			pthread_mutex_unlock(&batch->lock);
+			_triplestore_batch_eval(q);
+			pthread_mutex_lock(&batch->lock);
+		} else {
+			pthread_cond_wait(&batch->done, &batch->lock);
+		}
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
+
+// Tracks where the commands of a batch end. Returns 1 if line ends a command, 0 if it starts or continues one, or -1
+// if it is a blank line or comment between commands.
+static int _triplestore_batch_line(int* constructing, const char* line) {
+	size_t n	= strcspn(line, " ");
+	if (*constructing) {
+		if ((n == 3 && !strncmp(line, "end", 3)) || (n == 3 && !strncmp(line, "agg", 3))) {
+			*constructing	= 0;
+			return 1;
+		}
+		return 0;
+	} else if (n == 0 || line[0] == '#') {
+		return -1;
+	} else if (n == 5 && !strncmp(line, "begin", 5)) {
+		*constructing	= 1;
+		return 0;
+	}
+	return 1;
+}
+
+static int _triplestore_batch_append(triplestore_batch_query_t* q, const char* line, size_t length) {
+	if (q->length + length + 2 > q->alloc) {
+		size_t alloc	= q->alloc ? q->alloc : 256;
+		while (q->length + length + 2 > alloc) {
+			alloc	*= 2;
+		}
+		char* text	= realloc(q->text, alloc);
+		if (!text) {
+			return 1;
+		}
+		q->text		= text;
+		q->alloc	= alloc;
+	}
+	memcpy(&(q->text[q->length]), line, length);
+	q->length	+= length;
+	q->text[q->length++]	= '\n';
+	q->text[q->length]		= '\0';
+	return 0;
+}
+
+static void write_batch_part(triplestore_response_t* res, uint32_t index, triplestore_response_t* part, const char* output, size_t length) {
+	int code			= part->code ? part->code : 200;
+	const char* message	= part->code ? part->message : "OK";
+	const char* type	= part->content_type ? part->content_type : results_content_type(res->format);
+	fprintf(res->out, "--" BATCH_BOUNDARY "\r\n"
+					"Content-Type: %s\r\n"
+					"Content-Length: %zu\r\n"
+					"Content-ID: <query-%"PRIu32">\r\n"
+					"Status: %03d %s\r\n"
+					"\r\n", type, length, index, code, message);
+	fwrite(output, 1, length, res->out);
+	fputs("\r\n", res->out);
+}
+
+int triplestore_run_batch(triplestore_server_t* s, triplestore_t* t, triplestore_request_body_t* body, triplestore_response_t* res) {
+	triplestore_batch_t* batch	= calloc(1, sizeof(triplestore_batch_t));
+	if (!batch) {
+		write_http_error_header(NULL, res, 500, "Internal Server Error");
+		return 1;
+	}
+	batch->server	= s;
+	batch->t		= t;
+	batch->format	= res->format;
+	batch->refs		= 1;
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->done, NULL);
+	
+	int r							= 0;
+	int constructing				= 0;
+	triplestore_batch_query_t* q	= NULL;
+	while (1) {
+		char* line;
+		size_t length;
+		int status	= _triplestore_request_read_line(body, &line, &length);
+		if (status < 0) {
+			r	= 1;
+			break;
+		} else if (status == 0) {
+			// an unfinished begin ... end block is still run, so that its part reports the error
+			if (q && _triplestore_batch_submit(batch, q)) {
+				r	= 1;
+			} else {
+				q	= NULL;
+			}
+			break;
+		}
+		
+		int end	= _triplestore_batch_line(&constructing, line);
+		if (end < 0) {
+			continue;
+		} else if (!q && !(q = calloc(1, sizeof(triplestore_batch_query_t)))) {
+			r	= 1;
+			break;
+		} else if (_triplestore_batch_append(q, line, length)) {
+			r	= 1;
+			break;
+		} else if (end) {
+			if (_triplestore_batch_submit(batch, q)) {
+				r	= 1;
+				break;
+			}
+			q	= NULL;
+		}
+	}
+	if (q) {
+		free(q->text);
+		free(q);
+	}
+	
+	if (r) {
+		if (body->code) {
+			write_http_error_header(NULL, res, body->code, body->message);
+		} else {
+			write_http_error_header(NULL, res, 500, "Internal Server Error");
+		}
+	} else if (batch->used == 0) {
+		write_http_error_header(NULL, res, 400, "Bad Request");
+		r	= 1;
+	} else {
+		write_http_header(res, 200, "OK", "multipart/mixed; boundary=" BATCH_BOUNDARY);
+	}
+	
+	if (r) {
+		// queries that haven't started are dropped, and any that are running finish on their own
+		pthread_mutex_lock(&batch->lock);
+		for (uint32_t i = 0; i < batch->used; i++) {
+			if (batch->queries[i]->state == BATCH_QUEUED) {
+				batch->queries[i]->state	= BATCH_DONE;
+			}
+		}
+		pthread_mutex_unlock(&batch->lock);
+	} else {
+		for (uint32_t i = 0; i < batch->used; i++) {
+			_triplestore_batch_wait(batch, i);
+			triplestore_batch_query_t* part	= batch->queries[i];
+			write_batch_part(res, i, &(part->res), part->output, part->output_length);
+			free(part->output);
+			part->output	= NULL;
+		}
+		fputs("--" BATCH_BOUNDARY "--\r\n", res->out);
+	}
+	_triplestore_batch_release(batch);
+	return r;
+}
+
+#pragma mark -
+#pragma mark Prepared Statements
+
+// POST /prepare registers a begin ... end block as a template, where a term written as $name is a placeholder, and
+// responds with the statement's number. POST /execute/<number> runs it with a body binding each placeholder, one per
+// line ("name term"). Placeholders are variables that are bound before matching starts (so they can appear wherever
+// a variable can), which lets the template's terms be resolved and its query built just once rather than for every
+// execution. They are not among the result's variables.
+
+static void _triplestore_free_plan(triplestore_plan_t* plan) {
+	triplestore_free_query(plan->query);
+	free(plan->params);
+	free(plan);
+}
+
+static void _triplestore_free_statement(triplestore_statement_t* st) {
+	while (st->idle) {
+		triplestore_plan_t* plan	= st->idle;
+		st->idle					= plan->next;
+		_triplestore_free_plan(plan);
+	}
+	for (int i = 0; i < st->params; i++) {
+		free(st->param_names[i]);
+	}
+	free(st->param_names);
+	free(st->text);
+	pthread_mutex_destroy(&st->lock);
+	free(st);
+}
+
+// Builds a query from the statement's template. If that fails, *error is set to the reason.
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter"
+static triplestore_plan_t* _triplestore_build_plan(triplestore_server_t* s, triplestore_t* t, triplestore_statement_t* st, const char** error) {
+	__block struct command_ctx_s ctx	= {
+		.sandbox			= 1,
+		.start				= triplestore_current_time(),
+		.pool				= s->pool,
+	};
+	ctx.preamble_block		= ^(query_t* query){};
+	ctx.custom_output		= ^(const char* message){};
+	ctx.result_block		= ^(query_t* query, binding_t* final_match){};
+	ctx.set_error	= ^(int code, const char* message){
+		server_ctx_set_error(&ctx, (char*) message);
+	};
+	
+	triplestore_plan_t* plan	= calloc(1, sizeof(triplestore_plan_t));
+	char* text					= strdup(st->text);
+	int failed					= (!plan || !text);
+	for (char* line = text; !failed && *line; ) {
+		char* eol	= strchr(line, '\n');
+		*eol		= '\0';
+		int argc;
+		char** argv;
+		if (split_command_line(line, eol - line, &argc, &argv)) {
+			failed	= 1;
+		} else {
+			failed	= (triplestore_op(t, &ctx, argc, argv) || !ctx.constructing);
+			free(argv);
+		}
+		line	= eol + 1;
+	}
+	free(text);
+	
+	if (!failed && ctx.query) {
+		plan->query		= ctx.query;
+		plan->params	= calloc(st->params + 1, sizeof(int64_t));
+		failed			= !plan->params;
+		for (int i = 0; !failed && i < st->params; i++) {
+			size_t n	= strlen(st->param_names[i]);
+			char* var	= malloc(n + 2);
+			if (!var) {
+				failed	= 1;
+				break;
+			}
+			var[0]		= '$';
+			memcpy(&(var[1]), st->param_names[i], n + 1);
+			plan->params[i]	= triplestore_query_get_variable_id(plan->query, var);
+			free(var);
+			if (plan->params[i] == 0) {
+				ctx.set_error(-1, "Placeholders must be used as variables of the query");
+				failed	= 1;
+			}
+		}
+		if (!failed) {
+			return plan;
+		}
+	}
+	
+	*error	= ctx.error_message ? ctx.error_message : "Bad Request";
+	if (ctx.query) {
+		triplestore_free_query(ctx.query);
+	}
+	if (plan) {
+		free(plan->params);
+		free(plan);
+	}
+	return NULL;
+}
+#pragma clang diagnostic pop
+
+// Appends a line of the template to the statement's text, rewriting each placeholder $name as the variable ?$name
+// (a name the template's own variables may not use, so the two can't collide). Returns 400 for a template that uses a
+// reserved variable name, and 500 if memory runs out.
+static int _triplestore_statement_append(triplestore_statement_t* st, int argc, char** argv, size_t* alloc, const char** error) {
+	size_t length	= st->text ? strlen(st->text) : 0;
+	for (int i = 0; i < argc; i++) {
+		size_t n	= strlen(argv[i]);
+		if (argv[i][0] == '?' && argv[i][1] == '$') {
+			*error	= "Variable names starting with $ are reserved for placeholders";
+			return 400;
+		}
+		if (length + n + 3 > *alloc) {
+			size_t size	= *alloc ? *alloc : 256;
+			while (length + n + 3 > size) {
+				size	*= 2;
+			}
+			char* text	= realloc(st->text, size);
+			if (!text) {
+				return 500;
+			}
+			st->text	= text;
+			*alloc		= size;
+		}
+		
+		if (argv[i][0] == '$' && argv[i][1]) {
+			int known	= 0;
+			for (int j = 0; j < st->params && !known; j++) {
+				known	= !strcmp(st->param_names[j], &(argv[i][1]));
+			}
+			if (!known) {
+				char** names	= realloc(st->param_names, (st->params + 1) * sizeof(char*));
+				if (!names) {
+					return 500;
+				}
+				st->param_names	= names;
+				if (!(names[st->params] = strdup(&(argv[i][1])))) {
+					return 500;
+				}
+				st->params++;
+			}
+			st->text[length++]	= '?';
+			memcpy(&(st->text[length]), argv[i], n);
+		} else {
+			memcpy(&(st->text[length]), argv[i], n);
+		}
+		length	+= n;
+		st->text[length++]	= (i + 1 < argc) ? ' ' : '\n';
+		st->text[length]	= '\0';
+	}
+	return 0;
+}
+
+int triplestore_prepare_statement(triplestore_server_t* s, triplestore_t* t, triplestore_request_body_t* body, triplestore_response_t* res) {
+	triplestore_statement_t* st	= calloc(1, sizeof(triplestore_statement_t));
+	if (!st) {
+		write_http_error_header(NULL, res, 500, "Internal Server Error");
+		return 1;
+	}
+	pthread_mutex_init(&st->lock, NULL);
+	
+	const char* error	= NULL;
+	size_t alloc		= 0;
+	int constructing	= 0;
+	int lines			= 0;
+	int ended			= 0;
+	int code			= 0;
+	while (!code) {
+		char* line;
+		size_t length;
+		int status	= _triplestore_request_read_line(body, &line, &length);
+		if (status < 0) {
+			code	= body->code;
+			break;
+		} else if (status == 0) {
+			break;
+		}
+		
+		int end	= _triplestore_batch_line(&constructing, line);
+		if (end < 0) {
+			continue;
+		} else if (ended || (lines++ == 0 && !constructing) || (end && !strncmp(line, "agg", 3))) {
+			// only a single begin ... end block can be prepared
+			code	= 400;
+		} else if (end) {
+			ended	= 1;
+		} else {
+			int argc;
+			char** argv;
+			if ((code = split_command_line(line, length, &argc, &argv))) {
+				break;
+			}
+			code	= _triplestore_statement_append(st, argc, argv, &alloc, &error);
+			free(argv);
+		}
+	}
+	if (!code && !ended) {
+		code	= 400;
+	}
+	
+	triplestore_plan_t* plan	= NULL;
+	if (!code && !(plan = _triplestore_build_plan(s, t, st, &error))) {
+		code	= 400;
+	}
+	if (code) {
+		struct command_ctx_s ctx	= { .error_message = (char*) error };
+		_triplestore_free_statement(st);
+		write_http_error_header(&ctx, res, code, (code == body->code) ? body->message : (code == 400) ? "Bad Request" : "Internal Server Error");
+		return 1;
+	}
+	st->idle	= plan;
+	
+	// preparing the same template again gives the same statement
+	pthread_mutex_lock(&s->statements_lock);
+	uint32_t id	= 0;
+	for (uint32_t i = 0; i < s->statements_used && !id; i++) {
+		if (!strcmp(s->statements[i]->text, st->text)) {
+			id	= i + 1;
+		}
+	}
+	if (id) {
+		_triplestore_free_statement(st);
+	} else if (s->statements_used < SERVER_MAX_STATEMENTS) {
+		if (s->statements_used == s->statements_alloc) {
+			uint32_t size	= s->statements_alloc ? 2 * s->statements_alloc : 16;
+			triplestore_statement_t** statements	= realloc(s->statements, size * sizeof(triplestore_statement_t*));
+			if (statements) {
+				s->statements		= statements;
+				s->statements_alloc	= size;
+			}
+		}
+		if (s->statements_used < s->statements_alloc) {
+			s->statements[s->statements_used++]	= st;
+			id	= s->statements_used;
+		}
+	}
+	pthread_mutex_unlock(&s->statements_lock);
+	
+	if (!id) {
+		_triplestore_free_statement(st);
+		write_http_error_header(NULL, res, 503, "Service Unavailable");
+		return 1;
+	}
+	write_http_header(res, 200, "OK", "text/plain");
+	fprintf(res->out, "%"PRIu32"\n", id);
+	return 0;
+}
+
+int triplestore_execute_statement(triplestore_server_t* s, triplestore_t* t, uint32_t id, triplestore_request_body_t* body, triplestore_response_t* res) {
+	uint64_t start				= _triplestore_metrics_now();
+	__block uint64_t sampled	= 0;
+	triplestore_statement_t* st	= NULL;
+	pthread_mutex_lock(&s->statements_lock);
+	if (id > 0 && id <= s->statements_used) {
+		st	= s->statements[id - 1];
+	}
+	pthread_mutex_unlock(&s->statements_lock);
+	if (!st) {
+		write_http_error_header(NULL, res, 404, "Not Found");
+		return 1;
+	}
+	
+	pthread_mutex_lock(&st->lock);
+	triplestore_plan_t* plan	= st->idle;
+	if (plan) {
+		st->idle	= plan->next;
+	}
+	pthread_mutex_unlock(&st->lock);
+	const char* error	= NULL;
+	if (!plan && !(plan = _triplestore_build_plan(s, t, st, &error))) {
+		write_http_error_header(NULL, res, 500, "Internal Server Error");
+		return 1;
+	}
+	
+	__block struct command_ctx_s ctx	= {
+		.sandbox			= 1,
+		.start				= triplestore_current_time(),
+		.pool				= s->pool,
+	};
+	
+	ctx.preamble_block		= ^(query_t* query){
+		write_results_header(res, query);
+	};
+	
+	ctx.custom_output		= ^(const char* message){
+		write_output(res, message);
+	};
+	
+	ctx.result_block		= ^(query_t* query, binding_t* final_match){
+		serialize_sampled_result(&ctx, res, t, query, final_match, &sampled);
+	};
+	
+	ctx.set_error	= ^(int code, const char* message){
+		if (0) {
+			fprintf(stderr, "*** set_error called: (%d) %s\n", code, message);
+		}
+		server_ctx_set_error(&ctx, (char*) message);
+	};
+	
+	int code			= 0;
+	int absent			= 0;	// a parameter is bound to a term the store doesn't have, so there are no results
+	binding_t* bindings	= calloc(1 + triplestore_query_get_max_variables(plan->query), sizeof(binding_t));
+	char* given			= calloc(1 + st->params, 1);
+	if (!bindings || !given) {
+		code	= 500;
+	}
+	while (!code) {
+		char* line;
+		size_t length;
+		int status	= _triplestore_request_read_line(body, &line, &length);
+		if (status < 0) {
+			code	= body->code;
+			break;
+		} else if (status == 0) {
+			break;
+		} else if (length == 0 || line[0] == '#') {
+			continue;
+		}
+		
+		char* term	= strchr(line, ' ');
+		if (!term) {
+			code	= 400;
+			break;
+		}
+		*(term++)	= '\0';
+		term		+= strspn(term, " ");
+		const char* name	= (line[0] == '$' || line[0] == '?') ? &(line[1]) : line;
+		int param			= -1;
+		for (int i = 0; i < st->params && param < 0; i++) {
+			if (!strcmp(st->param_names[i], name)) {
+				param	= i;
+			}
+		}
+		if (param < 0 || term[0] == '?' || term[0] == '$') {
+			ctx.set_error(-1, "Parameters must bind a placeholder of the statement to a term");
+			code	= 400;
+		} else {
+			nodeid_t node	= 0;
+			if (query_term_id(t, term, &node)) {
+				ctx.set_error(-1, "Parameters must be bound to an IRI or literal");
+				code	= 400;
+			} else if (node == 0) {
+				absent++;
+			}
+			bindings[-plan->params[param]]	= node;
+			given[param]	= 1;
+		}
+	}
+	for (int i = 0; !code && i < st->params; i++) {
+		if (!given[i]) {
+			ctx.set_error(-1, "Missing parameter");
+			code	= 400;
+		}
+	}
+	
+	int r	= 0;
+	if (code) {
+		write_http_error_header(&ctx, res, code, (code == body->code) ? body->message : (code == 400) ? "Bad Request" : "Internal Server Error");
+		r	= 1;
+	} else {
+		uint64_t parse	= _triplestore_metrics_now() - start;
+		if (s->use_http) {
+			write_http_header(res, 200, "OK", results_content_type(res->format));
+		}
+		if (absent) {
+			write_results_header(res, plan->query);
+		} else {
+			triplestore_run_bound_query(t, plan->query, bindings, &ctx);
+		}
+		write_results_end(res);
+		_triplestore_metrics_query(s, &ctx, res, parse, sampled);
+	}
+	free(bindings);
+	free(given);
+	
+	pthread_mutex_lock(&st->lock);
+	plan->next	= st->idle;
+	st->idle	= plan;
+	pthread_mutex_unlock(&st->lock);
+	return r;
+}
+
+#pragma mark -
+#pragma mark Result Cache
+
+// While serving, the store is read-only, so running the same command again always gives the same response. The
+// result cache keeps the serialized bodies of recent responses (keyed by the results format and the command's text,
+// with runs of spaces, blank lines and comments removed) and evicts the least recently used when their total size
+// exceeds the cache's budget. A response too large to take more than a sixteenth of the budget isn't kept.
+
+static void _triplestore_cache_init(triplestore_result_cache_t* cache, size_t budget) {
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->budget	= budget;
+}
+
+static void _triplestore_cache_free_entry(triplestore_cached_result_t* e) {
+	free(e->key);
+	free(e->output);
+	free(e);
+}
+
+static void _triplestore_cache_destroy(triplestore_result_cache_t* cache) {
+	triplestore_cached_result_t* e	= cache->newest;
+	while (e) {
+		triplestore_cached_result_t* older	= e->older;
+		_triplestore_cache_free_entry(e);
+		e	= older;
+	}
+	free(cache->buckets);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+// FNV-1a
+static uint64_t _triplestore_cache_hash(const char* key, size_t length) {
+	uint64_t hash	= 14695981039346656037ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash	^= (unsigned char) key[i];
+		hash	*= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static void _triplestore_cache_key_add(triplestore_cache_key_t* key, const char* bytes, size_t length) {
+	if (key->failed) {
+		return;
+	}
+	if (key->length + length > key->alloc) {
+		size_t alloc	= key->alloc ? 2 * key->alloc : 256;
+		while (alloc < key->length + length) {
+			alloc	*= 2;
+		}
+		char* text	= realloc(key->text, alloc);
+		if (!text) {
+			key->failed	= 1;
+			return;
+		}
+		key->text	= text;
+		key->alloc	= alloc;
+	}
+	memcpy(&(key->text[key->length]), bytes, length);
+	key->length	+= length;
+}
+
+// Appends a command line to key (which starts with the results format), with its arguments separated by single
+// spaces. Comments are left out.
+static void _triplestore_cache_key_append(triplestore_cache_key_t* key, results_format_t format, int argc, char** argv) {
+	if (key->length == 0) {
+		char f	= (char) format;
+		_triplestore_cache_key_add(key, &f, 1);
+	}
+	if (argv[0][0] == '#') {
+		return;
+	}
+	int first	= 1;
+	for (int i = 0; i < argc; i++) {
+		if (argv[i][0] == '\0') {
+			continue;
+		}
+		if (!first) {
+			_triplestore_cache_key_add(key, " ", 1);
+		}
+		_triplestore_cache_key_add(key, argv[i], strlen(argv[i]));
+		first	= 0;
+	}
+	_triplestore_cache_key_add(key, "\n", 1);
+}
+
+static void _triplestore_cache_unlink(triplestore_result_cache_t* cache, triplestore_cached_result_t* e) {
+	if (e->newer) {
+		e->newer->older	= e->older;
+	} else {
+		cache->newest	= e->older;
+	}
+	if (e->older) {
+		e->older->newer	= e->newer;
+	} else {
+		cache->oldest	= e->newer;
+	}
+	e->newer	= NULL;
+	e->older	= NULL;
+}
+
+static void _triplestore_cache_push(triplestore_result_cache_t* cache, triplestore_cached_result_t* e) {
+	e->older	= cache->newest;
+	if (cache->newest) {
+		cache->newest->newer	= e;
+	} else {
+		cache->oldest	= e;
+	}
+	cache->newest	= e;
+}
+
+static size_t _triplestore_cache_entry_size(triplestore_cached_result_t* e) {
+	return sizeof(triplestore_cached_result_t) + e->key_length + e->length;
+}
+
+// Returns the entry for key (which the caller must release), or NULL if it isn't cached.
+static triplestore_cached_result_t* _triplestore_cache_get(triplestore_result_cache_t* cache, triplestore_cache_key_t* key) {
+	uint64_t hash	= _triplestore_cache_hash(key->text, key->length);
+	pthread_mutex_lock(&cache->lock);
+	triplestore_cached_result_t* e	= NULL;
+	if (cache->buckets_alloc) {
+		e	= cache->buckets[hash & (cache->buckets_alloc - 1)];
+	}
+	while (e && !(e->hash == hash && e->key_length == key->length && !memcmp(e->key, key->text, key->length))) {
+		e	= e->chain;
+	}
+	if (e) {
+		_triplestore_cache_unlink(cache, e);
+		_triplestore_cache_push(cache, e);
+		e->refs++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return e;
+}
+
+static void _triplestore_cache_release(triplestore_result_cache_t* cache, triplestore_cached_result_t* e) {
+	pthread_mutex_lock(&cache->lock);
+	int refs	= --e->refs;
+	pthread_mutex_unlock(&cache->lock);
+	if (refs == 0) {
+		_triplestore_cache_free_entry(e);
+	}
+}
+
+static void _triplestore_cache_evict(triplestore_result_cache_t* cache, triplestore_cached_result_t* e) {
+	triplestore_cached_result_t** p	= &(cache->buckets[e->hash & (cache->buckets_alloc - 1)]);
+	while (*p != e) {
+		p	= &((*p)->chain);
+	}
+	*p	= e->chain;
+	_triplestore_cache_unlink(cache, e);
+	cache->used	-= _triplestore_cache_entry_size(e);
+	cache->count--;
+	if (--e->refs == 0) {
+		_triplestore_cache_free_entry(e);
+	}
+}
+
+// Adds e to the cache (which takes ownership of it) unless an entry for the same key has been added since it was
+// looked up.
+static void _triplestore_cache_put(triplestore_result_cache_t* cache, triplestore_cached_result_t* e) {
+	pthread_mutex_lock(&cache->lock);
+	if (cache->count >= cache->buckets_alloc / 2) {
+		uint32_t alloc	= cache->buckets_alloc ? 2 * cache->buckets_alloc : 256;
+		triplestore_cached_result_t** buckets	= calloc(alloc, sizeof(triplestore_cached_result_t*));
+		if (buckets) {
+			for (uint32_t i = 0; i < cache->buckets_alloc; i++) {
+				triplestore_cached_result_t* b	= cache->buckets[i];
+				while (b) {
+					triplestore_cached_result_t* chain	= b->chain;
+					b->chain					= buckets[b->hash & (alloc - 1)];
+					buckets[b->hash & (alloc - 1)]	= b;
+					b	= chain;
+				}
+			}
+			free(cache->buckets);
+			cache->buckets			= buckets;
+			cache->buckets_alloc	= alloc;
+		}
+	}
+	
+	triplestore_cached_result_t* b	= NULL;
+	if (cache->buckets_alloc) {
+		b	= cache->buckets[e->hash & (cache->buckets_alloc - 1)];
+	}
+	while (b && !(b->hash == e->hash && b->key_length == e->key_length && !memcmp(b->key, e->key, e->key_length))) {
+		b	= b->chain;
+	}
+	if (b || !cache->buckets_alloc) {
+		pthread_mutex_unlock(&cache->lock);
+		_triplestore_cache_free_entry(e);
+		return;
+	}
+	
+	e->refs		= 1;
+	e->chain	= cache->buckets[e->hash & (cache->buckets_alloc - 1)];
+	cache->buckets[e->hash & (cache->buckets_alloc - 1)]	= e;
+	_triplestore_cache_push(cache, e);
+	cache->used	+= _triplestore_cache_entry_size(e);
+	cache->count++;
+	while (cache->used > cache->budget && cache->oldest != e) {
+		_triplestore_cache_evict(cache, cache->oldest);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+// Keeps what is written to the capture's stream, passing it on to the original stream only once it is finished (or
+// has grown too large to cache).
+static ssize_t _triplestore_capture_write(triplestore_cache_capture_t* cap, const char* buf, size_t size) {
+	if (cap->capturing) {
+		if (cap->length + size <= cap->limit) {
+			if (cap->length + size > cap->alloc) {
+				size_t alloc	= cap->alloc ? 2 * cap->alloc : 4096;
+				while (alloc < cap->length + size) {
+					alloc	*= 2;
+				}
+				char* output	= realloc(cap->output, alloc);
+				if (output) {
+					cap->output	= output;
+					cap->alloc	= alloc;
+				}
+			}
+			if (cap->length + size <= cap->alloc) {
+				memcpy(&(cap->output[cap->length]), buf, size);
+				cap->length	+= size;
+				return size;
+			}
+		}
+		
+		// too large to cache, so send what has been kept and pass the rest straight through
+		if (cap->length > 0) {
+			fwrite(cap->output, 1, cap->length, cap->out);
+		}
+		free(cap->output);
+		cap->output		= NULL;
+		cap->capturing	= 0;
+	}
+	if (size > 0 && fwrite(buf, 1, size, cap->out) < size) {
+		return -1;
+	}
+	return size;
+}
+
+#if defined(__linux__)
+static ssize_t capture_cookie_write(void* cookie, const char* buf, size_t size) {
+	return _triplestore_capture_write((triplestore_cache_capture_t*) cookie, buf, size);
+}
+#else
+static int capture_cookie_write(void* cookie, const char* buf, int size) {
+	return (int) _triplestore_capture_write((triplestore_cache_capture_t*) cookie, buf, (size_t) size);
+}
+#endif
+
+// Replaces the response's stream with one that keeps the command's output for the cache.
+static int _triplestore_cache_capture(triplestore_result_cache_t* cache, triplestore_response_t* res, triplestore_cache_capture_t* cap) {
+	*cap	= (triplestore_cache_capture_t) {
+		.out		= res->out,
+		.limit		= cache->budget / 16,
+		.capturing	= 1,
+	};
+#if defined(__linux__)
+	cookie_io_functions_t io	= { .read = NULL, .write = capture_cookie_write, .seek = NULL, .close = NULL };
+	FILE* f	= fopencookie(cap, "w", io);
+#else
+	FILE* f	= funopen(cap, NULL, capture_cookie_write, NULL, NULL);
+#endif
+	if (!f) {
+		cap->out	= NULL;
+		return 1;
+	}
+	res->out	= f;
+	return 0;
+}
+
+// Restores the response's stream, sending it the captured output, and (if store is true) adds the output to the
+// cache.
+static void _triplestore_cache_end_capture(triplestore_result_cache_t* cache, triplestore_response_t* res, triplestore_cache_capture_t* cap, triplestore_cache_key_t* key, int store) {
+	if (!cap->out) {
+		return;
+	}
+	fclose(res->out);
+	res->out	= cap->out;
+	cap->out	= NULL;
+	if (!cap->capturing) {
+		return;
+	}
+	
+	if (cap->length > 0) {
+		fwrite(cap->output, 1, cap->length, res->out);
+	}
+	triplestore_cached_result_t* e	= NULL;
+	if (store && !key->failed) {
+		e	= calloc(1, sizeof(triplestore_cached_result_t));
+	}
+	if (!e) {
+		free(cap->output);
+		return;
+	}
+	// the key's buffer is handed over to the entry
+	e->hash			= _triplestore_cache_hash(key->text, key->length);
+	e->key			= key->text;
+	e->key_length	= key->length;
+	e->output		= cap->output;
+	e->length		= cap->length;
+	e->content_type	= res->content_type;
+	e->rows			= res->rows;
+	key->text		= NULL;
+	_triplestore_cache_put(cache, e);
+}
+
+#pragma mark -
+#pragma mark Metrics
+
+// Each thread that serves requests keeps its own counters and latency histograms, so recording a request needs
+// neither a lock nor a locked instruction. GET /metrics sums them (in the Prometheus text format). In pre-fork mode
+// each worker process reports only its own requests.
+
+static const char* const metrics_phase_names[PHASES]	= {
+	[PHASE_QUEUE]		= "queue",
+	[PHASE_PARSE]		= "parse",
+	[PHASE_PLAN]		= "plan",
+	[PHASE_MATCH]		= "match",
+	[PHASE_SERIALIZE]	= "serialize",
+	[PHASE_REQUEST]		= "request",
+};
+
+static _Thread_local triplestore_metrics_t* _triplestore_metrics_current	= NULL;
+static _Thread_local triplestore_server_t* _triplestore_metrics_server	= NULL;
+
+static uint64_t _triplestore_metrics_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+// Returns this thread's counters for s, creating them the first time the thread serves a request.
+static triplestore_metrics_t* _triplestore_metrics(triplestore_server_t* s) {
+	static _Thread_local triplestore_metrics_t discarded;
+	if (_triplestore_metrics_server == s && _triplestore_metrics_current) {
+		return _triplestore_metrics_current;
+	}
+	
+	triplestore_metrics_t* m	= calloc(1, sizeof(triplestore_metrics_t));
+	if (!m) {
+		// counted nowhere, rather than failing the request
+		return &discarded;
+	}
+	pthread_mutex_lock(&s->metrics_lock);
+	m->next		= s->metrics;
+	s->metrics	= m;
+	pthread_mutex_unlock(&s->metrics_lock);
+	_triplestore_metrics_current	= m;
+	_triplestore_metrics_server		= s;
+	return m;
+}
+
+// Only the owning thread writes a counter, so it doesn't need an atomic increment (just a store that /metrics can
+// read while it happens).
+static void _triplestore_metrics_add(uint64_t* counter, uint64_t n) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void _triplestore_metrics_observe(triplestore_metrics_t* m, metrics_phase_t phase, uint64_t micros) {
+	// the smallest b with micros <= 2^b
+	int bucket	= (micros > 1) ? 64 - __builtin_clzll(micros - 1) : 0;
+	if (bucket > METRICS_BUCKETS - 1) {
+		bucket	= METRICS_BUCKETS - 1;
+	}
+	_triplestore_metrics_add(&(m->phase_micros[phase]), micros);
+	_triplestore_metrics_add(&(m->phase_buckets[phase][bucket]), 1);
+}
+
+// Records the phases of a command that has run: parse is in microseconds, sampled is the time spent serializing the
+// results timed by serialize_sampled_result (from which the time for all of them is estimated), and the time spent
+// planning and matching (which includes serializing the results) is taken from ctx.
+static void _triplestore_metrics_query(triplestore_server_t* s, struct command_ctx_s* ctx, triplestore_response_t* res, uint64_t parse, uint64_t sampled) {
+	triplestore_metrics_t* m	= _triplestore_metrics(s);
+	uint64_t plan		= (uint64_t) (ctx->plan_time * 1000000);
+	uint64_t match		= (uint64_t) (ctx->match_time * 1000000);
+	uint64_t samples	= (res->rows + METRICS_SAMPLE - 1) / METRICS_SAMPLE;
+	uint64_t serialize	= samples ? sampled * res->rows / samples : 0;
+	_triplestore_metrics_observe(m, PHASE_PARSE, parse);
+	_triplestore_metrics_observe(m, PHASE_PLAN, plan);
+	_triplestore_metrics_observe(m, PHASE_MATCH, (match > serialize) ? match - serialize : 0);
+	_triplestore_metrics_observe(m, PHASE_SERIALIZE, serialize);
+	_triplestore_metrics_add(&(m->rows), res->rows);
+}
+
+static void write_metrics_counter(FILE* f, const char* name, const char* type, const char* help, uint64_t value) {
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %"PRIu64"\n", name, help, name, type, name, value);
+}
+
+int triplestore_write_metrics(triplestore_server_t* s, triplestore_response_t* res) {
+	triplestore_metrics_t total;
+	memset(&total, 0, sizeof(total));
+	pthread_mutex_lock(&s->metrics_lock);
+	for (triplestore_metrics_t* m = s->metrics; m; m = m->next) {
+		// the counters are all uint64_t after the list pointer
+		uint64_t* from	= &(m->connections_opened);
+		uint64_t* to	= &(total.connections_opened);
+		size_t count	= (sizeof(triplestore_metrics_t) - offsetof(triplestore_metrics_t, connections_opened)) / sizeof(uint64_t);
+		for (size_t i = 0; i < count; i++) {
+			to[i]	+= __atomic_load_n(&(from[i]), __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&s->metrics_lock);
+	
+	if (s->use_http) {
+		write_http_header(res, 200, "OK", "text/plain; version=0.0.4");
+	}
+	FILE* f	= res->out;
+	write_metrics_counter(f, "triplestore_connections_active", "gauge", "Open client connections.", total.connections_opened - total.connections_closed);
+	write_metrics_counter(f, "triplestore_connections_total", "counter", "Client connections accepted.", total.connections_opened);
+	write_metrics_counter(f, "triplestore_requests_total", "counter", "Requests served.", total.requests);
+	write_metrics_counter(f, "triplestore_request_errors_total", "counter", "Requests answered with an error status.", total.errors);
+	write_metrics_counter(f, "triplestore_result_rows_total", "counter", "Result rows produced.", total.rows);
+	write_metrics_counter(f, "triplestore_cache_hits_total", "counter", "Commands answered from the result cache.", total.cache_hits);
+	write_metrics_counter(f, "triplestore_cache_misses_total", "counter", "Commands run because their results were not cached.", total.cache_misses);
+	
+	fprintf(f, "# HELP triplestore_phase_seconds Time spent in each phase of serving a request.\n");
+	fprintf(f, "# TYPE triplestore_phase_seconds histogram\n");
+	for (int phase = 0; phase < PHASES; phase++) {
+		const char* name	= metrics_phase_names[phase];
+		uint64_t count		= 0;
+		for (int b = 0; b < METRICS_BUCKETS; b++) {
+			count	+= total.phase_buckets[phase][b];
+			if (b < METRICS_BUCKETS - 1) {
+				fprintf(f, "triplestore_phase_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %"PRIu64"\n", name, (double) (1ULL << b) / 1000000, count);
+			} else {
+				fprintf(f, "triplestore_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %"PRIu64"\n", name, count);
+			}
+		}
+		fprintf(f, "triplestore_phase_seconds_sum{phase=\"%s\"} %.6f\n", name, (double) total.phase_micros[phase] / 1000000);
+		fprintf(f, "triplestore_phase_seconds_count{phase=\"%s\"} %"PRIu64"\n", name, count);
+	}
+	return 0;
 }
@@ -10,10 +10,63 @@
 #include <pcre.h>
 // #include <dispatch/dispatch.h>
 #include <sys/stat.h>
-#include <ck_ring.h>
 #include <pthread.h>
 #include "triplestore.h"
 
+typedef struct triplestore_connection_s {
+	struct triplestore_server_s* server;
+	int fd;
+	int eof;
+	char* buffer;			// bytes read from the client that have not yet been handled
+	size_t used;
+	size_t alloc;
+	char* output;			// buffers the body of each response between writes to the client
+	uint64_t queued;		// when (in microseconds) the connection was last handed to the pool
+} triplestore_connection_t;
+
+// A query built from a prepared statement's template. Each plan is used by one execution at a time, so a statement
+// has as many plans as it has had concurrent executions.
+typedef struct triplestore_plan_s {
+	query_t* query;
+	int64_t* params;			// the variable bound by each of the statement's parameters
+	struct triplestore_plan_s* next;
+} triplestore_plan_t;
+
+typedef struct triplestore_statement_s {
+	char* text;					// the template's lines (without its final END), with placeholders as variables
+	int params;
+	char** param_names;
+	pthread_mutex_t lock;
+	triplestore_plan_t* idle;	// plans not being used by an execution
+} triplestore_statement_t;
+
+// A response body kept by the result cache. An entry is shared by the cache and any responses still sending it, and
+// is freed once it has been evicted and the last of those is finished.
+typedef struct triplestore_cached_result_s {
+	uint64_t hash;
+	char* key;					// the results format followed by the normalized command text
+	size_t key_length;
+	char* output;
+	size_t length;
+	const char* content_type;
+	uint64_t rows;
+	int refs;
+	struct triplestore_cached_result_s* chain;	// the next entry in the same hash bucket
+	struct triplestore_cached_result_s* newer;
+	struct triplestore_cached_result_s* older;
+} triplestore_cached_result_t;
+
+typedef struct triplestore_result_cache_s {
+	pthread_mutex_t lock;
+	size_t budget;				// bytes the cached entries may use (0 disables the cache)
+	size_t used;
+	uint32_t count;
+	uint32_t buckets_alloc;
+	triplestore_cached_result_t** buckets;
+	triplestore_cached_result_t* newest;
+	triplestore_cached_result_t* oldest;	// the next entry to be evicted
+} triplestore_result_cache_t;
+
 typedef struct triplestore_server_s {
 	short port;
 	int fd;
@@ -21,12 +74,15 @@ typedef struct triplestore_server_s {
 	int buffer_size;
 // 	dispatch_queue_t queue;
 // 	dispatch_queue_t sync_queue;
-	ck_ring_t *ring;
-	int nthr;
-	int size;
-	int max;
-	ck_ring_buffer_t *buffer;
-	pthread_t* threads;
+	int events;					// epoll (or kqueue) descriptor watching the listening socket and idle connections
+	triplestore_pool_t* pool;	// runs both connections and parallel query operators
+	triplestore_statement_t** statements;	// prepared statements (statement N is at index N-1)
+	uint32_t statements_used;
+	uint32_t statements_alloc;
+	pthread_mutex_t statements_lock;
+	triplestore_result_cache_t cache;	// serialized results of recent commands
+	struct triplestore_metrics_s* metrics;	// the counters of each thread that has served a request
+	pthread_mutex_t metrics_lock;
 	triplestore_t* t;
 } triplestore_server_t;
 
@@ -34,4 +90,5 @@ triplestore_server_t* triplestore_new_server(short port, int use_http, triplesto
 int triplestore_free_server(triplestore_server_t* s);
 
 int triplestore_run_server(triplestore_server_t* s);
+int triplestore_run_prefork_server(triplestore_server_t* s, int workers);
 int triplestore_read_and_run_query(triplestore_server_t* s, FILE* in, FILE* out);
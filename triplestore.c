@@ -88,33 +88,253 @@ static void _print_result(triplestore_t* t, binding_t* match, FILE* f) {
 #pragma mark -
 #pragma mark RDF Terms
 
-static int _value_matches_regex(const char *value, pcre *re) {
-	int OVECCOUNT	= 30;
-	int ovector[OVECCOUNT];
-	int rc = pcre_exec(
-					   re,							/* the compiled pattern */
-					   NULL,						/* no extra data - we didn't study the pattern */
-					   value,						/* the subject string */
-					   (int) strlen(value),			/* the length of the subject */
-					   0,							/* start at offset 0 in the subject */
-					   0,							/* default options */
-					   ovector,						/* output vector for substring information */
-					   OVECCOUNT					/* number of elements in the output vector */
-					   );
-	return (rc > 0);
-}
-
-static const char* _parse_results ( int rc, int pos, const char* value, int* ovector, int* result_length ) {
-	if (pos >= rc) {
-		return NULL;
+typedef enum {
+	LEXICAL_INTEGER,	// [-+]?\d+
+	LEXICAL_DECIMAL,	// [-+]?\d+([.]\d+)?
+	LEXICAL_FLOAT,		// NaN|-?INF|[-+]?\d+[.]\d+([eE][-+]?\d+)?
+} lexical_numeric_t;
+
+static const double POWERS_OF_TEN[]	= {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Validate a numeric lexical form and compute its value in a single pass. Returns 0 if the value is valid.
+static int _parse_numeric_lexical(const char* value, lexical_numeric_t kind, double* result) {
+	const char* p	= value;
+	if (kind == LEXICAL_FLOAT) {
+		if (!strcmp(p, "NaN")) {
+			*result	= NAN;
+			return 0;
+		} else if (!strcmp(p, "INF")) {
+			*result	= INFINITY;
+			return 0;
+		} else if (!strcmp(p, "-INF")) {
+			*result	= -INFINITY;
+			return 0;
+		}
 	}
-	if (ovector[2 * pos] == -1) {
-		return NULL;
+	
+	int negative	= 0;
+	if (*p == '-' || *p == '+') {
+		negative	= (*p == '-');
+		p++;
+	}
+	
+	uint64_t mantissa	= 0;
+	int significant		= 0;	// significant digits accumulated into the mantissa
+	int exact			= 1;	// cleared if there were too many digits to accumulate without overflow
+	int exponent		= 0;
+	
+	const char* digits	= p;
+	for (; *p >= '0' && *p <= '9'; p++) {
+		if (significant < 19) {
+			mantissa	= 10 * mantissa + (*p - '0');
+			if (mantissa) {
+				significant++;
+			}
+		} else {
+			exact	= 0;
+		}
+	}
+	if (p == digits) {
+		return 1;
+	}
+	
+	if (*p == '.' && kind != LEXICAL_INTEGER) {
+		p++;
+		digits	= p;
+		for (; *p >= '0' && *p <= '9'; p++) {
+			if (significant < 19) {
+				mantissa	= 10 * mantissa + (*p - '0');
+				exponent--;
+				if (mantissa) {
+					significant++;
+				}
+			} else {
+				exact	= 0;
+			}
+		}
+		if (p == digits) {
+			return 1;
+		}
+	} else if (kind == LEXICAL_FLOAT) {
+		return 1;
+	}
+	
+	if (kind == LEXICAL_FLOAT && (*p == 'e' || *p == 'E')) {
+		p++;
+		int exp_negative	= 0;
+		if (*p == '-' || *p == '+') {
+			exp_negative	= (*p == '-');
+			p++;
+		}
+		digits	= p;
+		int e	= 0;
+		for (; *p >= '0' && *p <= '9'; p++) {
+			if (e < 100000) {
+				e	= 10 * e + (*p - '0');
+			}
+		}
+		if (p == digits) {
+			return 1;
+		}
+		exponent	+= exp_negative ? -e : e;
+	}
+	
+	if (*p != '\0') {
+		return 1;
+	}
+	
+	double v;
+	if (exact && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+		// both the mantissa and the power of ten are exactly representable, so a single operation is correctly rounded
+		v	= (exponent < 0) ? (double) mantissa / POWERS_OF_TEN[-exponent] : (double) mantissa * POWERS_OF_TEN[exponent];
+		if (negative) {
+			v	= -v;
+		}
+	} else {
+		v	= strtod(value, NULL);
+	}
+	*result	= v;
+	return 0;
+}
+
+static int _parse_digits(const char** p, int count, int* value) {
+	int v	= 0;
+	for (int i = 0; i < count; i++) {
+		if ((*p)[i] < '0' || (*p)[i] > '9') {
+			return 1;
+		}
+		v	= 10 * v + ((*p)[i] - '0');
+	}
+	*p		+= count;
+	*value	= v;
+	return 0;
+}
+
+// Days since 1970-01-01 of the given proleptic Gregorian date.
+static int64_t _days_from_civil(int64_t year, int month, int day) {
+	year		-= (month <= 2);
+	int64_t era	= (year >= 0 ? year : year - 399) / 400;
+	int64_t yoe	= year - era * 400;
+	int64_t doy	= (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	int64_t doe	= yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+// Validate a xsd:date (-?YYYY-MM-DD) or xsd:dateTime (-?YYYY-MM-DDTHH:MM:SS(.s+)?(Z|[-+]HH:MM)?) lexical form, and
+// compute its value as microseconds since the epoch. Dates are taken as midnight, and values without a timezone are
+// taken as UTC.
+// Returns 0 if the value is valid, 1 if it is not a valid lexical form, and 2 if it is lexically valid but one of its
+// fields is out of range (e.g. month 13).
+static int _parse_date_lexical(const char* value, int with_time, int64_t* result) {
+	const char* p	= value;
+	int negative	= 0;
+	int year, month, day;
+	int hour		= 0;
+	int minute		= 0;
+	int second		= 0;
+	int64_t usec	= 0;
+	int64_t offset	= 0;
+	if (*p == '-') {
+		negative	= 1;
+		p++;
+	}
+	if (_parse_digits(&p, 4, &year) || *(p++) != '-' || _parse_digits(&p, 2, &month) || *(p++) != '-' || _parse_digits(&p, 2, &day)) {
+		return 1;
+	}
+	if (with_time) {
+		if (*(p++) != 'T' || _parse_digits(&p, 2, &hour) || *(p++) != ':' || _parse_digits(&p, 2, &minute) || *(p++) != ':' || _parse_digits(&p, 2, &second)) {
+			return 1;
+		}
+		if (*p == '.') {
+			p++;
+			if (*p < '0' || *p > '9') {
+				return 1;
+			}
+			// fractional seconds beyond microsecond precision are truncated
+			int64_t scale	= 100000;
+			for (; *p >= '0' && *p <= '9'; p++) {
+				usec	+= scale * (*p - '0');
+				scale	/= 10;
+			}
+		}
+		if (*p == 'Z') {
+			p++;
+		} else if (*p == '-' || *p == '+') {
+			int sign	= (*(p++) == '-') ? -1 : 1;
+			int tzh, tzm;
+			if (_parse_digits(&p, 2, &tzh) || *(p++) != ':' || _parse_digits(&p, 2, &tzm)) {
+				return 1;
+			}
+			offset	= sign * (60 * tzh + tzm);
+		}
 	}
-	if (result_length) {
-		*result_length = ovector[2 * pos + 1] - ovector[2 * pos];
+	if (*p != '\0') {
+		return 1;
+	}
+	if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 24 || minute > 59 || second > 60) {
+		return 2;
+	}
+	if (hour == 24 && (minute > 0 || second > 0 || usec > 0)) {
+		// 24:00:00 is the only valid time in hour 24 (the end of the day)
+		return 2;
+	}
+	
+	int64_t days	= _days_from_civil(negative ? -year : year, month, day);
+	int64_t seconds	= 86400 * days + 3600 * hour + 60 * (minute - offset) + second;
+	*result			= 1000000 * seconds + usec;
+	return 0;
+}
+
+int triplestore_parse_date(const char* value, int64_t* result) {
+	if (_parse_date_lexical(value, 1, result) == 0) {
+		return 0;
+	}
+	return (_parse_date_lexical(value, 0, result) != 0);
+}
+
+static int _is_word_char(char c) {
+	return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_');
+}
+
+// Validate a language tag of the form LL, LL-RR (region) or LL-SSSS (script), and pack its canonical form (lowercase
+// language, uppercase region, titlecase script) into *packed. Returns 0 if the tag is valid.
+static int _parse_language_tag(const char* tag, size_t len, int64_t* packed) {
+	size_t suffix	= (len > 3) ? len - 3 : 0;
+	if (!(len == 2 || len == 5 || len == 7) || !_is_word_char(tag[0]) || !_is_word_char(tag[1])) {
+		return 1;
+	}
+	if (len > 2) {
+		if (tag[2] != '-') {
+			return 1;
+		}
+		for (size_t i = 0; i < suffix; i++) {
+			if (!_is_word_char(tag[3+i])) {
+				return 1;
+			}
+		}
+	}
+	
+	*packed		= 0;
+	char* ptr	= (char*) packed;
+	*(ptr++)	= tolower(tag[0]);
+	*(ptr++)	= tolower(tag[1]);
+	if (suffix == 2) {
+		// region is all uppercase
+		*(ptr++)	= '-';
+		*(ptr++)	= toupper(tag[3]);
+		*(ptr++)	= toupper(tag[4]);
+	} else if (suffix == 4) {
+		// script is title case
+		*(ptr++)	= '-';
+		*(ptr++)	= toupper(tag[3]);
+		*(ptr++)	= tolower(tag[4]);
+		*(ptr++)	= tolower(tag[5]);
+		*(ptr++)	= tolower(tag[6]);
 	}
-	return value + ovector[2 * pos];
+	return 0;
 }
 
 rdf_term_t *triplestore_get_term(triplestore_t *t, nodeid_t id) {
@@ -128,6 +348,7 @@ rdf_term_t* triplestore_new_term_n(triplestore_t* t, rdf_term_type_t type, const
 	rdf_term_t *term	= (rdf_term_t*) v;
 	term->type			= type;
 	term->vtype.value_type.is_numeric	= 0;
+	term->vtype.value_type.is_date		= 0;
 
 	term->value			= v + sizeof(rdf_term_t);
 	strncpy(term->value, _value, value_len);
@@ -135,52 +356,16 @@ rdf_term_t* triplestore_new_term_n(triplestore_t* t, rdf_term_type_t type, const
 	if (_vtype) {
 		if (vtype_len >= 8) {
 			fprintf(stderr, "*** Language tag is too long: %s\n", _vtype);
+			my_free(v);
 			return NULL;
 		}
 		
-		int OVECCOUNT	= 30;
-		int ovector[OVECCOUNT];
-		int rc = pcre_exec(
-						   t->lang_re,					/* the compiled pattern */
-						   NULL,						/* no extra data - we didn't study the pattern */
-						   _vtype,						/* the subject string */
-						   (int) vtype_len,				/* the length of the subject */
-						   0,							/* start at offset 0 in the subject */
-						   0,							/* default options */
-						   ovector,						/* output vector for substring information */
-						   OVECCOUNT					/* number of elements in the output vector */
-						   );
-		
-		if (rc <= 0) {
-			fprintf(stderr, "*** Language tag is not a valid lexical form: '%s'\n", _vtype);
+		// Validate and normalize the case of the language and any region/script
+		if (_parse_language_tag(_vtype, vtype_len, &(term->vtype.value_lang))) {
+			fprintf(stderr, "*** Language tag is not a valid lexical form: '%.*s'\n", (int) vtype_len, _vtype);
 			my_free(v);
 			return NULL;
 		}
-		
-		term->vtype.value_lang	= 0;
-
-		// Normalize the case of the language and any region/script
-		const char* lang	= _parse_results(rc, 1, _vtype, ovector, NULL);
-		const char* region	= _parse_results(rc, 2, _vtype, ovector, NULL);
-		const char* script	= _parse_results(rc, 3, _vtype, ovector, NULL);
-		char* ptr	= (char*) &(term->vtype.value_lang);
-		
-		// language is all lowercase
-		*(ptr++)	= tolower(lang[0]);
-		*(ptr++)	= tolower(lang[1]);
-		if (region) {
-			// region is all uppercase
-			*(ptr++)	= '-';
-			*(ptr++)	= toupper(region[0]);
-			*(ptr++)	= toupper(region[1]);
-		} else if (script) {
-			// script is title case
-			*(ptr++)	= '-';
-			*(ptr++)	= toupper(script[0]);
-			*(ptr++)	= tolower(script[1]);
-			*(ptr++)	= tolower(script[2]);
-			*(ptr++)	= tolower(script[3]);
-		}
 	} else {
 		term->vtype.value_type.value_id	= vid;
 		if (type == TERM_BLANK) {
@@ -196,57 +381,44 @@ rdf_term_t* triplestore_new_term_n(triplestore_t* t, rdf_term_type_t type, const
 			if (dt) {
 				if (!strncmp(dt->value, "http://www.w3.org/2001/XMLSchema#", 33)) {
 					char* type	= dt->value + 33;
+					int numeric		= 1;
+					lexical_numeric_t kind	= LEXICAL_INTEGER;
 					if (!strcmp(type, "integer")) {
-						if (t->verify_datatypes) {
-							if (!_value_matches_regex(term->value, t->integer_re)) {
-								fprintf(stderr, "*** Value is not a valid lexical form for type %s: '%s'\n", type, term->value);
-								my_free(v);
-								return NULL;
-							}
-						}
-						term->vtype.value_type.is_numeric	= 1;
-						term->vtype.value_type.numeric_value = (double) atoll(term->value);
+						kind	= LEXICAL_INTEGER;
 					} else if (!strcmp(type, "decimal")) {
-						if (t->verify_datatypes) {
-							if (!_value_matches_regex(term->value, t->decimal_re)) {
-								fprintf(stderr, "*** Value is not a valid lexical form for type %s: '%s'\n", type, term->value);
-								my_free(v);
-								return NULL;
-							}
-						}
-						term->vtype.value_type.is_numeric	= 1;
-						term->vtype.value_type.numeric_value = (double) atof(term->value);
+						kind	= LEXICAL_DECIMAL;
 					} else if (!strcmp(type, "float") || !strcmp(type, "double")) {
-						if (t->verify_datatypes) {
-							if (!_value_matches_regex(term->value, t->float_re)) {
-								fprintf(stderr, "*** Value is not a valid lexical form for type %s: '%s'\n", type, term->value);
-								my_free(v);
-								return NULL;
-							}
-						}
-//						fprintf(stderr, "--------\n");
-//						char* ss		= triplestore_term_to_string(t, term);
-//						fprintf(stderr, "typed literal: %s\n", ss);
-//						free(ss);
-
-						term->vtype.value_type.is_numeric	= 1;
-						term->vtype.value_type.numeric_value = (double) atof(term->value);
-					} else if (!strcmp(type, "dateTime")) {
-						if (t->verify_datatypes) {
-							if (!_value_matches_regex(term->value, t->datetime_re)) {
+						kind	= LEXICAL_FLOAT;
+					} else {
+						numeric	= 0;
+						int with_time	= !strcmp(type, "dateTime");
+						if (with_time || !strcmp(type, "date")) {
+							int64_t date;
+							int rc	= _parse_date_lexical(term->value, with_time, &date);
+							if (rc == 0) {
+								term->vtype.value_type.is_date		= 1;
+								term->vtype.value_type.date_value	= date;
+							} else if (rc == 1 && t->verify_datatypes) {
 								fprintf(stderr, "*** Value is not a valid lexical form for type %s: '%s'\n", type, term->value);
 								my_free(v);
 								return NULL;
 							}
 						}
-					} else if (!strcmp(type, "date")) {
-						if (t->verify_datatypes) {
-							if (!_value_matches_regex(term->value, t->date_re)) {
+					}
+					
+					if (numeric) {
+						// validation and conversion happen in the same pass over the lexical form
+						double value;
+						if (_parse_numeric_lexical(term->value, kind, &value)) {
+							if (t->verify_datatypes) {
 								fprintf(stderr, "*** Value is not a valid lexical form for type %s: '%s'\n", type, term->value);
 								my_free(v);
 								return NULL;
 							}
+							value	= (kind == LEXICAL_INTEGER) ? (double) atoll(term->value) : atof(term->value);
 						}
+						term->vtype.value_type.is_numeric	= 1;
+						term->vtype.value_type.numeric_value = value;
 					}
 				}
 			}
@@ -285,6 +457,25 @@ void free_rdf_term(rdf_term_t* t) {
 	my_free(t);
 }
 
+static uint8_t _triplestore_term_flags(rdf_term_t* term) {
+	if (!term) {
+		return 0;
+	}
+	uint8_t flags	= (uint8_t) (term->type & TRIPLESTORE_NODE_TYPE_MASK);
+	if (term->type == TERM_XSDSTRING_LITERAL || term->type == TERM_LANG_LITERAL || term->type == TERM_TYPED_LITERAL) {
+		flags	|= TRIPLESTORE_NODE_LITERAL;
+	}
+	if (term->type == TERM_TYPED_LITERAL) {
+		if (term->vtype.value_type.is_numeric) {
+			flags	|= TRIPLESTORE_NODE_NUMERIC;
+		}
+		if (term->vtype.value_type.is_date) {
+			flags	|= TRIPLESTORE_NODE_DATE;
+		}
+	}
+	return flags;
+}
+
 int triplestore_size(triplestore_t* t) {
 	return t->edges_used;
 }
@@ -338,71 +529,110 @@ int triplestore_term_get_value(rdf_term_t* t, int(^block)(size_t, const char*))
 	return block(len, t->value);
 }
 
-char* triplestore_term_to_string(triplestore_t* store, rdf_term_t* t) {
-	__block char* string	= NULL;
-	__block char* extra		= NULL;
+static size_t _triplestore_append(char* buffer, size_t length, const char* value, size_t len) {
+	if (buffer) {
+		memcpy(&(buffer[length]), value, len);
+	}
+	return length + len;
+}
+
+// Appends value to buffer, escaping tabs and line breaks (and, for literal values, quotes and backslashes).
+static size_t _triplestore_append_escaped(char* buffer, size_t length, const char* value, int literal) {
+	for (const char* p = value; *p; p++) {
+		char e	= 0;
+		switch (*p) {
+			case '\t':
+				e	= 't';
+				break;
+			case '\n':
+				e	= 'n';
+				break;
+			case '\r':
+				e	= 'r';
+				break;
+			case '"':
+			case '\\':
+				e	= literal ? *p : 0;
+				break;
+		}
+		if (e) {
+			if (buffer) {
+				buffer[length]		= '\\';
+				buffer[length+1]	= e;
+			}
+			length	+= 2;
+		} else {
+			if (buffer) {
+				buffer[length]	= *p;
+			}
+			length++;
+		}
+	}
+	return length;
+}
+
+// Only the datatypes whose bare lexical forms read back as the same datatype are abbreviated (a bare xsd:float value
+// would be read as a decimal or double).
+static int _triplestore_abbreviated_datatype(const char* datatype) {
+	return (!strcmp(datatype, "http://www.w3.org/2001/XMLSchema#integer")
+			|| !strcmp(datatype, "http://www.w3.org/2001/XMLSchema#decimal")
+			|| !strcmp(datatype, "http://www.w3.org/2001/XMLSchema#double"));
+}
+
+// Writes the serialized form of term (as used by N-Triples and SPARQL TSV, with integer, decimal and double literals
+// abbreviated) to buffer, returning its length. If buffer is NULL, only the length is computed.
+static size_t _triplestore_serialize_term(triplestore_t* store, rdf_term_t* t, char* buffer) {
+	size_t length	= 0;
+	char prefix[32];
+	const char* datatype;
 	switch (t->type) {
 		case TERM_IRI:
-			triplestore_term_get_value(t, ^(size_t len, const char* value){
-				string	= calloc(3+len, 1);
-				sprintf(string, "<%s>", value);
-				return 0;
-			});
+			length	= _triplestore_append(buffer, length, "<", 1);
+			length	= _triplestore_append_escaped(buffer, length, t->value, 0);
+			length	= _triplestore_append(buffer, length, ">", 1);
 			break;
 		case TERM_BLANK:
-			triplestore_term_get_value(t, ^(size_t len, const char* value){
-				string	= calloc(12+len, 1);
-				sprintf(string, "_:b%"PRIu32"b%s", (uint32_t) t->vtype.value_type.value_id, value);
-				return 0;
-			});
+			snprintf(prefix, sizeof(prefix), "_:b%"PRIu32"b", (uint32_t) t->vtype.value_type.value_id);
+			length	= _triplestore_append(buffer, length, prefix, strlen(prefix));
+			length	= _triplestore_append_escaped(buffer, length, t->value, 0);
 			break;
 		case TERM_XSDSTRING_LITERAL:
-			triplestore_term_get_value(t, ^(size_t len, const char* value){
-				string	= calloc(3+len, 1);
-				// TODO: handle escaping
-				sprintf(string, "\"%s\"", value);
-				return 0;
-			});
+			length	= _triplestore_append(buffer, length, "\"", 1);
+			length	= _triplestore_append_escaped(buffer, length, t->value, 1);
+			length	= _triplestore_append(buffer, length, "\"", 1);
 			break;
 		case TERM_LANG_LITERAL:
-			triplestore_term_get_value(t, ^(size_t len, const char* value){
-				// TODO: handle escaping
-				string	= calloc(4+len+strlen((char*) &(t->vtype.value_lang)), 1);
-				sprintf(string, "\"%s\"@%s", value, (char*) &(t->vtype.value_lang));
-				return 0;
-			});
+			length	= _triplestore_append(buffer, length, "\"", 1);
+			length	= _triplestore_append_escaped(buffer, length, t->value, 1);
+			length	= _triplestore_append(buffer, length, "\"@", 2);
+			length	= _triplestore_append(buffer, length, (char*) &(t->vtype.value_lang), strlen((char*) &(t->vtype.value_lang)));
 			break;
 		case TERM_TYPED_LITERAL:
-			// TODO: handle escaping
-			extra	= triplestore_term_to_string(store, store->graph[ t->vtype.value_type.value_id ]._term);
-			
-			triplestore_term_get_value(t, ^(size_t len, const char* value){
-				string	= calloc(7+len+strlen(extra), 1);
-				if (!strcmp(extra, "<http://www.w3.org/2001/XMLSchema#decimal>")) {
-					sprintf(string, "%s", value);
-				} else if (!strcmp(extra, "<http://www.w3.org/2001/XMLSchema#integer>")) {
-					sprintf(string, "%s", value);
-				} else if (!strcmp(extra, "<http://www.w3.org/2001/XMLSchema#float>")) {
-					sprintf(string, "%s", value);
-				} else if (!strcmp(extra, "<http://www.w3.org/2001/XMLSchema#double>")) {
-					sprintf(string, "%s", value);
-				} else if (!strcmp(extra, "<http://www.w3.org/2001/XMLSchema#boolean>")) {
-					sprintf(string, "%s", value);
-				} else {
-					sprintf(string, "\"%s\"^^%s", value, extra);
-				}
-				return 0;
-			});
-			free(extra);
+			datatype	= store->graph[ t->vtype.value_type.value_id ]._term->value;
+			if (_triplestore_abbreviated_datatype(datatype)) {
+				length	= _triplestore_append_escaped(buffer, length, t->value, 0);
+			} else {
+				length	= _triplestore_append(buffer, length, "\"", 1);
+				length	= _triplestore_append_escaped(buffer, length, t->value, 1);
+				length	= _triplestore_append(buffer, length, "\"^^<", 4);
+				length	= _triplestore_append_escaped(buffer, length, datatype, 0);
+				length	= _triplestore_append(buffer, length, ">", 1);
+			}
 			break;
 		case TERM_VARIABLE:
-			triplestore_term_get_value(t, ^(size_t len, const char* value){
-				string	= calloc(1, 1+len+1);
-				sprintf(string, "?%s", value);
-				return 0;
-			});
+			length	= _triplestore_append(buffer, length, "?", 1);
+			length	= _triplestore_append(buffer, length, t->value, strlen(t->value));
 			break;
 	}
+	return length;
+}
+
+char* triplestore_term_to_string(triplestore_t* store, rdf_term_t* t) {
+	size_t length	= _triplestore_serialize_term(store, t, NULL);
+	char* string	= calloc(1, length+1);
+	if (string) {
+		_triplestore_serialize_term(store, t, string);
+	}
 	return string;
 }
 
@@ -430,23 +660,34 @@ static void _hx_free_node_item (void *avl_item, void *avl_param) {
 #pragma mark -
 #pragma mark Triplestore
 
-static pcre* _new_regex(const char* name, const char* pattern) {
-	const char *error;
-	int erroffset;
-	pcre* re	= pcre_compile(
-	   pattern,		/* the pattern */
-	   0,			/* default options */
-	   &error,		/* for error message */
-	   &erroffset,	/* for error offset */
-	   NULL			/* use default character tables */
-	   );
-	if (re == NULL) {
-		fprintf(stderr,"PCRE compilation failed for %s at offset %d: %s\n", name, erroffset, error);
-		exit(1);
+#ifdef PCRE_STUDY_JIT_COMPILE
+#define TRIPLESTORE_PCRE_STUDY_OPTIONS	PCRE_STUDY_JIT_COMPILE
+#else
+#define TRIPLESTORE_PCRE_STUDY_OPTIONS	0
+#endif
+
+// Study a compiled regex (JIT compiling it where libpcre supports it). Returns NULL if no study data is available,
+// which pcre_exec accepts in place of the extra data.
+pcre_extra* triplestore_study_regex(const char* name, pcre* re) {
+	const char *error	= NULL;
+	pcre_extra* extra	= pcre_study(re, TRIPLESTORE_PCRE_STUDY_OPTIONS, &error);
+	if (error != NULL) {
+		fprintf(stderr, "PCRE study failed for %s: %s\n", name, error);
+		return NULL;
 	}
-	return re;
+	return extra;
 }
 
+void triplestore_free_regex_study(pcre_extra* extra) {
+	if (extra == NULL) {
+		return;
+	}
+#ifdef PCRE_STUDY_JIT_COMPILE
+	pcre_free_study(extra);
+#else
+	pcre_free(extra);
+#endif
+}
 
 triplestore_t* new_triplestore(int max_nodes, int max_edges) {
 	triplestore_t* t	= (triplestore_t*) my_calloc(sizeof(triplestore_t), 1);
@@ -466,33 +707,34 @@ triplestore_t* new_triplestore(int max_nodes, int max_edges) {
 	}
 //	fprintf(stderr, "allocating %d bytes for graph for %"PRIu32" nodes\n", max_nodes * sizeof(graph_node_t), max_nodes);
 	t->graph		= my_calloc(sizeof(graph_node_t), max_nodes);
-	if (t->graph == NULL) {
+	t->node_flags	= my_calloc(sizeof(uint8_t), max_nodes);
+	if (t->graph == NULL || t->node_flags == NULL) {
 		fprintf(stderr, "*** Failed to allocate memory for triplestore graph\n");
+		my_free(t->node_flags);
+		my_free(t->graph);
 		my_free(t->edges);
 		my_free(t);
 		return NULL;
 	}
 	t->dictionary	= avl_create( _hx_node_cmp_str, NULL, &avl_allocator_default );
-	
-	t->integer_re		= _new_regex("integer", "^[-+]?(\\d+)$");
-	t->decimal_re		= _new_regex("decimal", "^[-+]?(\\d+)([.](\\d+))?$");
-	t->float_re			= _new_regex("float", "^(NaN|-?INF|[-+]?(\\d+)[.](\\d+)([eE][-+]?(\\d+))?)$");
-	t->date_re			= _new_regex("date", "^(-?\\d{4})-(\\d\\d)-(\\d\\d)$");
-	t->datetime_re		= _new_regex("datetime", "^(-?\\d{4})-(\\d\\d)-(\\d\\d)T(\\d\\d):(\\d\\d):(\\d\\d([.]\\d+)?)(Z|[-+](\\d\\d):(\\d\\d))?$");
-	t->lang_re			= _new_regex("langauge tag", "^(\\w{2})(?:-(?:(\\w{2})|(\\w{4})))?$");
 	return t;
 }
 
+static void _triplestore_free_value_index(triplestore_t* t);
+static void _triplestore_free_closures(triplestore_t* t);
+static void _triplestore_free_term_strings(triplestore_t* t);
+static int _triplestore_resize_term_strings(triplestore_t* t, uint32_t alloc);
+static int _triplestore_dump_closures(triplestore_t* t, int fd);
+static int _triplestore_load_closures(triplestore_t* t, const char* mp, const char* end);
+
 int free_triplestore(triplestore_t* t) {
-	pcre_free(t->integer_re);
-	pcre_free(t->decimal_re);
-	pcre_free(t->float_re);
-	pcre_free(t->date_re);
-	pcre_free(t->datetime_re);
-	pcre_free(t->lang_re);
+	_triplestore_free_value_index(t);
+	_triplestore_free_closures(t);
+	_triplestore_free_term_strings(t);
 	avl_destroy(t->dictionary, _hx_free_node_item);
 	my_free(t->edges);
 	my_free(t->graph);
+	my_free(t->node_flags);
 	my_free(t);
 #ifdef DEBUG
 	fprintf(stderr, "Allocated %"PRIuMAX" bytes total\n", TRIPLESTORE_ALLOCATED);
@@ -502,7 +744,8 @@ int free_triplestore(triplestore_t* t) {
 
 int triplestore_set_read_only(triplestore_t* t) {
 	t->read_only	= 1;
-	return 0;
+	// the store can no longer change, so build the derived indexes up front (they are then safe to share between threads)
+	return triplestore_build_indexes(t);
 }
 
 int triplestore_read_only(triplestore_t* t) {
@@ -528,13 +771,19 @@ int triplestore_expand_nodes(triplestore_t* t) {
 	alloc		*= 2;
 //	fprintf(stderr, "Expanding triplestore to accept %d nodes\n", alloc);
 	graph_node_t* graph = realloc(t->graph, alloc * sizeof(graph_node_t));
-	if (graph) {
-		t->graph		= graph;
-		t->nodes_alloc	= alloc;
-		return 0;
-	} else {
+	if (!graph) {
 		return 1;
 	}
+	t->graph		= graph;
+	
+	uint8_t* flags	= realloc(t->node_flags, alloc * sizeof(uint8_t));
+	if (!flags) {
+		return 1;
+	}
+	memset(flags + t->nodes_alloc, 0, alloc - t->nodes_alloc);
+	t->node_flags	= flags;
+	t->nodes_alloc	= alloc;
+	return _triplestore_resize_term_strings(t, alloc);
 }
 
 static int _write32(int fd, uint32_t value) {
@@ -649,6 +898,8 @@ int triplestore_dump(triplestore_t* t, const char* filename) {
 	for (uint32_t i = 1; i <= t->edges_used; i++) {
 		_triplestore_dump_edge(fd, &(t->edges[i]));
 	}
+	_triplestore_dump_closures(t, fd);
+	close(fd);
 	return 0;
 }
 
@@ -667,6 +918,10 @@ int triplestore_load(triplestore_t* t, const char* filename, int verbose) {
 	}
 	
 	// LOAD replaces all the triples in the store, so drop and re-create the dictionary to clear it.
+	int cache_terms	= (t->term_strings != NULL);
+	_triplestore_free_value_index(t);
+	_triplestore_free_closures(t);
+	_triplestore_free_term_strings(t);
 	if (t->dictionary) {
 		avl_destroy(t->dictionary, _hx_free_node_item);
 	}
@@ -707,9 +962,15 @@ int triplestore_load(triplestore_t* t, const char* filename, int verbose) {
 //	fprintf(stderr, "loading triplestore with %"PRIu32" edges and %"PRIu32" nodes\n", t->edges_used, t->nodes_used);
 	
 	t->graph				= my_calloc(sizeof(graph_node_t), 1+nalloc);
+	my_free(t->node_flags);
+	t->node_flags			= my_calloc(sizeof(uint8_t), 1+nalloc);
+	if (cache_terms) {
+		triplestore_cache_terms(t);
+	}
 	for (uint32_t i = 1; i <= nodes; i++) {
 		hx_nodemap_item* item	= (hx_nodemap_item*) my_calloc( 1, sizeof( hx_nodemap_item ) );
 		int length	= _triplestore_load_node(t, mp, &(t->graph[i]));
+		t->node_flags[i]	= _triplestore_term_flags(t->graph[i]._term);
 		item->_term = t->graph[i]._term;
 		item->id	= i;
 		avl_insert( t->dictionary, item );
@@ -729,6 +990,7 @@ int triplestore_load(triplestore_t* t, const char* filename, int verbose) {
 		t->edges[i].next_in		= ntohl(t->edges[i].next_in);
 		t->edges[i].next_out	= ntohl(t->edges[i].next_out);
 	}
+	_triplestore_load_closures(t, mp + 20*edges, ((char*) m) + fs.st_size);
 
 
 //	if (0) {
@@ -754,85 +1016,501 @@ int triplestore_load(triplestore_t* t, const char* filename, int verbose) {
 }
 
 #pragma mark -
-#pragma mark Result Tables
-
-table_t* triplestore_new_table(int width) {
-	table_t* table	= my_calloc(1, sizeof(table_t));
-	table->width	= width;
-	table->alloc	= 128;
-	table->used		= 0;
-	table->ptr		= my_calloc(table->alloc, (1+width) * sizeof(binding_t));
-	return table;
-}
-
-int triplestore_free_table(table_t* table) {
-	my_free(table->ptr);
-	my_free(table);
-	return 0;
-}
+#pragma mark Value Index
 
-binding_t* triplestore_table_row_ptr(table_t* table, int row) {
-	binding_t* p = &( table->ptr[ row*(1+table->width) ] );
-	return p;
-}
+#define TRIPLESTORE_LANGUAGE_KEYS	4096
 
-int triplestore_table_add_row(table_t* table, binding_t* result) {
-	if (table->used == table->alloc) {
-		table->alloc	*= 2;
-		size_t requested	= table->alloc * (1+table->width) * sizeof(binding_t);
-// 		fprintf(stderr, "Reallocating to %zu bytes (currently have %d rows)\n", requested, table->used);
-		table->ptr	= realloc(table->ptr, requested);
-		if (table->ptr == NULL) {
-			fprintf(stderr, "failed to grow table size\n");
-			return 1;
+static void _triplestore_free_value_index(triplestore_t* t) {
+	for (int type = 0; type < TRIPLESTORE_TERM_TYPES; type++) {
+		my_free(t->value_index[type]);
+		t->value_index[type]		= NULL;
+		t->value_index_size[type]	= 0;
+	}
+	my_free(t->value_rank);
+	my_free(t->numeric_index);
+	my_free(t->date_index);
+	if (t->lang_bitmap) {
+		for (int key = 0; key < TRIPLESTORE_LANGUAGE_KEYS; key++) {
+			my_free(t->lang_bitmap[key]);
 		}
 	}
-	int i	= table->used++;
-	binding_t* p = &( table->ptr[ i*(1+table->width) ] );
-	memcpy(p, result, (1+table->width) * sizeof(binding_t));
-	return 0;
+	my_free(t->lang_bitmap);
+	my_free(t->lang_bitmap_count);
+	t->lang_bitmap			= NULL;
+	t->lang_bitmap_count	= NULL;
+	t->value_rank			= NULL;
+	t->numeric_index		= NULL;
+	t->numeric_index_size	= 0;
+	t->date_index			= NULL;
+	t->date_index_size		= 0;
+	t->value_index_nodes	= 0;
 }
 
-struct _sort_s {
-	triplestore_t* t;
-	sort_t* sort;
-};
-
-// static void _print_row(const char* head, FILE* f, uint32_t* row, int width) {
-//	fprintf(stderr, "%s:", head);
-//	for (int i = 1; i <= width; i++) {
-//		fprintf(stderr, " %"PRIu32"", row[i]);
-//	}
-//	fprintf(stderr, "\n");
-// }
-
-static int triplestore_term_is_numeric(rdf_term_t* term) {
-	return (term->type == TERM_TYPED_LITERAL && term->vtype.value_type.is_numeric);
+#ifdef __APPLE__
+static int _value_index_cmp(void* thunk, const void* a, const void* b) {
+#else
+static int _value_index_cmp(const void* a, const void* b, void* thunk) {
+#endif
+	triplestore_t* t	= (triplestore_t*) thunk;
+	nodeid_t aid		= *((nodeid_t*) a);
+	nodeid_t bid		= *((nodeid_t*) b);
+	return strcmp(t->graph[aid]._term->value, t->graph[bid]._term->value);
 }
 
 #ifdef __APPLE__
-int _table_row_cmp(void* thunk, const void* a, const void* b) {
+static int _numeric_index_cmp(void* thunk, const void* a, const void* b) {
 #else
-int _table_row_cmp(const void* a, const void* b, void* thunk) {
+static int _numeric_index_cmp(const void* a, const void* b, void* thunk) {
 #endif
-	if (!a) {
+	triplestore_t* t	= (triplestore_t*) thunk;
+	nodeid_t aid		= *((nodeid_t*) a);
+	nodeid_t bid		= *((nodeid_t*) b);
+	double av			= t->graph[aid]._term->vtype.value_type.numeric_value;
+	double bv			= t->graph[bid]._term->vtype.value_type.numeric_value;
+	if (av < bv) {
+		return -1;
+	} else if (av > bv) {
 		return 1;
 	}
-	if (!b) {
+	return (aid < bid) ? -1 : (aid > bid);
+}
+
+#ifdef __APPLE__
+static int _date_index_cmp(void* thunk, const void* a, const void* b) {
+#else
+static int _date_index_cmp(const void* a, const void* b, void* thunk) {
+#endif
+	triplestore_t* t	= (triplestore_t*) thunk;
+	nodeid_t aid		= *((nodeid_t*) a);
+	nodeid_t bid		= *((nodeid_t*) b);
+	int64_t av			= t->graph[aid]._term->vtype.value_type.date_value;
+	int64_t bv			= t->graph[bid]._term->vtype.value_type.date_value;
+	if (av < bv) {
 		return -1;
+	} else if (av > bv) {
+		return 1;
 	}
+	return (aid < bid) ? -1 : (aid > bid);
+}
+
+static int triplestore_build_value_index(triplestore_t* t) {
+	_triplestore_free_value_index(t);
 	
-	struct _sort_s* s	= (struct _sort_s*) thunk;
-	triplestore_t* t	= s->t;
-	sort_t* sort		= s->sort;
-	uint32_t width		= sort->size;
-	binding_t* ap		= (binding_t*) a;
-	binding_t* bp		= (binding_t*) b;
+	uint32_t counts[TRIPLESTORE_TERM_TYPES];
+	memset(counts, 0, sizeof(counts));
+	for (nodeid_t id = 1; id <= t->nodes_used; id++) {
+		rdf_term_t* term	= t->graph[id]._term;
+		if (term && term->type < TRIPLESTORE_TERM_TYPES) {
+			counts[term->type]++;
+		}
+	}
 	
-	for (uint32_t i = 0; i < width; i++) {
-		int64_t slot	= -(sort->vars[i]);
-		binding_t aid	= ap[slot];
-		binding_t bid	= bp[slot];
+	t->value_rank			= my_calloc(sizeof(uint32_t), 1+t->nodes_used);
+	t->lang_bitmap			= my_calloc(sizeof(uint64_t*), TRIPLESTORE_LANGUAGE_KEYS);
+	t->lang_bitmap_count	= my_calloc(sizeof(uint32_t), TRIPLESTORE_LANGUAGE_KEYS);
+	if (!t->value_rank || !t->lang_bitmap || !t->lang_bitmap_count) {
+		fprintf(stderr, "*** Failed to allocate memory for value index\n");
+		_triplestore_free_value_index(t);
+		return 1;
+	}
+	for (int type = 0; type < TRIPLESTORE_TERM_TYPES; type++) {
+		if (counts[type]) {
+			t->value_index[type]	= my_calloc(sizeof(nodeid_t), counts[type]);
+			if (!t->value_index[type]) {
+				fprintf(stderr, "*** Failed to allocate memory for value index\n");
+				_triplestore_free_value_index(t);
+				return 1;
+			}
+		}
+	}
+	
+	for (nodeid_t id = 1; id <= t->nodes_used; id++) {
+		rdf_term_t* term	= t->graph[id]._term;
+		if (term && term->type < TRIPLESTORE_TERM_TYPES) {
+			t->value_index[term->type][ t->value_index_size[term->type]++ ]	= id;
+		}
+	}
+	
+	for (int type = 0; type < TRIPLESTORE_TERM_TYPES; type++) {
+		nodeid_t* index	= t->value_index[type];
+		uint32_t size	= t->value_index_size[type];
+		if (size == 0) {
+			continue;
+		}
+#ifdef __APPLE__
+		qsort_r(index, size, sizeof(nodeid_t), t, _value_index_cmp);
+#else
+		qsort_r(index, size, sizeof(nodeid_t), _value_index_cmp, t);
+#endif
+		for (uint32_t rank = 0; rank < size; rank++) {
+			t->value_rank[ index[rank] ]	= rank;
+		}
+	}
+	
+	// NaN values compare false against everything, so they are left out of the numeric index
+	uint32_t numeric	= 0;
+	for (uint32_t i = 0; i < t->value_index_size[TERM_TYPED_LITERAL]; i++) {
+		rdf_term_t* term	= t->graph[ t->value_index[TERM_TYPED_LITERAL][i] ]._term;
+		if (term->vtype.value_type.is_numeric && !isnan(term->vtype.value_type.numeric_value)) {
+			numeric++;
+		}
+	}
+	if (numeric) {
+		t->numeric_index	= my_calloc(sizeof(nodeid_t), numeric);
+		if (!t->numeric_index) {
+			fprintf(stderr, "*** Failed to allocate memory for numeric index\n");
+			_triplestore_free_value_index(t);
+			return 1;
+		}
+		for (uint32_t i = 0; i < t->value_index_size[TERM_TYPED_LITERAL]; i++) {
+			nodeid_t id			= t->value_index[TERM_TYPED_LITERAL][i];
+			rdf_term_t* term	= t->graph[id]._term;
+			if (term->vtype.value_type.is_numeric && !isnan(term->vtype.value_type.numeric_value)) {
+				t->numeric_index[ t->numeric_index_size++ ]	= id;
+			}
+		}
+#ifdef __APPLE__
+		qsort_r(t->numeric_index, t->numeric_index_size, sizeof(nodeid_t), t, _numeric_index_cmp);
+#else
+		qsort_r(t->numeric_index, t->numeric_index_size, sizeof(nodeid_t), _numeric_index_cmp, t);
+#endif
+	}
+	
+	uint32_t dates	= 0;
+	for (uint32_t i = 0; i < t->value_index_size[TERM_TYPED_LITERAL]; i++) {
+		if (t->graph[ t->value_index[TERM_TYPED_LITERAL][i] ]._term->vtype.value_type.is_date) {
+			dates++;
+		}
+	}
+	if (dates) {
+		t->date_index	= my_calloc(sizeof(nodeid_t), dates);
+		if (!t->date_index) {
+			fprintf(stderr, "*** Failed to allocate memory for date index\n");
+			_triplestore_free_value_index(t);
+			return 1;
+		}
+		for (uint32_t i = 0; i < t->value_index_size[TERM_TYPED_LITERAL]; i++) {
+			nodeid_t id	= t->value_index[TERM_TYPED_LITERAL][i];
+			if (t->graph[id]._term->vtype.value_type.is_date) {
+				t->date_index[ t->date_index_size++ ]	= id;
+			}
+		}
+#ifdef __APPLE__
+		qsort_r(t->date_index, t->date_index_size, sizeof(nodeid_t), t, _date_index_cmp);
+#else
+		qsort_r(t->date_index, t->date_index_size, sizeof(nodeid_t), _date_index_cmp, t);
+#endif
+	}
+	
+	t->value_index_nodes	= t->nodes_used;
+	t->value_index_generation++;
+	return 0;
+}
+
+static int _triplestore_ensure_value_index(triplestore_t* t) {
+	if (t->value_rank && t->value_index_nodes == t->nodes_used) {
+		return 0;
+	}
+	return triplestore_build_value_index(t);
+}
+
+// Find the range [*start, *end) of ranks in the value index for the given term type whose values begin with prefix.
+static int _triplestore_prefix_range(triplestore_t* t, rdf_term_type_t type, const char* prefix, size_t prefix_len, uint32_t* start, uint32_t* end) {
+	*start	= 0;
+	*end	= 0;
+	if (type >= TRIPLESTORE_TERM_TYPES) {
+		return 1;
+	}
+	if (_triplestore_ensure_value_index(t)) {
+		return 1;
+	}
+	
+	nodeid_t* index	= t->value_index[type];
+	uint32_t size	= t->value_index_size[type];
+	
+	// lower bound: first value that sorts at or after the prefix
+	uint32_t lo	= 0;
+	uint32_t hi	= size;
+	while (lo < hi) {
+		uint32_t mid	= lo + (hi - lo) / 2;
+		if (strncmp(t->graph[ index[mid] ]._term->value, prefix, prefix_len) < 0) {
+			lo	= mid + 1;
+		} else {
+			hi	= mid;
+		}
+	}
+	*start	= lo;
+	
+	// upper bound: first value that sorts after every value beginning with the prefix
+	hi	= size;
+	while (lo < hi) {
+		uint32_t mid	= lo + (hi - lo) / 2;
+		if (strncmp(t->graph[ index[mid] ]._term->value, prefix, prefix_len) <= 0) {
+			lo	= mid + 1;
+		} else {
+			hi	= mid;
+		}
+	}
+	*end	= lo;
+	return 0;
+}
+
+int triplestore_match_prefix(triplestore_t* t, rdf_term_type_t type, const char* prefix, size_t prefix_len, int(^block)(nodeid_t id)) {
+	uint32_t start, end;
+	if (_triplestore_prefix_range(t, type, prefix, prefix_len, &start, &end)) {
+		return 1;
+	}
+	for (uint32_t rank = start; rank < end; rank++) {
+		if (block(t->value_index[type][rank])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Returns the position of the first entry in the numeric index whose value is not less than (or, if inclusive is
+// false, not less than or equal to) value.
+static uint32_t _triplestore_numeric_bound(triplestore_t* t, double value, int inclusive) {
+	uint32_t lo	= 0;
+	uint32_t hi	= t->numeric_index_size;
+	while (lo < hi) {
+		uint32_t mid	= lo + (hi - lo) / 2;
+		double v		= t->graph[ t->numeric_index[mid] ]._term->vtype.value_type.numeric_value;
+		if (v < value || (!inclusive && v == value)) {
+			lo	= mid + 1;
+		} else {
+			hi	= mid;
+		}
+	}
+	return lo;
+}
+
+// Find the range [*start, *end) of positions in the numeric index whose values lie between min and max.
+static int _triplestore_numeric_range(triplestore_t* t, double min, int min_inclusive, double max, int max_inclusive, uint32_t* start, uint32_t* end) {
+	*start	= 0;
+	*end	= 0;
+	if (_triplestore_ensure_value_index(t)) {
+		return 1;
+	}
+	if (isnan(min) || isnan(max)) {
+		return 0;
+	}
+	*start	= _triplestore_numeric_bound(t, min, min_inclusive);
+	*end	= _triplestore_numeric_bound(t, max, !max_inclusive);
+	if (*end < *start) {
+		*end	= *start;
+	}
+	return 0;
+}
+
+int triplestore_match_numeric_range(triplestore_t* t, double min, int min_inclusive, double max, int max_inclusive, int(^block)(nodeid_t id)) {
+	uint32_t start, end;
+	if (_triplestore_numeric_range(t, min, min_inclusive, max, max_inclusive, &start, &end)) {
+		return 1;
+	}
+	for (uint32_t i = start; i < end; i++) {
+		if (block(t->numeric_index[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// As _triplestore_numeric_bound, for the date index.
+static uint32_t _triplestore_date_bound(triplestore_t* t, int64_t value, int inclusive) {
+	uint32_t lo	= 0;
+	uint32_t hi	= t->date_index_size;
+	while (lo < hi) {
+		uint32_t mid	= lo + (hi - lo) / 2;
+		int64_t v		= t->graph[ t->date_index[mid] ]._term->vtype.value_type.date_value;
+		if (v < value || (!inclusive && v == value)) {
+			lo	= mid + 1;
+		} else {
+			hi	= mid;
+		}
+	}
+	return lo;
+}
+
+// Find the range [*start, *end) of positions in the date index whose values lie between min and max.
+static int _triplestore_date_range(triplestore_t* t, int64_t min, int min_inclusive, int64_t max, int max_inclusive, uint32_t* start, uint32_t* end) {
+	*start	= 0;
+	*end	= 0;
+	if (_triplestore_ensure_value_index(t)) {
+		return 1;
+	}
+	*start	= _triplestore_date_bound(t, min, min_inclusive);
+	*end	= _triplestore_date_bound(t, max, !max_inclusive);
+	if (*end < *start) {
+		*end	= *start;
+	}
+	return 0;
+}
+
+int triplestore_match_date_range(triplestore_t* t, int64_t min, int min_inclusive, int64_t max, int max_inclusive, int(^block)(nodeid_t id)) {
+	uint32_t start, end;
+	if (_triplestore_date_range(t, min, min_inclusive, max, max_inclusive, &start, &end)) {
+		return 1;
+	}
+	for (uint32_t i = start; i < end; i++) {
+		if (block(t->date_index[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int _language_char_key(char c) {
+	c	= tolower(c);
+	if (c >= '0' && c <= '9') {
+		return 1 + (c - '0');
+	} else if (c >= 'a' && c <= 'z') {
+		return 11 + (c - 'a');
+	} else if (c == '_') {
+		return 37;
+	}
+	return -1;
+}
+
+// Returns the slot in the language bitmap table for the primary language subtag at the start of lang, or -1 if the
+// string does not begin with a two character primary language.
+static int _triplestore_language_key(const char* lang) {
+	int a	= _language_char_key(lang[0]);
+	int b	= (a < 0) ? -1 : _language_char_key(lang[1]);
+	if (b < 0 || !(lang[2] == '\0' || lang[2] == '-')) {
+		return -1;
+	}
+	return 64 * a + b;
+}
+
+// Returns the bitmap (indexed by node ID) of language-tagged literals whose primary language has the given key,
+// building it if this is the first request for the language. Bitmaps are published with a compare-and-swap so that
+// concurrent queries against a read-only store may race to build the same one.
+static uint64_t* _triplestore_language_bitmap(triplestore_t* t, int key, uint32_t* count) {
+	if (_triplestore_ensure_value_index(t)) {
+		return NULL;
+	}
+	uint64_t* bitmap	= __atomic_load_n(&(t->lang_bitmap[key]), __ATOMIC_ACQUIRE);
+	if (bitmap) {
+		*count	= __atomic_load_n(&(t->lang_bitmap_count[key]), __ATOMIC_RELAXED);
+		return bitmap;
+	}
+	
+	bitmap	= my_calloc(sizeof(uint64_t), 1 + t->value_index_nodes / 64);
+	if (!bitmap) {
+		fprintf(stderr, "*** Failed to allocate memory for language bitmap\n");
+		return NULL;
+	}
+	uint32_t c	= 0;
+	for (uint32_t i = 0; i < t->value_index_size[TERM_LANG_LITERAL]; i++) {
+		nodeid_t id	= t->value_index[TERM_LANG_LITERAL][i];
+		if (_triplestore_language_key((char*) &(t->graph[id]._term->vtype.value_lang)) == key) {
+			bitmap[id / 64]	|= (1ULL << (id % 64));
+			c++;
+		}
+	}
+	
+	// the count is stored before the bitmap is published (with release ordering), so a thread that sees the bitmap
+	// also sees its count; racing builders store the same count
+	uint64_t* expected	= NULL;
+	__atomic_store_n(&(t->lang_bitmap_count[key]), c, __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&(t->lang_bitmap[key]), &expected, bitmap, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+		// another thread published the same bitmap first
+		my_free(bitmap);
+		bitmap	= expected;
+	}
+	*count	= c;
+	return bitmap;
+}
+
+int triplestore_build_indexes(triplestore_t* t) {
+	return triplestore_build_value_index(t);
+}
+
+#pragma mark -
+#pragma mark Result Tables
+
+table_t* triplestore_new_table(int width) {
+	table_t* table	= my_calloc(1, sizeof(table_t));
+	table->width	= width;
+	table->alloc	= 128;
+	table->used		= 0;
+	table->ptr		= my_calloc(table->alloc, (1+width) * sizeof(binding_t));
+	return table;
+}
+
+int triplestore_free_table(table_t* table) {
+	my_free(table->ptr);
+	my_free(table);
+	return 0;
+}
+
+binding_t* triplestore_table_row_ptr(table_t* table, int row) {
+	binding_t* p = &( table->ptr[ row*(1+table->width) ] );
+	return p;
+}
+
+int triplestore_table_add_row(table_t* table, binding_t* result) {
+	if (table->used == table->alloc) {
+		table->alloc	*= 2;
+		size_t requested	= table->alloc * (1+table->width) * sizeof(binding_t);
+// 		fprintf(stderr, "Reallocating to %zu bytes (currently have %d rows)\n", requested, table->used);
+		table->ptr	= realloc(table->ptr, requested);
+		if (table->ptr == NULL) {
+			fprintf(stderr, "failed to grow table size\n");
+			return 1;
+		}
+	}
+	int i	= table->used++;
+	binding_t* p = &( table->ptr[ i*(1+table->width) ] );
+	memcpy(p, result, (1+table->width) * sizeof(binding_t));
+	return 0;
+}
+
+struct _sort_s {
+	triplestore_t* t;
+	sort_t* sort;
+};
+
+// static void _print_row(const char* head, FILE* f, uint32_t* row, int width) {
+//	fprintf(stderr, "%s:", head);
+//	for (int i = 1; i <= width; i++) {
+//		fprintf(stderr, " %"PRIu32"", row[i]);
+//	}
+//	fprintf(stderr, "\n");
+// }
+
+static int triplestore_term_is_numeric(triplestore_t* t, nodeid_t id) {
+	return (t->node_flags[id] & TRIPLESTORE_NODE_NUMERIC);
+}
+
+static int triplestore_term_is_date(triplestore_t* t, nodeid_t id) {
+	return (t->node_flags[id] & TRIPLESTORE_NODE_DATE);
+}
+
+#ifdef __APPLE__
+int _table_row_cmp(void* thunk, const void* a, const void* b) {
+#else
+int _table_row_cmp(const void* a, const void* b, void* thunk) {
+#endif
+	if (!a) {
+		return 1;
+	}
+	if (!b) {
+		return -1;
+	}
+	
+	struct _sort_s* s	= (struct _sort_s*) thunk;
+	triplestore_t* t	= s->t;
+	sort_t* sort		= s->sort;
+	uint32_t width		= sort->size;
+	binding_t* ap		= (binding_t*) a;
+	binding_t* bp		= (binding_t*) b;
+	
+	for (uint32_t i = 0; i < width; i++) {
+		int64_t slot	= -(sort->vars[i]);
+		binding_t aid	= ap[slot];
+		binding_t bid	= bp[slot];
 		if (aid == 0 && bid == 0) {
 			continue;
 		} else if (aid == 0) {
@@ -844,8 +1522,8 @@ int _table_row_cmp(const void* a, const void* b, void* thunk) {
 		rdf_term_t* aterm	= t->graph[aid]._term;
 		rdf_term_t* bterm	= t->graph[bid]._term;
 		
-		int a_is_numeric	= triplestore_term_is_numeric(aterm);
-		int b_is_numeric	= triplestore_term_is_numeric(bterm);
+		int a_is_numeric	= triplestore_term_is_numeric(t, (nodeid_t) aid);
+		int b_is_numeric	= triplestore_term_is_numeric(t, (nodeid_t) bid);
 		
 		if (a_is_numeric && b_is_numeric) {
 			double av	= aterm->vtype.value_type.numeric_value;
@@ -863,6 +1541,15 @@ int _table_row_cmp(const void* a, const void* b, void* thunk) {
 			return -1;
 		}
 		
+		if (triplestore_term_is_date(t, (nodeid_t) aid) && triplestore_term_is_date(t, (nodeid_t) bid)) {
+			int64_t av	= aterm->vtype.value_type.date_value;
+			int64_t bv	= bterm->vtype.value_type.date_value;
+			if (av == bv) {
+				continue;
+			}
+			return (av < bv) ? -1 : 1;
+		}
+		
 		char* as	= triplestore_term_to_string(t, aterm);
 		char* bs	= triplestore_term_to_string(t, bterm);
 		int r		= strcmp(as, bs);
@@ -890,6 +1577,63 @@ int triplestore_table_sort(triplestore_t* t, table_t* table, sort_t* sort) {
 #pragma mark -
 #pragma mark Filters
 
+// Normalize a LANGMATCHES language range in the same way that language tags are normalized on input (lowercase
+// language, uppercase region, titlecase script), and compute the packed value and mask used to match it against
+// value_lang.
+static void _filter_set_language_range(query_filter_t* filter, const char* range, size_t len) {
+	filter->lang_range		= 0;
+	filter->lang_mask		= 0;
+	if (len == 1 && range[0] == '*') {
+		filter->lang_range_len	= 0;
+		return;
+	} else if (len == 0 || len > 7) {
+		// stored language tags are at most 7 characters, so a longer range can never match
+		filter->lang_range_len	= -1;
+		return;
+	}
+	
+	char* ptr	= (char*) &(filter->lang_range);
+	char* mask	= (char*) &(filter->lang_mask);
+	size_t subtag_start	= 0;
+	for (size_t i = 0; i <= len; i++) {
+		if (i < len && range[i] != '-') {
+			continue;
+		}
+		size_t subtag_len	= i - subtag_start;
+		for (size_t j = subtag_start; j < i; j++) {
+			char c	= range[j];
+			if (subtag_start == 0) {
+				c	= tolower(c);
+			} else if (subtag_len == 2) {
+				c	= toupper(c);
+			} else if (subtag_len == 4) {
+				c	= (j == subtag_start) ? toupper(c) : tolower(c);
+			} else {
+				c	= tolower(c);
+			}
+			ptr[j]	= c;
+		}
+		if (i < len) {
+			ptr[i]	= '-';
+		}
+		subtag_start	= i + 1;
+	}
+	memset(mask, 0xff, len);
+	filter->lang_range_len	= (int) len;
+}
+
+// Returns true if the packed language tag matches the LANGMATCHES filter's range: either the range is "*", or the range
+// is equal to the tag or to a prefix of the tag that is followed by a '-'.
+static int _filter_language_matches(query_filter_t* filter, int64_t value_lang) {
+	if (filter->lang_range_len == 0) {
+		return (value_lang != 0);
+	} else if (filter->lang_range_len < 0 || (value_lang & filter->lang_mask) != filter->lang_range) {
+		return 0;
+	}
+	char next	= ((char*) &value_lang)[filter->lang_range_len];
+	return (next == '\0' || next == '-');
+}
+
 query_filter_t* triplestore_new_filter(filter_type_t type, ...) {
 	va_list ap;
 	va_start(ap, type);
@@ -923,7 +1667,7 @@ query_filter_t* triplestore_new_filter(filter_type_t type, ...) {
 			flags		|= PCRE_CASELESS;
 		}
 		filter->re = pcre_compile(
-			pat,			/* the pattern */
+			filter->string2,	/* the pattern */
 			flags,			/* default options */
 			&error,			/* for error message */
 			&erroffset,		/* for error offset */
@@ -937,8 +1681,32 @@ query_filter_t* triplestore_new_filter(filter_type_t type, ...) {
 			return NULL;
 		}
 		
+		// the same pattern is matched against every row, so it is worth the up-front cost of JIT compilation
+		filter->re_extra	= triplestore_study_regex("filter", filter->re);
 		
-//	FILTER_LANGMATCHES, // LANGMATCHES(STR(?var), "string")
+	} else if (type == FILTER_LANGMATCHES) {
+		filter->node1			= va_arg(ap, int64_t);
+		const char* range		= va_arg(ap, char*);
+		size_t range_len		= va_arg(ap, size_t);
+		filter->string2			= my_calloc(1, 1+range_len);
+		strncpy(filter->string2, range, range_len);
+		filter->string2_type	= TERM_XSDSTRING_LITERAL;
+		filter->string2_lang	= NULL;
+		_filter_set_language_range(filter, range, range_len);
+	} else if (type == FILTER_IRIPREFIX) {
+		filter->node1			= va_arg(ap, int64_t);
+		const char* pat			= va_arg(ap, char*);
+		size_t pat_len			= va_arg(ap, size_t);
+		filter->string2			= my_calloc(1, 1+pat_len);
+		strncpy(filter->string2, pat, pat_len);
+		filter->string2_type	= TERM_XSDSTRING_LITERAL;
+		filter->string2_lang	= NULL;
+	} else if (type == FILTER_LT || type == FILTER_LE || type == FILTER_GT || type == FILTER_GE || type == FILTER_EQ) {
+		filter->node1			= va_arg(ap, int64_t);
+		filter->number2			= va_arg(ap, double);
+	} else if (type == FILTER_DATE_LT || type == FILTER_DATE_LE || type == FILTER_DATE_GT || type == FILTER_DATE_GE || type == FILTER_DATE_EQ) {
+		filter->node1			= va_arg(ap, int64_t);
+		filter->date2			= va_arg(ap, int64_t);
 	} else if (type == FILTER_STRSTARTS || type == FILTER_STRENDS || type == FILTER_CONTAINS) {
 		filter->node1			= va_arg(ap, int64_t);
 		const char* pat			= va_arg(ap, char*);
@@ -971,6 +1739,9 @@ int triplestore_free_filter(query_filter_t* filter) {
 	if (filter->string3) {
 		my_free(filter->string3);
 	}
+	if (filter->re_extra) {
+		triplestore_free_regex_study(filter->re_extra);
+	}
 	if (filter->re) {
 		pcre_free(filter->re);
 	}
@@ -989,31 +1760,209 @@ int _filter_args_are_term_compatible(query_filter_t* filter, rdf_term_t* term) {
 	return 0;
 }
 
-int _triplestore_filter_match(triplestore_t* t, query_filter_t* filter, binding_t* current_match, int(^block)(binding_t* final_match)) {
-	int64_t node1;
-	int64_t node2;
-	int rc;
-	rdf_term_t* term;
-	nodeid_t tmpid;
-	switch (filter->type) {
-		case FILTER_ISIRI:
-			if (t->graph[ current_match[-(filter->node1)] ]._term->type != TERM_IRI) {
-				return 0;
+// Compute (once per value index generation) the ranges of the value index that match a STRSTARTS or IRIPREFIX filter,
+// or the range of the numeric index that matches a numeric comparison filter.
+static int _triplestore_filter_ranges(triplestore_t* t, query_filter_t* filter) {
+	if (_triplestore_ensure_value_index(t)) {
+		return 1;
+	}
+	if (filter->index_generation == t->value_index_generation) {
+		return 0;
+	}
+	
+	double v	= filter->number2;
+	switch (filter->type) {
+		case FILTER_LT:
+			_triplestore_numeric_range(t, -INFINITY, 1, v, 0, &(filter->range_start), &(filter->range_end));
+			break;
+		case FILTER_LE:
+			_triplestore_numeric_range(t, -INFINITY, 1, v, 1, &(filter->range_start), &(filter->range_end));
+			break;
+		case FILTER_GT:
+			_triplestore_numeric_range(t, v, 0, INFINITY, 1, &(filter->range_start), &(filter->range_end));
+			break;
+		case FILTER_GE:
+			_triplestore_numeric_range(t, v, 1, INFINITY, 1, &(filter->range_start), &(filter->range_end));
+			break;
+		case FILTER_EQ:
+			_triplestore_numeric_range(t, v, 1, v, 1, &(filter->range_start), &(filter->range_end));
+			break;
+		case FILTER_DATE_LT:
+			_triplestore_date_range(t, INT64_MIN, 1, filter->date2, 0, &(filter->range_start), &(filter->range_end));
+			break;
+		case FILTER_DATE_LE:
+			_triplestore_date_range(t, INT64_MIN, 1, filter->date2, 1, &(filter->range_start), &(filter->range_end));
+			break;
+		case FILTER_DATE_GT:
+			_triplestore_date_range(t, filter->date2, 0, INT64_MAX, 1, &(filter->range_start), &(filter->range_end));
+			break;
+		case FILTER_DATE_GE:
+			_triplestore_date_range(t, filter->date2, 1, INT64_MAX, 1, &(filter->range_start), &(filter->range_end));
+			break;
+		case FILTER_DATE_EQ:
+			_triplestore_date_range(t, filter->date2, 1, filter->date2, 1, &(filter->range_start), &(filter->range_end));
+			break;
+		case FILTER_STRSTARTS:
+		case FILTER_IRIPREFIX: {
+			size_t len	= strlen(filter->string2);
+			for (int type = 0; type < TRIPLESTORE_TERM_TYPES; type++) {
+				filter->prefix_start[type]	= 0;
+				filter->prefix_end[type]	= 0;
+				if (type == 0 || (filter->type == FILTER_IRIPREFIX && type != TERM_IRI)) {
+					continue;
+				}
+				_triplestore_prefix_range(t, (rdf_term_type_t) type, filter->string2, len, &(filter->prefix_start[type]), &(filter->prefix_end[type]));
+			}
+			break;
+		}
+		default:
+			break;
+	}
+	filter->index_generation	= t->value_index_generation;
+	return 0;
+}
+
+// Returns the number of nodes that can possibly satisfy the filter (using the store indexes), or -1 if the filter
+// cannot produce such a candidate set.
+static int64_t _triplestore_filter_candidate_count(triplestore_t* t, query_filter_t* filter) {
+	if (filter->node1 >= 0) {
+		return -1;
+	}
+	switch (filter->type) {
+		case FILTER_STRSTARTS:
+		case FILTER_IRIPREFIX:
+			if (_triplestore_filter_ranges(t, filter)) {
+				return -1;
+			} else {
+				int64_t count	= 0;
+				for (int type = 0; type < TRIPLESTORE_TERM_TYPES; type++) {
+					count	+= filter->prefix_end[type] - filter->prefix_start[type];
+				}
+				return count;
+			}
+		case FILTER_LT:
+		case FILTER_LE:
+		case FILTER_GT:
+		case FILTER_GE:
+		case FILTER_EQ:
+		case FILTER_DATE_LT:
+		case FILTER_DATE_LE:
+		case FILTER_DATE_GT:
+		case FILTER_DATE_GE:
+		case FILTER_DATE_EQ:
+			if (_triplestore_filter_ranges(t, filter)) {
+				return -1;
+			}
+			return filter->range_end - filter->range_start;
+		case FILTER_LANGMATCHES:
+			if (filter->lang_range_len < 0) {
+				return 0;
+			} else if (filter->lang_range_len == 0) {
+				return -1;
+			} else {
+				// the bitmap of the range's primary language is a superset of the matching nodes
+				uint32_t count;
+				int key	= _triplestore_language_key(filter->string2);
+				if (key < 0) {
+					return 0;
+				} else if (!_triplestore_language_bitmap(t, key, &count)) {
+					return -1;
+				}
+				return count;
+			}
+		default:
+			return -1;
+	}
+}
+
+static int _triplestore_filter_candidates(triplestore_t* t, query_filter_t* filter, int(^block)(nodeid_t id)) {
+	if (_triplestore_filter_ranges(t, filter)) {
+		return 1;
+	}
+	switch (filter->type) {
+		case FILTER_LANGMATCHES: {
+			uint32_t count;
+			int key				= _triplestore_language_key(filter->string2);
+			uint64_t* bitmap	= (key < 0 || filter->lang_range_len < 0) ? NULL : _triplestore_language_bitmap(t, key, &count);
+			if (!bitmap) {
+				return 0;
+			}
+			uint32_t words	= 1 + t->value_index_nodes / 64;
+			for (uint32_t w = 0; w < words; w++) {
+				uint64_t bits	= bitmap[w];
+				while (bits) {
+					nodeid_t id	= 64 * w + __builtin_ctzll(bits);
+					bits		&= bits - 1;
+					if (filter->lang_range_len == 2 || _filter_language_matches(filter, t->graph[id]._term->vtype.value_lang)) {
+						if (block(id)) {
+							return 1;
+						}
+					}
+				}
+			}
+			return 0;
+		}
+		case FILTER_STRSTARTS:
+		case FILTER_IRIPREFIX:
+			for (int type = 0; type < TRIPLESTORE_TERM_TYPES; type++) {
+				for (uint32_t rank = filter->prefix_start[type]; rank < filter->prefix_end[type]; rank++) {
+					if (block(t->value_index[type][rank])) {
+						return 1;
+					}
+				}
+			}
+			return 0;
+		case FILTER_LT:
+		case FILTER_LE:
+		case FILTER_GT:
+		case FILTER_GE:
+		case FILTER_EQ:
+			for (uint32_t i = filter->range_start; i < filter->range_end; i++) {
+				if (block(t->numeric_index[i])) {
+					return 1;
+				}
+			}
+			return 0;
+		case FILTER_DATE_LT:
+		case FILTER_DATE_LE:
+		case FILTER_DATE_GT:
+		case FILTER_DATE_GE:
+		case FILTER_DATE_EQ:
+			for (uint32_t i = filter->range_start; i < filter->range_end; i++) {
+				if (block(t->date_index[i])) {
+					return 1;
+				}
+			}
+			return 0;
+		default:
+			return 1;
+	}
+}
+
+int _triplestore_filter_match(triplestore_t* t, query_filter_t* filter, binding_t* current_match, int(^block)(binding_t* final_match)) {
+	int64_t node1;
+	int64_t node2;
+	int rc;
+	rdf_term_t* term;
+	nodeid_t tmpid;
+	switch (filter->type) {
+		case FILTER_ISIRI:
+			if ((t->node_flags[ current_match[-(filter->node1)] ] & TRIPLESTORE_NODE_TYPE_MASK) != TERM_IRI) {
+				return 0;
 			}
 			break;
 		case FILTER_ISLITERAL:
-			term	= t->graph[ current_match[-(filter->node1)] ]._term;
-			if (!(term->type == TERM_XSDSTRING_LITERAL || term->type == TERM_LANG_LITERAL || term->type == TERM_TYPED_LITERAL)) {
+			if (!(t->node_flags[ current_match[-(filter->node1)] ] & TRIPLESTORE_NODE_LITERAL)) {
 				return 0;
 			}
 			break;
 		case FILTER_ISBLANK:
-			if (t->graph[ current_match[-(filter->node1)] ]._term->type != TERM_BLANK) {
+			if ((t->node_flags[ current_match[-(filter->node1)] ] & TRIPLESTORE_NODE_TYPE_MASK) != TERM_BLANK) {
 				return 0;
 			}
 			break;
 		case FILTER_ISNUMERIC:
-			if (!triplestore_term_is_numeric(t->graph[ current_match[-(filter->node1)] ]._term)) {
+			if (!triplestore_term_is_numeric(t, (nodeid_t) current_match[-(filter->node1)])) {
 				return 0;
 			}
 			break;
@@ -1064,20 +2013,86 @@ int _triplestore_filter_match(triplestore_t* t, query_filter_t* filter, binding_
 			}
 			return 0;
 		case FILTER_STRSTARTS:
-			term	= t->graph[ current_match[-(filter->node1)] ]._term;
-			rc = triplestore_term_get_value(term, ^(size_t len, const char* value){
-				if (len >= strlen(filter->string2)) {
-					if (0 == strncmp(value, filter->string2, strlen(filter->string2))) {
-						return 1;
-					}
+		case FILTER_IRIPREFIX:
+			if (filter->node1 >= 0) {
+				return 0;
+			}
+			tmpid	= (nodeid_t)current_match[-(filter->node1)];
+			if (!tmpid || _triplestore_filter_ranges(t, filter)) {
+				return 0;
+			} else {
+				// the matching values occupy a contiguous range of the sorted value index
+				rdf_term_type_t type	= (rdf_term_type_t) (t->node_flags[ tmpid ] & TRIPLESTORE_NODE_TYPE_MASK);
+				uint32_t rank			= t->value_rank[ tmpid ];
+				if (type >= TRIPLESTORE_TERM_TYPES || rank < filter->prefix_start[type] || rank >= filter->prefix_end[type]) {
+					return 0;
 				}
+			}
+			break;
+		case FILTER_LT:
+		case FILTER_LE:
+		case FILTER_GT:
+		case FILTER_GE:
+		case FILTER_EQ:
+			if (filter->node1 >= 0) {
 				return 0;
-			});
-			
-			if (rc) {
-				break;
 			}
-			return 0;
+			tmpid	= (nodeid_t)current_match[-(filter->node1)];
+			if (!tmpid || !triplestore_term_is_numeric(t, tmpid)) {
+				return 0;
+			} else {
+				term		= t->graph[ tmpid ]._term;
+				double v	= term->vtype.value_type.numeric_value;
+				double c	= filter->number2;
+				if (!((filter->type == FILTER_LT && v < c) || (filter->type == FILTER_LE && v <= c) || (filter->type == FILTER_GT && v > c) || (filter->type == FILTER_GE && v >= c) || (filter->type == FILTER_EQ && v == c))) {
+					return 0;
+				}
+			}
+			break;
+		case FILTER_DATE_LT:
+		case FILTER_DATE_LE:
+		case FILTER_DATE_GT:
+		case FILTER_DATE_GE:
+		case FILTER_DATE_EQ:
+			if (filter->node1 >= 0) {
+				return 0;
+			}
+			tmpid	= (nodeid_t)current_match[-(filter->node1)];
+			if (!tmpid || !triplestore_term_is_date(t, tmpid)) {
+				return 0;
+			} else {
+				term		= t->graph[ tmpid ]._term;
+				int64_t v	= term->vtype.value_type.date_value;
+				int64_t c	= filter->date2;
+				if (!((filter->type == FILTER_DATE_LT && v < c) || (filter->type == FILTER_DATE_LE && v <= c) || (filter->type == FILTER_DATE_GT && v > c) || (filter->type == FILTER_DATE_GE && v >= c) || (filter->type == FILTER_DATE_EQ && v == c))) {
+					return 0;
+				}
+			}
+			break;
+		case FILTER_LANGMATCHES:
+			if (filter->node1 >= 0) {
+				return 0;
+			}
+			tmpid	= (nodeid_t)current_match[-(filter->node1)];
+			if (!tmpid || filter->lang_range_len < 0) {
+				return 0;
+			} else if (filter->lang_range_len == 2) {
+				// a bare primary language range is a probe of that language's bitmap
+				uint32_t count;
+				int key				= _triplestore_language_key(filter->string2);
+				uint64_t* bitmap	= (key < 0) ? NULL : _triplestore_language_bitmap(t, key, &count);
+				if (!bitmap || tmpid > t->value_index_nodes || !(bitmap[tmpid / 64] & (1ULL << (tmpid % 64)))) {
+					return 0;
+				}
+			} else if ((t->node_flags[ tmpid ] & TRIPLESTORE_NODE_TYPE_MASK) != TERM_LANG_LITERAL) {
+				return 0;
+			} else {
+				term	= t->graph[ tmpid ]._term;
+				if (!_filter_language_matches(filter, term->vtype.value_lang)) {
+					return 0;
+				}
+			}
+			break;
 		case FILTER_STRENDS:
 			term	= t->graph[ current_match[-(filter->node1)] ]._term;
 			rc = triplestore_term_get_value(term, ^(size_t len, const char* value){
@@ -1101,12 +2116,12 @@ int _triplestore_filter_match(triplestore_t* t, query_filter_t* filter, binding_
 			}
 			term	= t->graph[ current_match[-node1] ]._term;
 			rc = triplestore_term_get_value(term, ^(size_t len, const char* value){
-				int OVECCOUNT	= 30;
+				int OVECCOUNT	= 3;
 				int ovector[OVECCOUNT];
 				// fprintf(stderr, "matching (?%s) %s =~ %s (%p)\n", query->variable_names[-(filter->node1)], term->value, filter->string2, filter->re);
 				return pcre_exec(
 					filter->re,					/* the compiled pattern */
-					NULL,						/* no extra data - we didn't study the pattern */
+					filter->re_extra,			/* study data (JIT code) */
 					value,						/* the subject string */
 					(int) len,					/* the length of the subject */
 					0,							/* start at offset 0 in the subject */
@@ -1115,7 +2130,7 @@ int _triplestore_filter_match(triplestore_t* t, query_filter_t* filter, binding_
 					OVECCOUNT					/* number of elements in the output vector */
 				);
 			});
-			if (rc <= 0) {
+			if (rc < 0) {
 				return 0;
 			}
 			break;
@@ -1256,191 +2271,1419 @@ int triplestore_free_project(project_t* project) {
 	return 0;
 }
 
-int triplestore_set_projection(project_t* project, int64_t var) {
-	project->keep[-var] = 1;
+int triplestore_set_projection(project_t* project, int64_t var) {
+	project->keep[-var] = 1;
+	return 0;
+}
+
+static int _triplestore_project(query_t* query, project_t* project, binding_t* current_match, int(^block)(binding_t* final_match)) {
+	int vars	= triplestore_query_get_max_variables(query);
+	int psize	= project->size;
+// 	fprintf(stderr, "%d %d\n", vars, psize);
+	for (int i = 1; i <= vars; i++) {
+// 		const char* var	= query->variable_names[i];
+		if (i <= vars && i <= psize && project->keep[i] != 0) {
+// 			fprintf(stderr, "Keep %d ?%s\n", i, var);
+		} else {
+// 			fprintf(stderr, "Drop %d ?%s\n", i, var);
+			current_match[i]	= 0;
+		}
+	}
+	return block(current_match);
+}
+
+
+#pragma mark -
+#pragma mark Sorting
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter"
+sort_t* triplestore_new_sort(triplestore_t* t, int result_width, int variables, int unique) {
+	sort_t* sort	= my_calloc(sizeof(sort_t), 1);
+	sort->size		= variables;
+	sort->unique	= unique;
+	sort->vars		= my_calloc(sizeof(int64_t), variables);
+	sort->table		= triplestore_new_table(result_width);
+	return sort;
+}
+#pragma clang diagnostic pop
+
+int triplestore_free_sort(sort_t* sort) {
+	triplestore_free_table(sort->table);
+	my_free(sort->vars);
+	my_free(sort);
+	return 0;
+}
+
+int triplestore_set_sort(sort_t* sort, int rank, int64_t var) {
+	sort->vars[rank]	= var;
+	return 0;
+}
+
+static int _triplestore_sort_fill(sort_t* sort, binding_t* current_match) {
+	return triplestore_table_add_row(sort->table, current_match);
+}
+
+
+#pragma mark -
+#pragma mark Parallel Matching
+
+#define PARALLEL_MIN_ITEMS	256		// fewer items than this are all handled by the calling thread
+#define PARALLEL_MAX_CHUNK	1024	// most items claimed by a thread at a time
+#define PARALLEL_BATCH		256		// result rows handed from a worker to the calling thread at a time
+#define PARALLEL_QUEUED		4		// batches (or when ordered, chunks) per thread allowed ahead of the calling thread
+
+struct _parallel_batch_s {
+	struct _parallel_batch_s* next;
+	uint32_t used;
+	binding_t rows[];
+};
+
+struct _parallel_results_s {
+	struct _parallel_batch_s* head;
+	struct _parallel_batch_s* tail;
+	int done;
+};
+
+// The shared state of a parallel match over items 1..count. Items are claimed in chunks by the calling thread and
+// by tasks running on the pool. Each thread evaluates items with its own local state (from setup) and hands the
+// rows it produces to the calling thread, which is the only thread that calls consume. When ordered, rows are
+// consumed in item order (each chunk's rows are held until every earlier chunk has been consumed); otherwise they
+// are consumed as they arrive. The job is reference counted because queued tasks may not start until after the
+// caller has returned; such tasks see that the job is closed and return without touching anything else.
+struct _parallel_job_s {
+	uint32_t count;
+	uint32_t chunk;				// items per chunk
+	uint32_t chunks;
+	uint32_t width;				// binding_t values per row
+	int ordered;
+	void*(^setup)(int caller);
+	void(^teardown)(void* local, int caller);
+	int(^eval)(void* local, uint32_t item, int(^emit)(binding_t* row));
+	uint32_t next;				// the first chunk not yet claimed
+	uint32_t emitted;			// when ordered, the chunk whose rows are being consumed
+	int refs;					// the calling thread and each submitted task
+	int active;					// tasks that have started and not yet finished
+	int closed;
+	int stop;
+	int error;
+	uint32_t queued;
+	uint32_t max_queued;
+	struct _parallel_results_s queue;		// rows waiting to be consumed (unordered)
+	struct _parallel_results_s* results;	// rows waiting to be consumed, per chunk (ordered)
+	pthread_mutex_t lock;
+	pthread_cond_t produced;
+	pthread_cond_t consumed;
+};
+
+static void _parallel_results_free(struct _parallel_results_s* results) {
+	while (results->head) {
+		struct _parallel_batch_s* batch	= results->head;
+		results->head					= batch->next;
+		free(batch);
+	}
+	results->tail	= NULL;
+}
+
+static void _parallel_job_release(struct _parallel_job_s* job) {
+	pthread_mutex_lock(&job->lock);
+	int last	= (--job->refs == 0);
+	pthread_mutex_unlock(&job->lock);
+	if (last) {
+		_parallel_results_free(&job->queue);
+		if (job->results) {
+			for (uint32_t i = 0; i < job->chunks; i++) {
+				_parallel_results_free(&(job->results[i]));
+			}
+			free(job->results);
+		}
+		pthread_cond_destroy(&job->produced);
+		pthread_cond_destroy(&job->consumed);
+		pthread_mutex_destroy(&job->lock);
+		free(job);
+	}
+}
+
+static void _parallel_job_stop(struct _parallel_job_s* job, int error) {
+	pthread_mutex_lock(&job->lock);
+	job->stop	= 1;
+	job->error	|= error;
+	pthread_cond_broadcast(&job->consumed);
+	pthread_mutex_unlock(&job->lock);
+}
+
+// Claims the next chunk, returning 1 if one was claimed and 0 once none are left. When ordered, chunks are only
+// handed out a limited distance ahead of the chunk being consumed: workers (wait) wait for the calling thread to
+// catch up, while the calling thread gets -1 back so that it can go and consume rows itself.
+static int _parallel_job_claim(struct _parallel_job_s* job, int wait, uint32_t* chunk) {
+	int claimed	= 0;
+	pthread_mutex_lock(&job->lock);
+	while (!job->stop && job->next < job->chunks) {
+		if (!job->ordered || job->next < job->emitted + job->max_queued) {
+			*chunk	= job->next++;
+			claimed	= 1;
+			break;
+		} else if (!wait) {
+			claimed	= -1;
+			break;
+		}
+		pthread_cond_wait(&job->consumed, &job->lock);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return claimed;
+}
+
+// Queues a batch of rows from chunk. If wait is true, waits while too many batches are already queued (unless chunk
+// is the one being consumed, which must always be able to make progress). Returns true if the job has been stopped.
+static int _parallel_job_push(struct _parallel_job_s* job, uint32_t chunk, struct _parallel_batch_s* batch, int wait) {
+	pthread_mutex_lock(&job->lock);
+	while (wait && job->queued >= job->max_queued && !job->stop && !(job->ordered && chunk == job->emitted)) {
+		pthread_cond_wait(&job->consumed, &job->lock);
+	}
+	int stop	= job->stop;
+	if (!stop) {
+		struct _parallel_results_s* results	= job->ordered ? &(job->results[chunk]) : &(job->queue);
+		if (results->tail) {
+			results->tail->next	= batch;
+		} else {
+			results->head	= batch;
+		}
+		results->tail	= batch;
+		job->queued++;
+		pthread_cond_broadcast(&job->produced);
+	}
+	pthread_mutex_unlock(&job->lock);
+	if (stop) {
+		free(batch);
+	}
+	return stop;
+}
+
+static void _parallel_job_finish_chunk(struct _parallel_job_s* job, uint32_t chunk) {
+	if (job->ordered) {
+		pthread_mutex_lock(&job->lock);
+		job->results[chunk].done	= 1;
+		pthread_cond_broadcast(&job->produced);
+		pthread_mutex_unlock(&job->lock);
+	}
+}
+
+// Dequeues the next batch that may be consumed. If wait is true and there is none, waits for one, unless the job
+// has moved on to a chunk nobody has claimed yet (which the calling thread should claim) or nothing more can arrive.
+static struct _parallel_batch_s* _parallel_job_pop(struct _parallel_job_s* job, int wait) {
+	struct _parallel_batch_s* batch	= NULL;
+	pthread_mutex_lock(&job->lock);
+	while (1) {
+		struct _parallel_results_s* results	= &(job->queue);
+		if (job->ordered) {
+			if (job->emitted >= job->chunks) {
+				break;
+			}
+			results	= &(job->results[job->emitted]);
+		}
+		if (results->head) {
+			batch			= results->head;
+			results->head	= batch->next;
+			if (!results->head) {
+				results->tail	= NULL;
+			}
+			job->queued--;
+			pthread_cond_broadcast(&job->consumed);
+			break;
+		} else if (job->ordered && results->done) {
+			job->emitted++;
+			pthread_cond_broadcast(&job->consumed);
+			continue;
+		} else if (!wait || (job->ordered ? job->emitted >= job->next : job->active == 0)) {
+			break;
+		}
+		pthread_cond_wait(&job->produced, &job->lock);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return batch;
+}
+
+// True once every row has been consumed, or the job has been stopped.
+static int _parallel_job_finished(struct _parallel_job_s* job) {
+	pthread_mutex_lock(&job->lock);
+	int finished	= job->stop || (job->ordered ? job->emitted >= job->chunks : (job->active == 0 && !job->queue.head));
+	pthread_mutex_unlock(&job->lock);
+	return finished;
+}
+
+// Calls consume with each row that may be consumed now (waiting for rows if wait is true), returning the first
+// non-zero value consume returns.
+static int _parallel_job_drain(struct _parallel_job_s* job, int wait, int(^consume)(binding_t* row)) {
+	struct _parallel_batch_s* batch;
+	while ((batch = _parallel_job_pop(job, wait))) {
+		int r	= 0;
+		for (uint32_t i = 0; i < batch->used && !r; i++) {
+			r	= consume(&(batch->rows[i * job->width]));
+		}
+		free(batch);
+		if (r) {
+			return r;
+		}
+	}
+	return 0;
+}
+
+// Evaluates the items of chunk. Rows are passed straight to consume if it is given (by the calling thread, when it
+// may consume rows of this chunk immediately), and otherwise queued in batches.
+static int _parallel_job_eval_chunk(struct _parallel_job_s* job, void* local, uint32_t chunk, int wait, int(^consume)(binding_t* row)) {
+	__block struct _parallel_batch_s* batch	= NULL;
+	__block uint32_t produced				= 0;
+	uint32_t end	= (chunk + 1) * job->chunk;
+	if (end > job->count) {
+		end	= job->count;
+	}
+	int r	= 0;
+	for (uint32_t item = 1 + chunk * job->chunk; item <= end && !r; item++) {
+		r	= job->eval(local, item, ^(binding_t* row) {
+			if (consume) {
+				int rc	= consume(row);
+				if (!rc && !job->ordered && ++produced % PARALLEL_BATCH == 0) {
+					// keep the workers' rows flowing while this thread works through a large chunk
+					rc	= _parallel_job_drain(job, 0, consume);
+				}
+				return rc;
+			}
+			if (!batch && !(batch = calloc(1, sizeof(struct _parallel_batch_s) + PARALLEL_BATCH * job->width * sizeof(binding_t)))) {
+				fprintf(stderr, "*** Failed to allocate memory for parallel match results\n");
+				_parallel_job_stop(job, 1);
+				return 1;
+			}
+			memcpy(&(batch->rows[batch->used * job->width]), row, job->width * sizeof(binding_t));
+			if (++batch->used == PARALLEL_BATCH) {
+				struct _parallel_batch_s* full	= batch;
+				batch							= NULL;
+				return _parallel_job_push(job, chunk, full, wait);
+			}
+			return 0;
+		});
+	}
+	if (batch) {
+		if (r) {
+			free(batch);
+		} else {
+			r	= _parallel_job_push(job, chunk, batch, wait);
+		}
+	}
+	_parallel_job_finish_chunk(job, chunk);
+	return r;
+}
+
+static void _parallel_job_run(void* arg) {
+	struct _parallel_job_s* job	= arg;
+	pthread_mutex_lock(&job->lock);
+	int started	= !job->closed && !job->stop;
+	if (started) {
+		job->active++;
+	}
+	pthread_mutex_unlock(&job->lock);
+	
+	if (started) {
+		// if the local state can't be set up, this task just leaves its share of the work to the others
+		void* local	= job->setup(0);
+		if (local) {
+			uint32_t chunk;
+			while (_parallel_job_claim(job, 1, &chunk) > 0) {
+				if (_parallel_job_eval_chunk(job, local, chunk, 1, NULL)) {
+					break;
+				}
+			}
+			job->teardown(local, 0);
+		}
+		pthread_mutex_lock(&job->lock);
+		job->active--;
+		pthread_cond_broadcast(&job->produced);
+		pthread_mutex_unlock(&job->lock);
+	}
+	_parallel_job_release(job);
+}
+
+// Evaluates items 1..count across the calling thread and the threads of pool, calling consume on the calling thread
+// with each row of width values that eval produces. Each thread gets its own local state from setup (which is
+// passed true for the calling thread) and releases it with teardown. Returns the first non-zero value returned by
+// consume, or 1 if evaluation failed.
+static int _triplestore_parallel_match(triplestore_pool_t* pool, uint32_t count, uint32_t width, int ordered, void*(^setup)(int caller), void(^teardown)(void* local, int caller), int(^eval)(void* local, uint32_t item, int(^emit)(binding_t* row)), int(^consume)(binding_t* row)) {
+	if (count == 0) {
+		return 0;
+	}
+	uint32_t threads		= (uint32_t) triplestore_pool_threads(pool);
+	struct _parallel_job_s* job	= calloc(1, sizeof(struct _parallel_job_s));
+	if (!job) {
+		fprintf(stderr, "*** Failed to allocate memory for parallel match\n");
+		return 1;
+	}
+	// aim for enough chunks per thread that uneven items still balance out
+	job->chunk		= count / (16 * (threads + 1));
+	job->chunk		= (job->chunk < 1) ? 1 : (job->chunk > PARALLEL_MAX_CHUNK) ? PARALLEL_MAX_CHUNK : job->chunk;
+	job->count		= count;
+	job->chunks		= (count + job->chunk - 1) / job->chunk;
+	job->width		= width;
+	job->ordered	= ordered;
+	job->setup		= setup;
+	job->teardown	= teardown;
+	job->eval		= eval;
+	job->refs		= 1;
+	job->max_queued	= PARALLEL_QUEUED * (threads + 1);
+	if (ordered && !(job->results = calloc(job->chunks, sizeof(struct _parallel_results_s)))) {
+		fprintf(stderr, "*** Failed to allocate memory for parallel match\n");
+		free(job);
+		return 1;
+	}
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->produced, NULL);
+	pthread_cond_init(&job->consumed, NULL);
+	
+	// the calling thread claims chunks too, so no more tasks are needed than there are other chunks
+	uint32_t tasks	= (count < PARALLEL_MIN_ITEMS) ? 0 : (threads < job->chunks) ? threads : job->chunks - 1;
+	for (uint32_t i = 0; i < tasks; i++) {
+		pthread_mutex_lock(&job->lock);
+		job->refs++;
+		pthread_mutex_unlock(&job->lock);
+		if (triplestore_pool_async(pool, _parallel_job_run, job)) {
+			_parallel_job_release(job);
+			break;
+		}
+	}
+	
+	int r		= 0;
+	void* local	= setup(1);
+	if (local) {
+		uint32_t chunk;
+		int claimed;
+		while (!r && (claimed = _parallel_job_claim(job, 0, &chunk))) {
+			if (claimed < 0) {
+				// too far ahead of the rows being consumed; wait for some
+				struct _parallel_batch_s* batch	= _parallel_job_pop(job, 1);
+				if (batch) {
+					for (uint32_t i = 0; i < batch->used && !r; i++) {
+						r	= consume(&(batch->rows[i * width]));
+					}
+					free(batch);
+				}
+			} else {
+				// rows of the chunk being consumed (or any rows at all, when unordered) can be consumed immediately
+				int direct	= !ordered || chunk == job->emitted;
+				r			= _parallel_job_eval_chunk(job, local, chunk, 0, direct ? consume : NULL);
+			}
+			if (!r) {
+				r	= _parallel_job_drain(job, 0, consume);
+			}
+		}
+		teardown(local, 1);
+	} else {
+		r	= 1;
+	}
+	
+	pthread_mutex_lock(&job->lock);
+	job->closed	= 1;
+	pthread_mutex_unlock(&job->lock);
+	while (!r && !_parallel_job_finished(job)) {
+		r	= _parallel_job_drain(job, 1, consume);
+	}
+	
+	// stop any task still running (if consume asked to stop early) and wait for it to finish with local state
+	_parallel_job_stop(job, 0);
+	pthread_mutex_lock(&job->lock);
+	while (job->active > 0) {
+		pthread_cond_wait(&job->produced, &job->lock);
+	}
+	if (job->error) {
+		r	= 1;
+	}
+	pthread_mutex_unlock(&job->lock);
+	_parallel_job_release(job);
+	return r;
+}
+
+#pragma mark -
+#pragma mark Closures
+
+static void _triplestore_free_closure(closure_t* c) {
+	my_free(c->component);
+	my_free(c->member_offset);
+	my_free(c->members);
+	my_free(c->interval_offset);
+	my_free(c->intervals);
+	my_free(c->cyclic);
+	memset(c, 0, sizeof(closure_t));
+}
+
+static void _triplestore_free_closures(triplestore_t* t) {
+	for (uint32_t i = 0; i < t->closures_count; i++) {
+		_triplestore_free_closure(&(t->closures[i]));
+	}
+	my_free(t->closures);
+	t->closures			= NULL;
+	t->closures_count	= 0;
+}
+
+// Returns the closure of pred if one has been built and no triples have been added since.
+static closure_t* _triplestore_closure(triplestore_t* t, nodeid_t pred) {
+	for (uint32_t i = 0; i < t->closures_count; i++) {
+		closure_t* c	= &(t->closures[i]);
+		if (c->pred == pred) {
+			return (c->edges == t->edges_used) ? c : NULL;
+		}
+	}
+	return NULL;
+}
+
+static int _triplestore_closure_group_members(closure_t* c) {
+	c->member_offset	= my_calloc(sizeof(uint32_t), 2+c->components);
+	uint32_t* cursor	= my_calloc(sizeof(uint32_t), 2+c->components);
+	if (!c->member_offset || !cursor) {
+		my_free(cursor);
+		return 1;
+	}
+	for (nodeid_t id = 1; id <= c->nodes; id++) {
+		if (c->component[id]) {
+			c->member_offset[ c->component[id] + 1 ]++;
+		}
+	}
+	for (uint32_t cn = 1; cn <= c->components+1; cn++) {
+		c->member_offset[cn]	+= c->member_offset[cn-1];
+	}
+	memcpy(cursor, c->member_offset, (2+c->components) * sizeof(uint32_t));
+	c->members	= my_calloc(sizeof(nodeid_t), 1+c->member_offset[c->components+1]);
+	if (!c->members) {
+		my_free(cursor);
+		return 1;
+	}
+	for (nodeid_t id = 1; id <= c->nodes; id++) {
+		if (c->component[id]) {
+			c->members[ cursor[c->component[id]]++ ]	= id;
+		}
+	}
+	my_free(cursor);
+	return 0;
+}
+
+struct _closure_frame_s {
+	nodeid_t node;
+	nodeid_t edge;		// next out-edge of node to examine
+	uint32_t entry;		// number of components completed when node was first visited
+};
+
+struct _closure_intervals_s {
+	uint32_t* pairs;
+	uint32_t used;
+	uint32_t alloc;
+};
+
+static int _closure_intervals_push(struct _closure_intervals_s* list, uint32_t lo, uint32_t hi) {
+	if (list->used == list->alloc) {
+		uint32_t alloc	= list->alloc ? 2 * list->alloc : 64;
+		uint32_t* pairs	= realloc(list->pairs, 2 * alloc * sizeof(uint32_t));
+		if (!pairs) {
+			fprintf(stderr, "*** Failed to allocate memory for closure intervals\n");
+			return 1;
+		}
+		list->pairs	= pairs;
+		list->alloc	= alloc;
+	}
+	list->pairs[2*list->used]	= lo;
+	list->pairs[2*list->used+1]	= hi;
+	list->used++;
+	return 0;
+}
+
+static int _closure_interval_cmp(const void* a, const void* b) {
+	uint32_t alo	= ((const uint32_t*) a)[0];
+	uint32_t blo	= ((const uint32_t*) b)[0];
+	return (alo < blo) ? -1 : (alo > blo);
+}
+
+// Finds the strongly connected components of the pred subgraph with an iterative Tarjan search. Tarjan numbers the
+// components in reverse topological order, and the components completed while a component's root is on the DFS
+// stack form the contiguous range [entry+1, c], all of which are reachable from c. Each component's interval list
+// is that range merged with the lists of the components it has edges to (which are already complete).
+static int _triplestore_closure_compute(triplestore_t* t, closure_t* c) {
+	uint32_t n							= c->nodes;
+	nodeid_t pred						= c->pred;
+	uint32_t* order						= my_calloc(sizeof(uint32_t), 1+n);
+	uint32_t* low						= my_calloc(sizeof(uint32_t), 1+n);
+	uint32_t* first						= my_calloc(sizeof(uint32_t), 1+n);
+	nodeid_t* stack						= my_calloc(sizeof(nodeid_t), 1+n);
+	struct _closure_frame_s* frames		= my_calloc(sizeof(struct _closure_frame_s), 1+n);
+	c->component						= my_calloc(sizeof(uint32_t), 1+n);
+	int error							= (!order || !low || !first || !stack || !frames || !c->component);
+	
+	uint32_t counter	= 0;
+	for (nodeid_t root = 1; root <= n && !error; root++) {
+		if (order[root]) {
+			continue;
+		}
+		nodeid_t idx	= t->graph[root].out_edge_head;
+		while (idx != 0 && t->edges[idx].p != pred) {
+			idx	= t->edges[idx].next_out;
+		}
+		if (idx == 0) {
+			continue;
+		}
+		
+		uint32_t depth		= 0;
+		uint32_t stacked	= 0;
+		order[root]			= low[root]	= ++counter;
+		stack[stacked++]	= root;
+		frames[depth++]		= (struct _closure_frame_s) { root, t->graph[root].out_edge_head, c->components };
+		while (depth > 0) {
+			struct _closure_frame_s* f	= &(frames[depth-1]);
+			nodeid_t v					= f->node;
+			nodeid_t idx				= f->edge;
+			while (idx != 0 && t->edges[idx].p != pred) {
+				idx	= t->edges[idx].next_out;
+			}
+			if (idx != 0) {
+				f->edge		= t->edges[idx].next_out;
+				nodeid_t w	= t->edges[idx].o;
+				if (!order[w]) {
+					order[w]			= low[w]	= ++counter;
+					stack[stacked++]	= w;
+					frames[depth++]		= (struct _closure_frame_s) { w, t->graph[w].out_edge_head, c->components };
+				} else if (!c->component[w] && order[w] < low[v]) {
+					low[v]	= order[w];
+				}
+				continue;
+			}
+			
+			if (low[v] == order[v]) {
+				uint32_t cn	= ++(c->components);
+				first[cn]	= f->entry + 1;
+				nodeid_t w;
+				do {
+					w				= stack[--stacked];
+					c->component[w]	= cn;
+				} while (w != v);
+			}
+			if (--depth > 0) {
+				nodeid_t parent	= frames[depth-1].node;
+				if (low[v] < low[parent]) {
+					low[parent]	= low[v];
+				}
+			}
+		}
+	}
+	my_free(order);
+	my_free(low);
+	my_free(stack);
+	my_free(frames);
+	
+	if (!error) {
+		error	= _triplestore_closure_group_members(c);
+	}
+	
+	c->cyclic			= my_calloc(sizeof(uint8_t), 1+c->components);
+	c->interval_offset	= my_calloc(sizeof(uint32_t), 2+c->components);
+	uint32_t* added		= my_calloc(sizeof(uint32_t), 1+c->components);
+	error				= error || !c->cyclic || !c->interval_offset || !added;
+	
+	for (nodeid_t e = 1; e <= t->edges_used && !error; e++) {
+		if (t->edges[e].p == pred && c->component[t->edges[e].s] == c->component[t->edges[e].o]) {
+			c->cyclic[ c->component[t->edges[e].s] ]	= 1;
+		}
+	}
+	
+	struct _closure_intervals_s merged	= { NULL, 0, 0 };
+	struct _closure_intervals_s pending	= { NULL, 0, 0 };
+	for (uint32_t cn = 1; cn <= c->components && !error; cn++) {
+		pending.used	= 0;
+		error			= _closure_intervals_push(&pending, first[cn], cn);
+		for (uint32_t m = c->member_offset[cn]; m < c->member_offset[cn+1] && !error; m++) {
+			for (nodeid_t idx = t->graph[ c->members[m] ].out_edge_head; idx != 0 && !error; idx = t->edges[idx].next_out) {
+				uint32_t d	= c->component[ t->edges[idx].o ];
+				if (t->edges[idx].p != pred || d == cn || added[d] == cn) {
+					continue;
+				}
+				added[d]	= cn;
+				for (uint32_t i = c->interval_offset[d]; i < c->interval_offset[d+1] && !error; i++) {
+					error	= _closure_intervals_push(&pending, merged.pairs[2*i], merged.pairs[2*i+1]);
+				}
+			}
+		}
+		if (pending.used > 1) {
+			qsort(pending.pairs, pending.used, 2 * sizeof(uint32_t), _closure_interval_cmp);
+		}
+		
+		c->interval_offset[cn]	= merged.used;
+		for (uint32_t i = 0; i < pending.used && !error; i++) {
+			uint32_t lo	= pending.pairs[2*i];
+			uint32_t hi	= pending.pairs[2*i+1];
+			if (merged.used > c->interval_offset[cn] && lo <= merged.pairs[2*(merged.used-1)+1] + 1) {
+				if (hi > merged.pairs[2*(merged.used-1)+1]) {
+					merged.pairs[2*(merged.used-1)+1]	= hi;
+				}
+			} else {
+				error	= _closure_intervals_push(&merged, lo, hi);
+			}
+		}
+		c->interval_offset[cn+1]	= merged.used;
+	}
+	free(pending.pairs);
+	my_free(added);
+	my_free(first);
+	c->intervals	= merged.pairs;
+	return error;
+}
+
+int triplestore_build_closure(triplestore_t* t, nodeid_t pred) {
+	if (pred == 0 || pred > t->nodes_used) {
+		fprintf(stderr, "*** Cannot build closure for unknown predicate %"PRIu32"\n", pred);
+		return 1;
+	}
+	
+	closure_t closure;
+	memset(&closure, 0, sizeof(closure_t));
+	closure.pred	= pred;
+	closure.edges	= t->edges_used;
+	closure.nodes	= t->nodes_used;
+	if (_triplestore_closure_compute(t, &closure)) {
+		fprintf(stderr, "*** Failed to allocate memory for closure\n");
+		_triplestore_free_closure(&closure);
+		return 1;
+	}
+	
+	for (uint32_t i = 0; i < t->closures_count; i++) {
+		if (t->closures[i].pred == pred) {
+			_triplestore_free_closure(&(t->closures[i]));
+			t->closures[i]	= closure;
+			return 0;
+		}
+	}
+	closure_t* closures	= realloc(t->closures, (1+t->closures_count) * sizeof(closure_t));
+	if (!closures) {
+		fprintf(stderr, "*** Failed to allocate memory for closure\n");
+		_triplestore_free_closure(&closure);
+		return 1;
+	}
+	t->closures							= closures;
+	t->closures[t->closures_count++]	= closure;
+	return 0;
+}
+
+// Returns true if end is reachable from start by one or more edges.
+static int _triplestore_closure_reaches(closure_t* c, nodeid_t start, nodeid_t end) {
+	if (start > c->nodes || end > c->nodes) {
+		return 0;
+	}
+	uint32_t cs	= c->component[start];
+	uint32_t ce	= c->component[end];
+	if (cs == 0 || ce == 0) {
+		return 0;
+	} else if (cs == ce) {
+		return c->cyclic[cs];
+	}
+	
+	uint32_t min	= c->interval_offset[cs];
+	uint32_t max	= c->interval_offset[cs+1];
+	while (min < max) {
+		uint32_t mid	= min + (max - min) / 2;
+		if (c->intervals[2*mid+1] < ce) {
+			min	= mid + 1;
+		} else {
+			max	= mid;
+		}
+	}
+	return (min < c->interval_offset[cs+1] && c->intervals[2*min] <= ce);
+}
+
+// Calls block with every node reachable from start by one or more edges.
+static int _triplestore_closure_enumerate(closure_t* c, nodeid_t start, int(^block)(nodeid_t reached)) {
+	uint32_t cs	= (start > c->nodes) ? 0 : c->component[start];
+	if (cs == 0) {
+		return 0;
+	}
+	for (uint32_t i = c->interval_offset[cs]; i < c->interval_offset[cs+1]; i++) {
+		for (uint32_t cn = c->intervals[2*i]; cn <= c->intervals[2*i+1]; cn++) {
+			if (cn == cs && !c->cyclic[cs]) {
+				continue;
+			}
+			for (uint32_t m = c->member_offset[cn]; m < c->member_offset[cn+1]; m++) {
+				if (block(c->members[m])) {
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int _write32_array(int fd, const uint32_t* values, uint32_t count) {
+	uint32_t buffer[1024];
+	while (count > 0) {
+		uint32_t n	= (count < 1024) ? count : 1024;
+		for (uint32_t i = 0; i < n; i++) {
+			buffer[i]	= htonl(values[i]);
+		}
+		write(fd, buffer, n * sizeof(uint32_t));
+		values	+= n;
+		count	-= n;
+	}
+	return 0;
+}
+
+static void _read32_array(const char* buffer, uint32_t* values, uint32_t count) {
+	for (uint32_t i = 0; i < count; i++) {
+		values[i]	= ntohl(*((uint32_t*) &(buffer[4*i])));
+	}
+}
+
+// Closures are written after the edges as an optional "3CLO" section, so dumps without one still load.
+static int _triplestore_dump_closures(triplestore_t* t, int fd) {
+	uint32_t count	= 0;
+	for (uint32_t i = 0; i < t->closures_count; i++) {
+		if (_triplestore_closure(t, t->closures[i].pred)) {
+			count++;
+		}
+	}
+	if (count == 0) {
+		return 0;
+	}
+	
+	write(fd, "3CLO", 4);
+	_write32(fd, count);
+	for (uint32_t i = 0; i < t->closures_count; i++) {
+		closure_t* c	= &(t->closures[i]);
+		if (!_triplestore_closure(t, c->pred)) {
+			continue;
+		}
+		_write32(fd, c->pred);
+		_write32(fd, c->edges);
+		_write32(fd, c->nodes);
+		_write32(fd, c->components);
+		_write32(fd, c->interval_offset[c->components+1]);
+		_write32_array(fd, &(c->component[1]), c->nodes);
+		_write32_array(fd, c->interval_offset, 2+c->components);
+		_write32_array(fd, c->intervals, 2*c->interval_offset[c->components+1]);
+		write(fd, c->cyclic, 1+c->components);
+	}
+	return 0;
+}
+
+static int _triplestore_closure_valid(closure_t* c, uint32_t pairs) {
+	for (nodeid_t id = 1; id <= c->nodes; id++) {
+		if (c->component[id] > c->components) {
+			return 0;
+		}
+	}
+	for (uint32_t cn = 1; cn <= c->components+1; cn++) {
+		if (c->interval_offset[cn] < c->interval_offset[cn-1] || c->interval_offset[cn] > pairs) {
+			return 0;
+		}
+	}
+	for (uint32_t i = 0; i < pairs; i++) {
+		if (c->intervals[2*i] == 0 || c->intervals[2*i] > c->intervals[2*i+1] || c->intervals[2*i+1] > c->components) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int _triplestore_load_closures(triplestore_t* t, const char* mp, const char* end) {
+	if (end - mp < 8 || strncmp(mp, "3CLO", 4)) {
+		return 0;
+	}
+	uint32_t count	= ntohl(*((uint32_t*) &(mp[4])));
+	mp				+= 8;
+	t->closures		= my_calloc(sizeof(closure_t), count ? count : 1);
+	int error		= (t->closures == NULL);
+	
+	for (uint32_t i = 0; i < count && !error; i++) {
+		closure_t* c	= &(t->closures[t->closures_count++]);
+		if (end - mp < 20) {
+			error	= 1;
+			break;
+		}
+		// a closure built over a different number of edges than the dump has is kept but not used (as if triples had
+		// been added since it was built)
+		c->pred			= ntohl(*((uint32_t*) &(mp[0])));
+		c->edges		= ntohl(*((uint32_t*) &(mp[4])));
+		c->nodes		= ntohl(*((uint32_t*) &(mp[8])));
+		c->components	= ntohl(*((uint32_t*) &(mp[12])));
+		uint32_t pairs	= ntohl(*((uint32_t*) &(mp[16])));
+		mp				+= 20;
+		
+		size_t size		= 4 * (size_t) c->nodes + 4 * (2 + (size_t) c->components) + 8 * (size_t) pairs + 1 + (size_t) c->components;
+		if (c->nodes > t->nodes_used || c->components > c->nodes || (size_t) (end - mp) < size) {
+			error	= 1;
+			break;
+		}
+		c->component		= my_calloc(sizeof(uint32_t), 1+c->nodes);
+		c->interval_offset	= my_calloc(sizeof(uint32_t), 2+c->components);
+		c->intervals		= my_calloc(sizeof(uint32_t), 2+2*(size_t)pairs);
+		c->cyclic			= my_calloc(sizeof(uint8_t), 1+c->components);
+		if (!c->component || !c->interval_offset || !c->intervals || !c->cyclic) {
+			error	= 1;
+			break;
+		}
+		_read32_array(mp, &(c->component[1]), c->nodes);
+		mp	+= 4 * (size_t) c->nodes;
+		_read32_array(mp, c->interval_offset, 2+c->components);
+		mp	+= 4 * (2 + (size_t) c->components);
+		_read32_array(mp, c->intervals, 2*pairs);
+		mp	+= 8 * (size_t) pairs;
+		memcpy(c->cyclic, mp, 1+c->components);
+		mp	+= 1 + c->components;
+		error	= !_triplestore_closure_valid(c, pairs) || _triplestore_closure_group_members(c);
+	}
+	
+	if (error) {
+		fprintf(stderr, "*** Failed to load closures from dump\n");
+		_triplestore_free_closures(t);
+		return 1;
+	}
+	return 0;
+}
+
+#pragma mark -
+#pragma mark Paths
+
+// A visited set stores, for each node, the generation in which it was last marked. Starting a new traversal only
+// bumps the generation (the stamps are cleared only when the counter wraps), so a path can be evaluated from many
+// start nodes without touching nodes_used bytes of memory for each one.
+static int _visited_set_reset(visited_set_t* v, uint32_t size) {
+	if (v->size < size) {
+		uint32_t* stamps	= calloc(size, sizeof(uint32_t));
+		if (!stamps) {
+			fprintf(stderr, "*** Failed to allocate memory for path visited set\n");
+			return 1;
+		}
+		free(v->stamps);
+		v->stamps		= stamps;
+		v->size			= size;
+		v->generation	= 0;
+	}
+	if (++v->generation == 0) {
+		memset(v->stamps, 0, v->size * sizeof(uint32_t));
+		v->generation	= 1;
+	}
+	return 0;
+}
+
+static inline int _visited_set_contains(visited_set_t* v, nodeid_t id) {
+	return v->stamps[id] == v->generation;
+}
+
+// Marks id as visited, returning true if it had already been visited in the current generation.
+static inline int _visited_set_add(visited_set_t* v, nodeid_t id) {
+	if (v->stamps[id] == v->generation) {
+		return 1;
+	}
+	v->stamps[id]	= v->generation;
+	return 0;
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter"
+path_t* triplestore_new_path_predicate(triplestore_t* t, nodeid_t pred) {
+	path_t* path	= my_calloc(sizeof(path_t), 1);
+	if (path) {
+		path->type	= PATH_PREDICATE;
+		path->pred	= pred;
+	}
+	return path;
+}
+
+path_t* triplestore_new_path_negated(triplestore_t* t, const nodeid_t* preds, uint32_t count) {
+	path_t* path	= my_calloc(sizeof(path_t), 1);
+	if (!path) {
+		return NULL;
+	}
+	path->type			= PATH_NEGATED;
+	path->preds			= my_calloc(sizeof(nodeid_t), 1+count);
+	path->preds_count	= count;
+	if (!path->preds) {
+		my_free(path);
+		return NULL;
+	}
+	memcpy(path->preds, preds, count * sizeof(nodeid_t));
+	return path;
+}
+
+// Takes ownership of the operand paths (which are freed if the path cannot be constructed). right must be NULL
+// for the unary operators, and non-NULL for PATH_SEQUENCE and PATH_ALTERNATIVE.
+path_t* triplestore_new_path_operator(triplestore_t* t, path_type_t type, path_t* left, path_t* right) {
+	int unary	= (type == PATH_PLUS || type == PATH_STAR || type == PATH_ZERO_OR_ONE || type == PATH_INVERSE);
+	int binary	= (type == PATH_SEQUENCE || type == PATH_ALTERNATIVE);
+	path_t* path	= NULL;
+	if (left && ((unary && !right) || (binary && right))) {
+		path	= my_calloc(sizeof(path_t), 1);
+	} else {
+		fprintf(stderr, "*** Invalid operands for path type %d\n", type);
+	}
+	if (!path) {
+		if (left) {
+			triplestore_free_path(left);
+		}
+		if (right) {
+			triplestore_free_path(right);
+		}
+		return NULL;
+	}
+	path->type	= type;
+	path->left	= left;
+	path->right	= right;
+	return path;
+}
+#pragma clang diagnostic pop
+
+int triplestore_path_set_endpoints(path_t* path, int64_t start, int64_t end) {
+	path->start	= start;
+	path->end	= end;
+	return 0;
+}
+
+// Returns pred+ (or pred*, pred? or just pred, depending on type) between start and end.
+path_t* triplestore_new_path(triplestore_t* t, path_type_t type, int64_t start, nodeid_t pred, int64_t end) {
+	path_t* path	= NULL;
+	switch (type) {
+		case PATH_PREDICATE:
+			path	= triplestore_new_path_predicate(t, pred);
+			break;
+		case PATH_PLUS:
+		case PATH_STAR:
+		case PATH_ZERO_OR_ONE:
+			path	= triplestore_new_path_operator(t, type, triplestore_new_path_predicate(t, pred), NULL);
+			break;
+		default:
+			fprintf(stderr, "*** Path type %d cannot be constructed from a single predicate\n", type);
+			return NULL;
+	}
+	if (path) {
+		triplestore_path_set_endpoints(path, start, end);
+	}
+	return path;
+}
+
+int triplestore_free_path(path_t* path) {
+	if (path->left) {
+		triplestore_free_path(path->left);
+	}
+	if (path->right) {
+		triplestore_free_path(path->right);
+	}
+	my_free(path->preds);
+	free(path->starts.stamps);
+	free(path->forward.stamps);
+	free(path->backward.stamps);
+	my_free(path);
+	return 0;
+}
+
+struct _path_frontier_s {
+	nodeid_t* ids;
+	uint32_t used;
+	uint32_t alloc;
+};
+
+static int _path_frontier_push(struct _path_frontier_s* f, nodeid_t id) {
+	if (f->used == f->alloc) {
+		uint32_t alloc	= f->alloc ? 2 * f->alloc : 64;
+		nodeid_t* ids	= realloc(f->ids, alloc * sizeof(nodeid_t));
+		if (!ids) {
+			fprintf(stderr, "*** Failed to allocate memory for path frontier\n");
+			return 1;
+		}
+		f->ids		= ids;
+		f->alloc	= alloc;
+	}
+	f->ids[f->used++]	= id;
+	return 0;
+}
+
+// True for pred+ and pred*, which are answered by the predicate's closure (if any) or a search along its edges.
+static int _triplestore_path_is_predicate_closure(path_t* path) {
+	return (path->type == PATH_PLUS || path->type == PATH_STAR) && path->left->type == PATH_PREDICATE;
+}
+
+// Calls block with every node reachable from s by one or more edges of the predicate of the pred+/pred* path
+// (or, if inverse is true, every node that reaches s), in depth-first order.
+// Instead of recursing, the search keeps an explicit stack holding the next unvisited edge of each node on the
+// current branch, so arbitrarily long chains cannot overflow the C stack.
+static int _triplestore_path_step(triplestore_t* t, path_t* path, nodeid_t s, int inverse, int(^block)(nodeid_t reached)) {
+	assert(s > 0);
+	if (s > t->nodes_used) {
+		return 0;
+	}
+	nodeid_t pred		= path->left->pred;
+	closure_t* closure	= inverse ? NULL : _triplestore_closure(t, pred);
+	if (closure) {
+		return _triplestore_closure_enumerate(closure, s, block);
+	}
+	if (_visited_set_reset(&path->forward, 1+t->nodes_used)) {
+		return 1;
+	}
+	
+	struct _path_frontier_s stack	= { NULL, 0, 0 };
+	int r							= _path_frontier_push(&stack, inverse ? t->graph[s].in_edge_head : t->graph[s].out_edge_head);
+	while (!r && stack.used > 0) {
+		nodeid_t idx	= stack.ids[stack.used-1];
+		if (idx == 0) {
+			stack.used--;
+			continue;
+		}
+		stack.ids[stack.used-1]	= inverse ? t->edges[idx].next_in : t->edges[idx].next_out;
+		
+		nodeid_t o	= inverse ? t->edges[idx].s : t->edges[idx].o;
+		if (t->edges[idx].p != pred || _visited_set_add(&path->forward, o)) {
+			continue;
+		}
+		if ((r = block(o))) {
+			break;
+		}
+		r	= _path_frontier_push(&stack, inverse ? t->graph[o].in_edge_head : t->graph[o].out_edge_head);
+	}
+	free(stack.ids);
+	return r;
+}
+
+// Returns true if end can be reached from start by following one or more (or for PATH_STAR, zero or more) edges of
+// the predicate of the pred+/pred* path.
+// The search runs breadth-first from both ends (along out-edges from start and in-edges to end), always expanding the
+// smaller frontier, and stops as soon as an edge joins a node reached from start to a node that reaches end.
+static int _triplestore_path_reachable(triplestore_t* t, path_t* path, nodeid_t start, nodeid_t end) {
+	if (start > t->nodes_used || end > t->nodes_used) {
+		return 0;
+	}
+	if (path->type == PATH_STAR && start == end) {
+		return 1;
+	}
+	nodeid_t pred		= path->left->pred;
+	closure_t* closure	= _triplestore_closure(t, pred);
+	if (closure) {
+		return _triplestore_closure_reaches(closure, start, end);
+	}
+	
+	visited_set_t* reached	= &path->forward;
+	visited_set_t* reaches	= &path->backward;
+	if (_visited_set_reset(reached, 1+t->nodes_used) || _visited_set_reset(reaches, 1+t->nodes_used)) {
+		return 0;
+	}
+	struct _path_frontier_s forward		= { NULL, 0, 0 };
+	struct _path_frontier_s backward	= { NULL, 0, 0 };
+	struct _path_frontier_s next		= { NULL, 0, 0 };
+	_visited_set_add(reached, start);
+	_visited_set_add(reaches, end);
+	int error		= _path_frontier_push(&forward, start) || _path_frontier_push(&backward, end);
+	int found		= 0;
+	
+	while (!found && !error && forward.used > 0 && backward.used > 0) {
+		next.used	= 0;
+		if (forward.used <= backward.used) {
+			for (uint32_t i = 0; i < forward.used && !found && !error; i++) {
+				for (nodeid_t idx = t->graph[ forward.ids[i] ].out_edge_head; idx != 0; idx = t->edges[idx].next_out) {
+					nodeid_t o	= t->edges[idx].o;
+					if (t->edges[idx].p != pred) {
+						continue;
+					} else if (_visited_set_contains(reaches, o)) {
+						found	= 1;
+						break;
+					} else if (!_visited_set_add(reached, o)) {
+						if ((error = _path_frontier_push(&next, o))) {
+							break;
+						}
+					}
+				}
+			}
+			struct _path_frontier_s tmp	= forward;
+			forward						= next;
+			next						= tmp;
+		} else {
+			for (uint32_t i = 0; i < backward.used && !found && !error; i++) {
+				for (nodeid_t idx = t->graph[ backward.ids[i] ].in_edge_head; idx != 0; idx = t->edges[idx].next_in) {
+					nodeid_t s	= t->edges[idx].s;
+					if (t->edges[idx].p != pred) {
+						continue;
+					} else if (_visited_set_contains(reached, s)) {
+						found	= 1;
+						break;
+					} else if (!_visited_set_add(reaches, s)) {
+						if ((error = _path_frontier_push(&next, s))) {
+							break;
+						}
+					}
+				}
+			}
+			struct _path_frontier_s tmp	= backward;
+			backward					= next;
+			next						= tmp;
+		}
+	}
+	
+	free(forward.ids);
+	free(backward.ids);
+	free(next.ids);
+	return found;
+}
+
+static int _triplestore_path_eval(triplestore_t* t, path_t* path, nodeid_t x, int inverse, int(^block)(nodeid_t reached));
+
+// Evaluates PATH_PLUS, PATH_STAR and PATH_ZERO_OR_ONE from x. Each reached node is produced once, with x itself
+// produced first for the zero-length cases. Repetitions of a single predicate are handled by _triplestore_path_step,
+// and anything else by a breadth-first search that evaluates the operand path from each node of the frontier.
+static int _triplestore_path_repeat(triplestore_t* t, path_t* path, nodeid_t x, int inverse, int(^block)(nodeid_t reached)) {
+	int zero_length	= (path->type != PATH_PLUS);
+	if (_triplestore_path_is_predicate_closure(path)) {
+		if (zero_length && block(x)) {
+			return 1;
+		}
+		return _triplestore_path_step(t, path, x, inverse, ^(nodeid_t reached) {
+			return (zero_length && reached == x) ? 0 : block(reached);
+		});
+	}
+	
+	visited_set_t* visited	= &path->forward;
+	if (_visited_set_reset(visited, 1+t->nodes_used)) {
+		return 1;
+	}
+	if (zero_length) {
+		_visited_set_add(visited, x);
+		if (block(x)) {
+			return 1;
+		}
+	}
+	
+	int repeat							= (path->type != PATH_ZERO_OR_ONE);
+	struct _path_frontier_s frontier	= { NULL, 0, 0 };
+	struct _path_frontier_s next		= { NULL, 0, 0 };
+	struct _path_frontier_s* nextp		= &next;
+	int r								= _path_frontier_push(&frontier, x);
+	while (!r && frontier.used > 0) {
+		next.used	= 0;
+		for (uint32_t i = 0; i < frontier.used && !r; i++) {
+			r	= _triplestore_path_eval(t, path->left, frontier.ids[i], inverse, ^(nodeid_t reached) {
+				if (_visited_set_add(visited, reached)) {
+					return 0;
+				}
+				if (repeat && _path_frontier_push(nextp, reached)) {
+					return 1;
+				}
+				return block(reached);
+			});
+		}
+		struct _path_frontier_s tmp	= frontier;
+		frontier					= next;
+		next						= tmp;
+		if (!repeat) {
+			break;
+		}
+	}
+	free(frontier.ids);
+	free(next.ids);
+	return r;
+}
+
+static int _triplestore_path_negated_contains(path_t* path, nodeid_t pred) {
+	for (uint32_t i = 0; i < path->preds_count; i++) {
+		if (path->preds[i] == pred) {
+			return 1;
+		}
+	}
 	return 0;
 }
 
-static int _triplestore_project(query_t* query, project_t* project, binding_t* current_match, int(^block)(binding_t* final_match)) {
-	int vars	= triplestore_query_get_max_variables(query);
-	int psize	= project->size;
-// 	fprintf(stderr, "%d %d\n", vars, psize);
-	for (int i = 1; i <= vars; i++) {
-// 		const char* var	= query->variable_names[i];
-		if (i <= vars && i <= psize && project->keep[i] != 0) {
-// 			fprintf(stderr, "Keep %d ?%s\n", i, var);
-		} else {
-// 			fprintf(stderr, "Drop %d ?%s\n", i, var);
-			current_match[i]	= 0;
+// Calls block with every node y such that (x, y) is connected by path (or, if inverse is true, every y such that
+// (y, x) is). Sequences and alternatives produce a node once for each way of reaching it; the repetition operators
+// produce each node once.
+static int _triplestore_path_eval(triplestore_t* t, path_t* path, nodeid_t x, int inverse, int(^block)(nodeid_t reached)) {
+	switch (path->type) {
+		case PATH_PREDICATE:
+		case PATH_NEGATED:
+			if (x > t->nodes_used) {
+				return 0;
+			}
+			for (nodeid_t idx = inverse ? t->graph[x].in_edge_head : t->graph[x].out_edge_head; idx != 0; idx = inverse ? t->edges[idx].next_in : t->edges[idx].next_out) {
+				nodeid_t p	= t->edges[idx].p;
+				int match	= (path->type == PATH_PREDICATE) ? (p == path->pred) : !_triplestore_path_negated_contains(path, p);
+				if (match && block(inverse ? t->edges[idx].s : t->edges[idx].o)) {
+					return 1;
+				}
+			}
+			return 0;
+		case PATH_INVERSE:
+			return _triplestore_path_eval(t, path->left, x, !inverse, block);
+		case PATH_SEQUENCE: {
+			// the inverse of p/q is ^q/^p
+			path_t* first	= inverse ? path->right : path->left;
+			path_t* second	= inverse ? path->left : path->right;
+			return _triplestore_path_eval(t, first, x, inverse, ^(nodeid_t middle) {
+				return _triplestore_path_eval(t, second, middle, inverse, block);
+			});
 		}
+		case PATH_ALTERNATIVE:
+			return _triplestore_path_eval(t, path->left, x, inverse, block) || _triplestore_path_eval(t, path->right, x, inverse, block);
+		case PATH_PLUS:
+		case PATH_STAR:
+		case PATH_ZERO_OR_ONE:
+			return _triplestore_path_repeat(t, path, x, inverse, block);
 	}
-	return block(current_match);
+	fprintf(stderr, "*** Unrecognized path type %d\n", path->type);
+	return 1;
 }
 
-
-#pragma mark -
-#pragma mark Sorting
-
+// Calls block with every node that might start a match of path when neither endpoint is bound: the subjects of pred
+// for pred and pred+, and otherwise every node used as a subject or object (which is what zero-length paths match).
+static int _triplestore_path_candidates(triplestore_t* t, path_t* path, int(^block)(nodeid_t candidate)) {
+	path_t* link	= NULL;
+	if (path->type == PATH_PREDICATE) {
+		link	= path;
+	} else if (path->type == PATH_PLUS && path->left->type == PATH_PREDICATE) {
+		link	= path->left;
+	}
+	
+	if (link) {
+		if (_visited_set_reset(&path->starts, 1+t->nodes_used)) {
+			return 1;
+		}
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunused-parameter"
-sort_t* triplestore_new_sort(triplestore_t* t, int result_width, int variables, int unique) {
-	sort_t* sort	= my_calloc(sizeof(sort_t), 1);
-	sort->size		= variables;
-	sort->unique	= unique;
-	sort->vars		= my_calloc(sizeof(int64_t), variables);
-	sort->table		= triplestore_new_table(result_width);
-	return sort;
-}
+		return triplestore_match_triple(t, 0, link->pred, 0, ^(triplestore_t* t, nodeid_t _s, nodeid_t _p, nodeid_t _o) {
+			return _visited_set_add(&path->starts, _s) ? 0 : block(_s);
+		});
 #pragma clang diagnostic pop
-
-int triplestore_free_sort(sort_t* sort) {
-	triplestore_free_table(sort->table);
-	my_free(sort->vars);
-	my_free(sort);
-	return 0;
-}
-
-int triplestore_set_sort(sort_t* sort, int rank, int64_t var) {
-	sort->vars[rank]	= var;
+	}
+	
+	for (nodeid_t id = 1; id <= t->nodes_used; id++) {
+		if ((t->graph[id].out_degree > 0 || t->graph[id].in_degree > 0) && block(id)) {
+			return 1;
+		}
+	}
 	return 0;
 }
 
-static int _triplestore_sort_fill(sort_t* sort, binding_t* current_match) {
-	return triplestore_table_add_row(sort->table, current_match);
+static int _triplestore_path_bind(binding_t* current_match, int64_t var, nodeid_t value, int(^block)(binding_t* final_match)) {
+	if (var >= 0) {
+		return block(current_match);
+	}
+	current_match[-var]	= value;
+	int rc				= block(current_match);
+	current_match[-var]	= 0;
+	return rc;
 }
 
-
-#pragma mark -
-#pragma mark Paths
-
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wunused-parameter"
-path_t* triplestore_new_path(triplestore_t* t, path_type_t type, int64_t start, nodeid_t pred, int64_t end) {
-	path_t* path	= my_calloc(sizeof(path_t), 1);
-	path->type	= type;
-	path->start = start;
-	path->end	= end;
-	path->pred	= pred;
-	return path;
+// Returns a copy of path with its own (empty) visited sets, so that another thread can evaluate it independently.
+static path_t* _triplestore_copy_path(path_t* path) {
+	path_t* copy	= my_calloc(sizeof(path_t), 1);
+	if (!copy) {
+		fprintf(stderr, "*** Failed to allocate memory for path copy\n");
+		return NULL;
+	}
+	copy->type	= path->type;
+	copy->start	= path->start;
+	copy->end	= path->end;
+	copy->pred	= path->pred;
+	if (path->preds_count > 0) {
+		if (!(copy->preds = my_calloc(sizeof(nodeid_t), path->preds_count))) {
+			fprintf(stderr, "*** Failed to allocate memory for path copy\n");
+			triplestore_free_path(copy);
+			return NULL;
+		}
+		memcpy(copy->preds, path->preds, path->preds_count * sizeof(nodeid_t));
+		copy->preds_count	= path->preds_count;
+	}
+	if ((path->left && !(copy->left = _triplestore_copy_path(path->left))) || (path->right && !(copy->right = _triplestore_copy_path(path->right)))) {
+		triplestore_free_path(copy);
+		return NULL;
+	}
+	return copy;
 }
-#pragma clang diagnostic pop
 
-int triplestore_free_path(path_t* path) {
-	my_free(path);
-	return 0;
+// Binds the endpoint variables of path to (s, o) and calls block.
+static int _triplestore_path_emit(path_t* path, binding_t* current_match, nodeid_t s, nodeid_t o, int(^block)(binding_t* final_match)) {
+	return _triplestore_path_bind(current_match, path->start, s, ^(binding_t* match) {
+		return (path->start == path->end) ? block(match) : _triplestore_path_bind(match, path->end, o, block);
+	});
 }
 
-int _triplestore_path_step(triplestore_t* t, nodeid_t s, nodeid_t pred, char* seen, int depth, int(^block)(nodeid_t reached)) {
-//	__indent(stderr, depth);
-//	fprintf(stderr, "matching path %"PRId64" (%"PRIu32") %"PRId64"\n", s, path->pred, path->end);
-	assert(s > 0);
-	
-	
+// Evaluates a path whose endpoints are both unbound by spreading its start nodes across the threads of the query's
+// pool. Each thread evaluates its own copy of the path (so visited sets are thread-local).
+static int _triplestore_path_match_parallel(triplestore_t* t, query_t* query, path_t* path, binding_t* current_match, int(^block)(binding_t* final_match)) {
+	struct _path_frontier_s candidates	= { NULL, 0, 0 };
+	struct _path_frontier_s* cp			= &candidates;
+	if (_triplestore_path_candidates(t, path, ^(nodeid_t candidate) {
+		return _path_frontier_push(cp, candidate);
+	})) {
+		free(candidates.ids);
+		return 1;
+	}
 	
-//	__indent(stderr, depth);
-//	fprintf(stderr, "matching triple %"PRId64" %"PRIu32" 0\n", s, path->pred);
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wunused-parameter"
-	int r	= triplestore_match_triple(t, s, pred, 0, ^(triplestore_t* t, nodeid_t _s, nodeid_t _p, nodeid_t _o) {
-		if (seen[_o]) {
-			return 0;
-		} else {
-			seen[_o]	= 1;
-	//		__indent(stderr, depth);
-	//		fprintf(stderr, "got triple --> %"PRIu32" %"PRIu32" %"PRIu32"\n", _s, _p, _o);
-
-			if (block(_o)) {
-				return 1;
-			}
-			
-			int r	= _triplestore_path_step(t, _o, pred, seen, 1+depth, block);
-			return r;
+	nodeid_t* ids	= candidates.ids;
+	int same		= (path->start == path->end);	// only (x, x) pairs match
+	int r			= _triplestore_parallel_match(query->pool, candidates.used, 2, query->ordered, ^void*(int caller) {
+		return caller ? path : _triplestore_copy_path(path);
+	}, ^(void* local, int caller) {
+		if (!caller) {
+			triplestore_free_path(local);
 		}
+	}, ^(void* local, uint32_t item, int(^emit)(binding_t* row)) {
+		nodeid_t candidate	= ids[item-1];
+		return _triplestore_path_eval(t, local, candidate, 0, ^(nodeid_t reached) {
+			if (same && reached != candidate) {
+				return 0;
+			}
+			binding_t row[2]	= { candidate, reached };
+			return emit(row);
+		});
+	}, ^(binding_t* row) {
+		return _triplestore_path_emit(path, current_match, (nodeid_t) row[0], (nodeid_t) row[1], block);
 	});
-#pragma clang diagnostic pop
+	free(candidates.ids);
 	return r;
 }
 
-int _triplestore_path_match(triplestore_t* t, path_t* path, binding_t* current_match, int(^block)(binding_t* final_match)) {
-	if (path->type == PATH_STAR) {
-		fprintf(stderr, "*** should emit graph terms for * path\n");
+int _triplestore_path_match(triplestore_t* t, query_t* query, path_t* path, binding_t* current_match, int(^block)(binding_t* final_match)) {
+	int64_t start	= path->start;
+	int64_t end		= path->end;
+	if (start < 0 && current_match[-start] > 0) {
+		start	= current_match[-start];
+	}
+	if (end < 0 && current_match[-end] > 0) {
+		end	= current_match[-end];
 	}
 	
-	int r	= 0;
-	if (path->type == PATH_STAR || path->type == PATH_PLUS) {
-		char* seen	= my_calloc(1, t->nodes_used);
-		
-		int64_t start	= path->start;
-		int64_t end		= path->end;
-		
-		int orig_end	= end;
-		if (end < 0) {
-			int64_t e	= current_match[-end];
-			if (e > 0) {
-				end	= e;
-			}
-		}
-		
-//		fprintf(stderr, "matching path with start %"PRId64"\n", start);
-		if (start < 0) {
-			int64_t s	= current_match[-start];
-			if (s > 0) {
-				start	= s;
-// 				fprintf(stderr, "replacing path start with bound term %"PRId64"\n", start);
-			}
+	if (start > 0 && end > 0) {
+		if (_triplestore_path_is_predicate_closure(path)) {
+			// only reachability needs to be checked
+			return _triplestore_path_reachable(t, path, (nodeid_t) start, (nodeid_t) end) ? block(current_match) : 0;
 		}
-		
-		if (start <= 0) {
-// 			fprintf(stderr, "pre-binding path starting nodes (%"PRId64")...\n", start);
-			char* starts	= my_calloc(1, t->nodes_used);
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wunused-parameter"
-			r	= triplestore_match_triple(t, start, path->pred, 0, ^(triplestore_t* t, nodeid_t _s, nodeid_t _p, nodeid_t _o) {
-				if (starts[_s]++) {
-					return 0;
-				}
-				memset(seen, 0, t->nodes_used);
-//				fprintf(stderr, "path match setting match[%"PRId64"]\n", -start);
-				current_match[-start]	= _s;
-				int rc	= _triplestore_path_step(t, _s, path->pred, seen, 0, ^(nodeid_t reached) {
-// 					fprintf(stderr, "Path end: %"PRId64": %"PRIu32"\n", end, reached);
-					if (end < 0) {
-						current_match[-end] = reached;
-					} else if (end > 0) {
-						if (reached != end) {
-// 							fprintf(stderr, "- reached node does not match the path end\n");
-							return 0;
-						}
-					}
-					int rc	= block(current_match);
-					if (orig_end < 0) {
-						current_match[-orig_end] = 0;
-					}
-					return rc;
-				});
-				current_match[-start]	= 0;
-				return rc;
+		return _triplestore_path_eval(t, path, (nodeid_t) start, 0, ^(nodeid_t reached) {
+			return (reached == end) ? block(current_match) : 0;
+		});
+	} else if (start > 0) {
+		return _triplestore_path_eval(t, path, (nodeid_t) start, 0, ^(nodeid_t reached) {
+			return _triplestore_path_bind(current_match, end, reached, block);
+		});
+	} else if (end > 0) {
+		// walk the path backwards from the bound end
+		return _triplestore_path_eval(t, path, (nodeid_t) end, 1, ^(nodeid_t reached) {
+			return _triplestore_path_bind(current_match, start, reached, block);
+		});
+	} else if (query && query->pool) {
+		return _triplestore_path_match_parallel(t, query, path, current_match, block);
+	} else if (start < 0 && start == end) {
+		return _triplestore_path_candidates(t, path, ^(nodeid_t candidate) {
+			return _triplestore_path_eval(t, path, candidate, 0, ^(nodeid_t reached) {
+				return (reached == candidate) ? _triplestore_path_bind(current_match, start, reached, block) : 0;
 			});
-#pragma clang diagnostic pop
-			my_free(starts);
-		} else {
-// 			fprintf(stderr, "path starting node is bound\n");
-			r	= _triplestore_path_step(t, (nodeid_t)start, path->pred, seen, 0, ^(nodeid_t reached) {
-				if (path->end < 0) {
-					current_match[-(path->end)] = reached;
-				}
-				return block(current_match);
+		});
+	} else {
+		return _triplestore_path_candidates(t, path, ^(nodeid_t candidate) {
+			return _triplestore_path_bind(current_match, start, candidate, ^(binding_t* match) {
+				return _triplestore_path_eval(t, path, candidate, 0, ^(nodeid_t reached) {
+					return _triplestore_path_bind(match, end, reached, block);
+				});
 			});
-		}
-		my_free(seen);
+		});
 	}
-	return r;
 }
 
 int triplestore_path_match(triplestore_t* t, path_t* path, int variables, int(^block)(binding_t* final_match)) {
 	binding_t* current_match = my_calloc(sizeof(binding_t), 1+variables);
 	current_match[0]	= variables;
-	int r				= _triplestore_path_match(t, path, current_match, block);
+	int r				= _triplestore_path_match(t, NULL, path, current_match, block);
 	my_free(current_match);
 	return r;
 }
@@ -1457,6 +3700,20 @@ int triplestore_query_set_max_variables(query_t* query, int max) {
 	return 0;
 }
 
+// Evaluates BGPs and paths whose endpoints are both unbound using the threads of pool (or serially if pool is NULL).
+// The pool is not owned by the query.
+int triplestore_query_set_pool(query_t* query, triplestore_pool_t* pool) {
+	query->pool	= pool;
+	return 0;
+}
+
+// If ordered is true, results of parallel evaluation are produced in the same order as serial evaluation would
+// produce them (at the cost of buffering); otherwise they are produced as soon as they are available.
+int triplestore_query_set_ordered(query_t* query, int ordered) {
+	query->ordered	= ordered;
+	return 0;
+}
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunused-parameter"
 query_t* triplestore_new_query(triplestore_t* t, int variables) {
@@ -1585,13 +3842,156 @@ int triplestore_query_add_op(query_t* query, query_type_t type, void* ptr) {
 	return 0;
 }
 
+// Estimate the number of edges that have to be visited to match the first triple of the BGP.
+static int64_t _triplestore_bgp_estimate(triplestore_t* t, bgp_t* bgp, binding_t* current_match) {
+	if (bgp->triples == 0) {
+		return 0;
+	}
+	int64_t s	= bgp->nodes[0];
+	int64_t o	= bgp->nodes[2];
+	if (s < 0) {
+		s	= current_match[-s];
+	}
+	if (o < 0) {
+		o	= current_match[-o];
+	}
+	if (s > 0 && s <= t->nodes_used) {
+		return t->graph[s].out_degree;
+	} else if (o > 0 && o <= t->nodes_used) {
+		return t->graph[o].in_degree;
+	}
+	return t->edges_used;
+}
+
+// Find a filter immediately following the BGP whose candidate node set is small enough that it is cheaper to bind
+// the filter variable to each candidate before matching the BGP than to filter the BGP results afterwards.
+static query_filter_t* _triplestore_bgp_seeding_filter(triplestore_t* t, bgp_t* bgp, query_op_t* op, binding_t* current_match) {
+	query_filter_t* best	= NULL;
+	int64_t best_count		= _triplestore_bgp_estimate(t, bgp, current_match);
+	for (; op && op->type == QUERY_FILTER; op = op->next) {
+		query_filter_t* filter	= (query_filter_t*) op->ptr;
+		int64_t var				= filter->node1;
+		if (var >= 0 || current_match[-var] != 0) {
+			continue;
+		}
+		
+		// binding a variable only helps if it lets triple matching use the subject or object edge lists
+		int used	= 0;
+		for (int i = 0; i < bgp->triples; i++) {
+			if (bgp->nodes[3*i] == var || bgp->nodes[3*i+2] == var) {
+				used	= 1;
+				break;
+			}
+		}
+		if (!used) {
+			continue;
+		}
+		
+		int64_t count	= _triplestore_filter_candidate_count(t, filter);
+		if (count >= 0 && count < best_count) {
+			best		= filter;
+			best_count	= count;
+		}
+	}
+	return best;
+}
+
+// Matches bgp across the threads of the query's pool by partitioning the matches of its first triple pattern or,
+// when neither the subject nor the object of that pattern is bound (a full scan), the range of subject node IDs.
+// Each thread matches the remaining patterns with its own copy of current_match.
+static int _triplestore_bgp_match_parallel(triplestore_t* t, query_t* query, bgp_t* bgp, binding_t* current_match, int(^block)(binding_t* final_match)) {
+	int64_t s		= bgp->nodes[0];
+	int64_t p		= bgp->nodes[1];
+	int64_t o		= bgp->nodes[2];
+	int64_t _s		= (s < 0 && current_match[-s] > 0) ? (int64_t) current_match[-s] : s;
+	int64_t _p		= (p < 0 && current_match[-p] > 0) ? (int64_t) current_match[-p] : p;
+	int64_t _o		= (o < 0 && current_match[-o] > 0) ? (int64_t) current_match[-o] : o;
+	uint32_t width	= (uint32_t) (1 + current_match[0]);
+	int scan		= (_s < 0 && _o < 0);
+	
+	struct _path_frontier_s matches	= { NULL, 0, 0 };
+	struct _path_frontier_s* mp		= &matches;
+	if (!scan) {
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter"
+		int r	= triplestore_match_triple(t, _s, _p, _o, ^(triplestore_t* t, nodeid_t s, nodeid_t p, nodeid_t o) {
+			return _path_frontier_push(mp, s) || _path_frontier_push(mp, p) || _path_frontier_push(mp, o);
+		});
+#pragma clang diagnostic pop
+		if (r) {
+			free(matches.ids);
+			return r;
+		}
+	}
+	
+	nodeid_t* triples	= matches.ids;
+	uint32_t count		= scan ? t->nodes_used : matches.used / 3;
+	int r				= _triplestore_parallel_match(query->pool, count, width, query->ordered, ^void*(int caller) {
+		if (caller) {
+			return current_match;
+		}
+		binding_t* local	= calloc(width, sizeof(binding_t));
+		if (local) {
+			memcpy(local, current_match, width * sizeof(binding_t));
+		}
+		return local;
+	}, ^(void* local, int caller) {
+		if (!caller) {
+			free(local);
+		}
+	}, ^(void* local, uint32_t item, int(^emit)(binding_t* row)) {
+		binding_t* match	= local;
+		int rc;
+		if (scan) {
+			// item is a subject node ID
+			if (t->graph[item].out_degree == 0) {
+				return 0;
+			}
+			match[-s]	= item;
+			rc			= _triplestore_bgp_match(t, bgp, 0, match, emit);
+			match[-s]	= 0;
+		} else {
+			// item is a match of the first triple pattern
+			nodeid_t* triple	= &(triples[3*(item-1)]);
+			if (_s < 0) match[-_s]	= triple[0];
+			if (_p < 0) match[-_p]	= triple[1];
+			if (_o < 0) match[-_o]	= triple[2];
+			rc	= _triplestore_bgp_match(t, bgp, 1, match, emit);
+			if (_s < 0) match[-_s]	= 0;
+			if (_p < 0) match[-_p]	= 0;
+			if (_o < 0) match[-_o]	= 0;
+		}
+		return rc;
+	}, block);
+	free(triples);
+	return r;
+}
+
 static int _triplestore_query_op_match(triplestore_t* t, query_t* query, query_op_t* op, binding_t* current_match, int(^block)(binding_t* final_match)) {
 	if (op) {
 		switch (op->type) {
-			case QUERY_BGP:
+			case QUERY_BGP: {
+				query_filter_t* seed	= _triplestore_bgp_seeding_filter(t, op->ptr, op->next, current_match);
+				if (seed) {
+					int64_t var	= seed->node1;
+					int r		= _triplestore_filter_candidates(t, seed, ^(nodeid_t id){
+						current_match[-var]	= id;
+						return _triplestore_bgp_match(t, op->ptr, 0, current_match, ^(binding_t* final_match){
+							return _triplestore_query_op_match(t, query, op->next, final_match, block);
+						});
+					});
+					current_match[-var]	= 0;
+					return r;
+				}
+				if (query->pool && _triplestore_bgp_estimate(t, op->ptr, current_match) >= PARALLEL_MIN_ITEMS) {
+					return _triplestore_bgp_match_parallel(t, query, op->ptr, current_match, ^(binding_t* final_match){
+						return _triplestore_query_op_match(t, query, op->next, final_match, block);
+					});
+				}
 				return _triplestore_bgp_match(t, op->ptr, 0, current_match, ^(binding_t* final_match){
 					return _triplestore_query_op_match(t, query, op->next, final_match, block);
 				});
+			}
 			case QUERY_FILTER:
 				return _triplestore_filter_match(t, op->ptr, current_match, ^(binding_t* final_match){
 					return _triplestore_query_op_match(t, query, op->next, final_match, block);
@@ -1601,7 +4001,7 @@ static int _triplestore_query_op_match(triplestore_t* t, query_t* query, query_o
 					return _triplestore_query_op_match(t, query, op->next, final_match, block);
 				});
 			case QUERY_PATH:
-				return _triplestore_path_match(t, op->ptr, current_match, ^(binding_t* final_match){
+				return _triplestore_path_match(t, query, op->ptr, current_match, ^(binding_t* final_match){
 					return _triplestore_query_op_match(t, query, op->next, final_match, block);
 				});
 			case QUERY_SORT:
@@ -1618,8 +4018,25 @@ static int _triplestore_query_op_match(triplestore_t* t, query_t* query, query_o
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunused-parameter"
 int triplestore_query_match(triplestore_t* t, query_t* query, int64_t limit, int(^block)(binding_t* final_match)) {
+	return triplestore_query_match_bound(t, query, NULL, limit, block);
+}
+
+// Matches query with the variables that are non-zero in bindings (which has an entry for each of the query's
+// variables, after an unused first entry) already bound to those node IDs. A query can be matched any number of times
+// (though only one match can be running at a time).
+int triplestore_query_match_bound(triplestore_t* t, query_t* query, const binding_t* bindings, int64_t limit, int(^block)(binding_t* final_match)) {
 // 	triplestore_print_query(t, query, stderr);
+	for (query_op_t* op = query->head; op; op = op->next) {
+		if (op->type == QUERY_SORT) {
+			// drop the rows of an earlier match
+			((sort_t*) op->ptr)->table->used	= 0;
+		}
+	}
+	
 	binding_t* current_match = my_calloc(sizeof(binding_t), 1+triplestore_query_get_max_variables(query));
+	if (bindings) {
+		memcpy(current_match, bindings, sizeof(binding_t) * (1+triplestore_query_get_max_variables(query)));
+	}
 	current_match[0]	= triplestore_query_get_max_variables(query);
 	query_op_t* op		= query->head;
 	int r				= _triplestore_query_op_match(t, query, op, current_match, block);
@@ -1760,7 +4177,8 @@ nodeid_t triplestore_add_term(triplestore_t* t, rdf_term_t* myterm) {
 		avl_insert( t->dictionary, item );
 		
 		graph_node_t node	= { ._term = item->_term, .mtime = 0, .out_edge_head = 0, .in_edge_head = 0 };
-		t->graph[item->id]	= node;
+		t->graph[item->id]		= node;
+		t->node_flags[item->id]	= _triplestore_term_flags(item->_term);
 //		fprintf(stdout, "+ %6"PRIu32" %s\n", item->id, triplestore_term_to_string(t, term));
 	} else {
 		free_rdf_term(myterm);
@@ -2019,13 +4437,98 @@ int triplestore_print_term(triplestore_t* t, nodeid_t s, FILE* f, int newline) {
 		}
 		return 1;
 	}
-	rdf_term_t* subject		= t->graph[s]._term;
-	if (subject == NULL) assert(0);
-	char* ss		= triplestore_term_to_string(t, subject);
-	fprintf(f, "%s", ss);
+	triplestore_write_term(t, s, f);
 	if (newline) {
 		fprintf(f, "\n");
 	}
+	return 0;
+}
+
+static void _triplestore_free_term_strings(triplestore_t* t) {
+	if (t->term_strings) {
+		for (uint32_t i = 0; i < t->term_strings_alloc; i++) {
+			my_free(t->term_strings[i]);
+		}
+	}
+	my_free(t->term_strings);
+	t->term_strings			= NULL;
+	t->term_strings_alloc	= 0;
+}
+
+static int _triplestore_resize_term_strings(triplestore_t* t, uint32_t alloc) {
+	if (!t->term_strings || alloc < t->term_strings_alloc) {
+		return 0;
+	}
+	term_string_t** strings	= realloc(t->term_strings, (1+alloc) * sizeof(term_string_t*));
+	if (!strings) {
+		fprintf(stderr, "*** Failed to allocate memory for term cache\n");
+		return 1;
+	}
+	memset(&(strings[t->term_strings_alloc]), 0, (1 + alloc - t->term_strings_alloc) * sizeof(term_string_t*));
+	t->term_strings			= strings;
+	t->term_strings_alloc	= 1+alloc;
+	return 0;
+}
+
+// Keeps the serialized form of each node the first time it is written, so that writing it again is a single copy.
+int triplestore_cache_terms(triplestore_t* t) {
+	if (t->term_strings) {
+		return 0;
+	}
+	t->term_strings	= my_calloc(1+t->nodes_alloc, sizeof(term_string_t*));
+	if (!t->term_strings) {
+		fprintf(stderr, "*** Failed to allocate memory for term cache\n");
+		return 1;
+	}
+	t->term_strings_alloc	= 1+t->nodes_alloc;
+	return 0;
+}
+
+// Returns the cached serialized form of node id, building it if this is the first time it has been asked for, or
+// NULL if terms are not being cached. Strings are published with a compare-and-swap so that concurrent queries
+// against a read-only store may race to build the same one.
+static term_string_t* _triplestore_term_string(triplestore_t* t, nodeid_t id) {
+	if (id >= t->term_strings_alloc) {
+		return NULL;
+	}
+	term_string_t* string	= __atomic_load_n(&(t->term_strings[id]), __ATOMIC_ACQUIRE);
+	if (string) {
+		return string;
+	}
+	
+	rdf_term_t* term	= t->graph[id]._term;
+	size_t length		= _triplestore_serialize_term(t, term, NULL);
+	string				= my_calloc(1, sizeof(term_string_t) + length + 1);
+	if (!string) {
+		return NULL;
+	}
+	string->length		= (uint32_t) length;
+	_triplestore_serialize_term(t, term, string->value);
+	
+	term_string_t* expected	= NULL;
+	if (!__atomic_compare_exchange_n(&(t->term_strings[id]), &expected, string, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+		// another thread published the same string first
+		my_free(string);
+		string	= expected;
+	}
+	return string;
+}
+
+// Writes the serialized form of node s to f (see triplestore_term_to_string).
+int triplestore_write_term(triplestore_t* t, nodeid_t s, FILE* f) {
+	term_string_t* string	= _triplestore_term_string(t, s);
+	if (string) {
+		fwrite(string->value, 1, string->length, f);
+		return 0;
+	}
+	
+	rdf_term_t* term	= t->graph[s]._term;
+	if (term == NULL) assert(0);
+	char* ss		= triplestore_term_to_string(t, term);
+	if (!ss) {
+		return 1;
+	}
+	fwrite(ss, 1, strlen(ss), f);
 	free(ss);
 	return 0;
 }
@@ -2052,11 +4555,47 @@ static void _print_term_or_variable(triplestore_t* t, int variables, char** vari
 	}
 }
 
+static void _triplestore_print_path_expression(triplestore_t* t, path_t* path, FILE* f) {
+	switch (path->type) {
+		case PATH_PREDICATE:
+			_print_term_or_variable(t, 0, NULL, path->pred, f);
+			break;
+		case PATH_NEGATED:
+			fprintf(f, "!(");
+			for (uint32_t i = 0; i < path->preds_count; i++) {
+				if (i > 0) {
+					fprintf(f, "|");
+				}
+				_print_term_or_variable(t, 0, NULL, path->preds[i], f);
+			}
+			fprintf(f, ")");
+			break;
+		case PATH_INVERSE:
+			fprintf(f, "^");
+			_triplestore_print_path_expression(t, path->left, f);
+			break;
+		case PATH_SEQUENCE:
+		case PATH_ALTERNATIVE:
+			fprintf(f, "(");
+			_triplestore_print_path_expression(t, path->left, f);
+			fprintf(f, (path->type == PATH_SEQUENCE) ? "/" : "|");
+			_triplestore_print_path_expression(t, path->right, f);
+			fprintf(f, ")");
+			break;
+		case PATH_PLUS:
+		case PATH_STAR:
+		case PATH_ZERO_OR_ONE:
+			_triplestore_print_path_expression(t, path->left, f);
+			fprintf(f, (path->type == PATH_PLUS) ? "+" : (path->type == PATH_STAR) ? "*" : "?");
+			break;
+	}
+}
+
 void triplestore_print_path(triplestore_t* t, query_t* query, path_t* path, FILE* f) {
 	fprintf(f, "Path: ");
 	_print_term_or_variable(t, triplestore_query_get_max_variables(query), query->variable_names, path->start, f);
 	fprintf(f, " ");
-	_print_term_or_variable(t, triplestore_query_get_max_variables(query), query->variable_names, path->pred, f);
+	_triplestore_print_path_expression(t, path, f);
 	fprintf(f, " ");
 	_print_term_or_variable(t, triplestore_query_get_max_variables(query), query->variable_names, path->end, f);
 	fprintf(f, "\n");
@@ -2125,6 +4664,16 @@ void triplestore_print_filter(triplestore_t* t, query_t* query, query_filter_t*
 			}
 			fprintf(f, ")\n");
 			break;
+		case FILTER_LANGMATCHES:
+			fprintf(f, "LANGMATCHES(LANG(");
+			_print_term_or_variable(t, triplestore_query_get_max_variables(query), query->variable_names, filter->node1, f);
+			fprintf(f, "), \"%s\")\n", filter->string2);
+			break;
+		case FILTER_IRIPREFIX:
+			fprintf(f, "IRIPREFIX(");
+			_print_term_or_variable(t, triplestore_query_get_max_variables(query), query->variable_names, filter->node1, f);
+			fprintf(f, ", <%s>)\n", filter->string2);
+			break;
 		case FILTER_STRENDS:
 			fprintf(f, "STRENDS(");
 			_print_term_or_variable(t, triplestore_query_get_max_variables(query), query->variable_names, filter->node1, f);
@@ -2134,6 +4683,28 @@ void triplestore_print_filter(triplestore_t* t, query_t* query, query_filter_t*
 			}
 			fprintf(f, ")\n");
 			break;
+		case FILTER_LT:
+		case FILTER_LE:
+		case FILTER_GT:
+		case FILTER_GE:
+		case FILTER_EQ: {
+			const char* ops[]	= { "<", "<=", ">", ">=", "=" };
+			fprintf(f, "(");
+			_print_term_or_variable(t, triplestore_query_get_max_variables(query), query->variable_names, filter->node1, f);
+			fprintf(f, " %s %.17g)\n", ops[filter->type - FILTER_LT], filter->number2);
+			break;
+		}
+		case FILTER_DATE_LT:
+		case FILTER_DATE_LE:
+		case FILTER_DATE_GT:
+		case FILTER_DATE_GE:
+		case FILTER_DATE_EQ: {
+			const char* ops[]	= { "<", "<=", ">", ">=", "=" };
+			fprintf(f, "(");
+			_print_term_or_variable(t, triplestore_query_get_max_variables(query), query->variable_names, filter->node1, f);
+			fprintf(f, " %s DATE(%"PRId64"us))\n", ops[filter->type - FILTER_DATE_LT], filter->date2);
+			break;
+		}
 		case FILTER_REGEX:
 			fprintf(f, "REGEX(");
 			_print_term_or_variable(t, triplestore_query_get_max_variables(query), query->variable_names, filter->node1, f);
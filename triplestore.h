@@ -7,6 +7,7 @@
 #include <inttypes.h>
 #include <stdarg.h>
 #include "avl.h"
+#include "triplestore-pool.h"
 
 typedef uint32_t nodeid_t;
 typedef uint64_t binding_t;
@@ -20,6 +21,14 @@ typedef enum {
 	TERM_VARIABLE				= 99,
 } rdf_term_type_t;
 
+#define TRIPLESTORE_TERM_TYPES	(TERM_TYPED_LITERAL+1)
+
+// Bits of the per-node flags byte (triplestore_t.node_flags)
+#define TRIPLESTORE_NODE_TYPE_MASK	0x07	// the node's rdf_term_type_t
+#define TRIPLESTORE_NODE_LITERAL	0x08	// TERM_XSDSTRING_LITERAL, TERM_LANG_LITERAL or TERM_TYPED_LITERAL
+#define TRIPLESTORE_NODE_NUMERIC	0x10	// a typed literal with a numeric_value
+#define TRIPLESTORE_NODE_DATE		0x20	// a typed literal with a date_value
+
 typedef enum {
 	QUERY_BGP					= 1,
 	QUERY_FILTER				= 2,
@@ -31,6 +40,12 @@ typedef enum {
 typedef enum {
 	PATH_PLUS,
 	PATH_STAR,
+	PATH_ZERO_OR_ONE,
+	PATH_PREDICATE,
+	PATH_INVERSE,
+	PATH_SEQUENCE,
+	PATH_ALTERNATIVE,
+	PATH_NEGATED,
 } path_type_t;
 
 typedef enum {
@@ -44,8 +59,17 @@ typedef enum {
 	FILTER_CONTAINS,	// CONTAINS(?var, "string")
 	FILTER_STRSTARTS,	// STRSTARTS(?var, "string")
 	FILTER_STRENDS,		// STRENDS(?var, "string")
-    // Numeric logical testing (var, const)
-    // Date logical testing (var, const)
+	FILTER_IRIPREFIX,	// ISIRI(?var) && STRSTARTS(STR(?var), "string")
+	FILTER_LT,			// ?var < numeric
+	FILTER_LE,			// ?var <= numeric
+	FILTER_GT,			// ?var > numeric
+	FILTER_GE,			// ?var >= numeric
+	FILTER_EQ,			// ?var = numeric
+	FILTER_DATE_LT,		// ?var < date
+	FILTER_DATE_LE,		// ?var <= date
+	FILTER_DATE_GT,		// ?var > date
+	FILTER_DATE_GE,		// ?var >= date
+	FILTER_DATE_EQ,		// ?var = date
 } filter_type_t;
 
 typedef struct table_s {
@@ -60,14 +84,22 @@ typedef struct rdf_term_s {
 	union {
 		struct {
 			double numeric_value;
+			int64_t date_value;		// xsd:date and xsd:dateTime values as microseconds since the epoch (UTC)
 			nodeid_t value_id;
 			char is_numeric;
+			char is_date;
 		} value_type;
 		int64_t value_lang;	// depending on the term type, instead of a value_id, we might pack a 1-7 char string plus trailing NULL into the value_lang integer (e.g. the language tag string for TERM_LANG_LITERAL)
 	} vtype;
 	rdf_term_type_t type;
 } rdf_term_t;
 
+// serialized form of a term, as written in N-Triples and SPARQL TSV results
+typedef struct term_string_s {
+	uint32_t length;
+	char value[];			// NULL terminated
+} term_string_t;
+
 typedef struct index_list_element_s {
 	uint32_t s;
 	uint32_t p;
@@ -99,6 +131,8 @@ typedef struct query_s {
 	char** variable_names;
 	query_op_t* head;
 	query_op_t* tail;
+	triplestore_pool_t* pool;	// if set, worker threads used to evaluate BGPs and paths (with both endpoints unbound)
+	int ordered;				// produce parallel results in the same order as serial evaluation
 } query_t;
 
 typedef struct bgp_s {
@@ -106,11 +140,24 @@ typedef struct bgp_s {
 	int64_t* nodes;
 } bgp_t;
 
+typedef struct visited_set_s {
+	uint32_t* stamps;
+	uint32_t size;
+	uint32_t generation;
+} visited_set_t;
+
 typedef struct path_s {
 	path_type_t type;
-	int64_t start;
+	int64_t start;			// endpoints (only used for the outermost path)
 	int64_t end;
-	nodeid_t pred;
+	nodeid_t pred;			// PATH_PREDICATE
+	struct path_s* left;	// the operand of a unary path, or the first operand of PATH_SEQUENCE and PATH_ALTERNATIVE
+	struct path_s* right;
+	nodeid_t* preds;		// PATH_NEGATED: the excluded predicates
+	uint32_t preds_count;
+	visited_set_t starts;
+	visited_set_t forward;
+	visited_set_t backward;
 } path_t;
 
 typedef struct project_s {
@@ -134,8 +181,35 @@ typedef struct query_filter_s {
 	char* string2_lang;				// the language of the string argument (where string2_type == TERM_LANG_LITERAL)
 	char* string3; 	// REGEX flags
 	pcre* re;		// compile pcre object
+	pcre_extra* re_extra;	// study data (including JIT compiled code) for re
+	double number2;			// LT, LE, GT, GE, EQ numeric constant
+	int64_t date2;			// DATE_LT, DATE_LE, DATE_GT, DATE_GE, DATE_EQ constant (microseconds since the epoch)
+	int lang_range_len;		// LANGMATCHES normalized range length (0 for "*", -1 if the range cannot match any stored language tag)
+	int64_t lang_range;		// LANGMATCHES normalized range, packed in the same way as value_lang
+	int64_t lang_mask;		// mask selecting the first lang_range_len bytes of a packed language tag
+	uint32_t index_generation;							// value index generation for which the ranges below were computed (0 if not yet computed)
+	uint32_t prefix_start[TRIPLESTORE_TERM_TYPES];		// STRSTARTS/IRIPREFIX range of matching ranks in the value index, per term type
+	uint32_t prefix_end[TRIPLESTORE_TERM_TYPES];
+	uint32_t range_start;								// LT/LE/GT/GE/EQ (DATE_*) range of matching positions in the numeric (date) index
+	uint32_t range_end;
 } query_filter_t;
 
+// Transitive closure of a single predicate. The strongly connected components of the predicate's subgraph are
+// numbered in reverse topological order, and each component is labelled with the (merged, sorted) intervals of
+// component numbers it can reach, so reachability is a binary search and enumeration walks only the reachable nodes.
+typedef struct closure_s {
+	nodeid_t pred;
+	uint32_t edges;				// edges_used at the time the closure was built
+	uint32_t nodes;				// nodes_used at the time the closure was built
+	uint32_t components;
+	uint32_t* component;		// component number of each node (0 for nodes without any pred edge)
+	uint32_t* member_offset;	// nodes of component c are members[member_offset[c]] .. members[member_offset[c+1]-1]
+	nodeid_t* members;
+	uint32_t* interval_offset;	// intervals of component c are interval pairs interval_offset[c] .. interval_offset[c+1]-1
+	uint32_t* intervals;		// [lo, hi] pairs of reachable component numbers (each component includes itself)
+	uint8_t* cyclic;			// true if the nodes of a component reach themselves
+} closure_t;
+
 typedef struct triplestore_s {
 	int read_only;
 	
@@ -147,19 +221,41 @@ typedef struct triplestore_s {
 	
 	index_list_element_t* edges;
 	graph_node_t* graph;
+	uint8_t* node_flags;	// TRIPLESTORE_NODE_* flags of each node, kept dense so that type tests need not touch the term heap
 	
 	struct avl_table* dictionary;
 	
 	
-	pcre* decimal_re;
-	pcre* integer_re;
-	pcre* float_re;
-	pcre* date_re;
-	pcre* datetime_re;
-	pcre* lang_re;
-	
 	int verify_datatypes;
 	nodeid_t bnode_prefix;
+	
+	// node IDs sorted lexicographically by term value, one array per term type
+	uint32_t value_index_nodes;		// nodes_used at the time the value index was built
+	uint32_t value_index_generation;
+	nodeid_t* value_index[TRIPLESTORE_TERM_TYPES];
+	uint32_t value_index_size[TRIPLESTORE_TERM_TYPES];
+	uint32_t* value_rank;			// position of each node in the value index of its term type
+	
+	// numeric node IDs sorted by numeric_value (built alongside the value index)
+	nodeid_t* numeric_index;
+	uint32_t numeric_index_size;
+	
+	// date and dateTime node IDs sorted by date_value (built alongside the value index)
+	nodeid_t* date_index;
+	uint32_t date_index_size;
+	
+	// per primary language bitmaps of language-tagged literal node IDs (the table is allocated with the value index, and
+	// each bitmap is built the first time a LANGMATCHES filter asks for it)
+	uint64_t** lang_bitmap;
+	uint32_t* lang_bitmap_count;
+	
+	// opt-in transitive closures of individual predicates (see triplestore_build_closure)
+	closure_t* closures;
+	uint32_t closures_count;
+	
+	// opt-in cache of the serialized form of each node, indexed by node ID (see triplestore_cache_terms)
+	term_string_t** term_strings;
+	uint32_t term_strings_alloc;
 } triplestore_t;
 
 double triplestore_current_time ( void );
@@ -172,6 +268,7 @@ void free_rdf_term(rdf_term_t* t);
 int triplestore_size(triplestore_t* t);
 
 int triplestore_term_get_value(rdf_term_t* t, int(^block)(size_t, const char*));
+int triplestore_parse_date(const char* value, int64_t* result);
 char* triplestore_term_to_string(triplestore_t* store, rdf_term_t* t);
 triplestore_t* new_triplestore(int max_nodes, int max_edges);
 int free_triplestore(triplestore_t* t);
@@ -181,17 +278,28 @@ nodeid_t triplestore_get_termid(triplestore_t* t, rdf_term_t* myterm);
 int triplestore_set_read_only(triplestore_t* t);
 int triplestore_read_only(triplestore_t* t);
 
+int triplestore_build_indexes(triplestore_t* t);
+int triplestore_build_closure(triplestore_t* t, nodeid_t pred);
+
 int triplestore_dump(triplestore_t* t, const char* filename);
 int triplestore_load(triplestore_t* t, const char* filename, int verbose);
 
 
 int triplestore__load_file(triplestore_t* t, const char* filename, int verbose);
 
+int triplestore_match_prefix(triplestore_t* t, rdf_term_type_t type, const char* prefix, size_t prefix_len, int(^block)(nodeid_t id));
+int triplestore_match_numeric_range(triplestore_t* t, double min, int min_inclusive, double max, int max_inclusive, int(^block)(nodeid_t id));
+int triplestore_match_date_range(triplestore_t* t, int64_t min, int min_inclusive, int64_t max, int max_inclusive, int(^block)(nodeid_t id));
 int triplestore_match_triple(triplestore_t* t, int64_t _s, int64_t _p, int64_t _o, int(^block)(triplestore_t* t, nodeid_t s, nodeid_t p, nodeid_t o));
 int triplestore_bgp_match(triplestore_t* t, bgp_t* bgp, int variables, int(^block)(binding_t* final_match));
 
 void triplestore_print_bgp(triplestore_t* t, bgp_t* bgp, int variables, char** variable_names, FILE* f);
 int triplestore_print_term(triplestore_t* t, nodeid_t s, FILE* f, int newline);
+int triplestore_write_term(triplestore_t* t, nodeid_t s, FILE* f);
+int triplestore_cache_terms(triplestore_t* t);
+
+pcre_extra* triplestore_study_regex(const char* name, pcre* re);
+void triplestore_free_regex_study(pcre_extra* extra);
 
 // Queries
 query_t* triplestore_new_query(triplestore_t* t, int variables);
@@ -202,7 +310,10 @@ int64_t triplestore_query_add_variable(query_t* query, const char* name);
 int64_t triplestore_query_add_variable_n(query_t* query, const char* name, size_t name_len);
 int triplestore_query_add_op(query_t* query, query_type_t type, void* ptr);
 int triplestore_query_match(triplestore_t* t, query_t* query, int64_t limit, int(^block)(binding_t* final_match));
+int triplestore_query_match_bound(triplestore_t* t, query_t* query, const binding_t* bindings, int64_t limit, int(^block)(binding_t* final_match));
 int triplestore_query_get_max_variables(query_t* query);
+int triplestore_query_set_pool(query_t* query, triplestore_pool_t* pool);
+int triplestore_query_set_ordered(query_t* query, int ordered);
 void triplestore_print_query(triplestore_t* t, query_t* query, FILE* f);
 void triplestore_query_as_string_chunks(triplestore_t* t, query_t* query, void(^cb)(const char* line, size_t len));
 
@@ -213,6 +324,10 @@ int triplestore_bgp_set_triple_nodes(bgp_t* bgp, int triple, int64_t s, int64_t
 
 // Paths
 path_t* triplestore_new_path(triplestore_t* t, path_type_t type, int64_t start, nodeid_t pred, int64_t end);
+path_t* triplestore_new_path_predicate(triplestore_t* t, nodeid_t pred);
+path_t* triplestore_new_path_negated(triplestore_t* t, const nodeid_t* preds, uint32_t count);
+path_t* triplestore_new_path_operator(triplestore_t* t, path_type_t type, path_t* left, path_t* right);
+int triplestore_path_set_endpoints(path_t* path, int64_t start, int64_t end);
 int triplestore_free_path(path_t* path);
 int triplestore_path_match(triplestore_t* t, path_t* path, int variables, int(^block)(binding_t* final_match));
 
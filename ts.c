@@ -41,6 +41,7 @@ int main (int argc, char** argv) {
 		.constructing		= 0,
 		.language			= NULL,
 		.query				= NULL,
+		.pool				= NULL,
 		.set_error			= ^(int code, const char* message){
 			fprintf(stderr, "(%d) %s\n", code, message);
 		},
@@ -126,6 +127,9 @@ int main (int argc, char** argv) {
 	if (ctx.language) {
 		free(ctx.language);
 	}
+	if (ctx.pool) {
+		triplestore_free_pool(ctx.pool);
+	}
 	free_triplestore(t);
 	return 0;
 }